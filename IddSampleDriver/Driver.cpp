@@ -31,14 +31,18 @@ extern "C" DRIVER_INITIALIZE DriverEntry;
 LONG debug_level = LOG_LEVEL_TRACE;
 static int g_maxWidth = 1920;
 static int g_maxHeight = 1080;
+static int g_encode_threads = 0;
+static uint64_t g_encode_affinity = 0;
+static int g_coalesce_ms = COALESCE_WINDOW_MS;
+static int g_coalesce_tiles = COALESCE_MAX_TILES;
 
 
 
 VOID registry_config_base(void);
-int fetch_grab_surface(std::shared_ptr<Direct3DDevice> m_Device,ComPtr<IDXGIResource> AcquiredBuffer, uint8_t *fb_buf,D3D11_TEXTURE2D_DESC *);
 
 EVT_WDF_DRIVER_DEVICE_ADD IddSampleDeviceAdd;
 EVT_WDF_DEVICE_D0_ENTRY IddSampleDeviceD0Entry;
+EVT_WDF_DEVICE_D0_EXIT IddSampleDeviceD0Exit;
 EVT_WDF_DEVICE_PREPARE_HARDWARE IddSampleDevicePrepareHardware;
 EVT_WDF_DEVICE_RELEASE_HARDWARE IddSampleDeviceReleaseHardware;
 EVT_WDF_DEVICE_SURPRISE_REMOVAL IddSampleDeviceSurpriseRemoval;
@@ -107,6 +111,7 @@ NTSTATUS IddSampleDeviceAdd(WDFDRIVER Driver, PWDFDEVICE_INIT pDeviceInit)
     // Register for power callbacks - in this sample only power-on is needed
     WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&PnpPowerCallbacks);
     PnpPowerCallbacks.EvtDeviceD0Entry = IddSampleDeviceD0Entry;
+    PnpPowerCallbacks.EvtDeviceD0Exit = IddSampleDeviceD0Exit;
     PnpPowerCallbacks.EvtDevicePrepareHardware = IddSampleDevicePrepareHardware;
     PnpPowerCallbacks.EvtDeviceReleaseHardware = IddSampleDeviceReleaseHardware;
     PnpPowerCallbacks.EvtDeviceSurpriseRemoval = IddSampleDeviceSurpriseRemoval;
@@ -159,7 +164,6 @@ NTSTATUS IddSampleDeviceAdd(WDFDRIVER Driver, PWDFDEVICE_INIT pDeviceInit)
     pContext->UsbDevice = NULL;
     pContext->BulkReadPipe = NULL;
     pContext->BulkWritePipe = NULL;
-    pContext->purb_list = NULL;
 
     // Set default values
     pContext->config.w = 1920;
@@ -169,9 +173,24 @@ NTSTATUS IddSampleDeviceAdd(WDFDRIVER Driver, PWDFDEVICE_INIT pDeviceInit)
     pContext->config.fps = 30;  // Lower FPS for ACM bandwidth
     pContext->config.sample_only = 0;
     pContext->config.sleep =0;
+    pContext->config.features = 0;
+    pContext->config.panels = 1;
+    pContext->config.cache_slots = 0;
+    pContext->config.max_transfer = 0;
+    pContext->config.rx_buffer = 0;
+    pContext->config.rotation = 0;
+    pContext->config.decode_rate = 0;
 
     // Initialize error recovery and performance tracking
     tools_perf_stats_init(&pContext->perf_stats);
+    clock_sync_init(&pContext->clock);
+
+    // Encoder threads outlive swap-chains, one pool per device
+    pContext->encode_pool = new WorkPool(g_encode_threads, g_encode_affinity);
+    LOGI("Encode pool: %d threads\n", pContext->encode_pool->threads());
+    pContext->session = new TransportSession();
+    pContext->injector = nullptr;
+    pContext->purb_list = pContext->session->urb_list();
 
     return Status;
 }
@@ -186,6 +205,18 @@ NTSTATUS IddSampleDeviceD0Entry(WDFDEVICE Device, WDF_POWER_DEVICE_STATE Previou
     auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
     pContext->pContext->InitAdapter();
 
+    // Device messages (credits) arrive on the bulk IN pipe
+    usb_reader_start(Device);
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS IddSampleDeviceD0Exit(WDFDEVICE Device, WDF_POWER_DEVICE_STATE TargetState)
+{
+    UNREFERENCED_PARAMETER(TargetState);
+
+    usb_reader_stop(Device);
     return STATUS_SUCCESS;
 }
 
@@ -239,86 +270,155 @@ void IndirectDeviceContextWrapper::Cleanup()
 {
     delete pContext;
     pContext = nullptr;
+    if (injector != nullptr) {
+        usb_input_set_sink(session->transport(), NULL, NULL);
+        delete injector;
+        injector = nullptr;
+    }
+    delete session;
+    session = nullptr;
+    delete encode_pool;
+    encode_pool = nullptr;
 }
 #define  SURFACE_LOG_DEBUG()  do { ; } while (0)
-int fetch_grab_surface(std::shared_ptr<Direct3DDevice> m_Device, ComPtr<IDXGIResource> AcquiredBuffer, uint8_t* fb_buf, D3D11_TEXTURE2D_DESC* pframeDescriptor)
+IddSwapChainSource::IddSwapChainSource(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, HANDLE hAvailableBufferEvent, HANDLE hTerminateEvent)
+    : m_hSwapChain(hSwapChain), m_Device(Device), m_hAvailableBufferEvent(hAvailableBufferEvent), m_hTerminateEvent(hTerminateEvent), m_staging_desc{}
+{
+}
+
+int IddSwapChainSource::acquire()
 {
+    IDARG_OUT_RELEASEANDACQUIREBUFFER Buffer = {};
+    HRESULT hr = IddCxSwapChainReleaseAndAcquireBuffer(m_hSwapChain, &Buffer);
+
+    if (hr == E_PENDING) {
+        return SWAPCHAIN_PENDING;
+    }
+    if (FAILED(hr)) {
+        LOGE("Swap-chain abandoned, exiting loop: 0x%x\n", hr);
+        return SWAPCHAIN_LOST;
+    }
+    m_buffer.Attach(Buffer.MetaData.pSurface);
+    return SWAPCHAIN_FRAME;
+}
+
+bool IddSwapChainSource::wait(int timeout_ms)
+{
+    HANDLE WaitHandles[] = {
+        m_hAvailableBufferEvent,
+        m_hTerminateEvent
+    };
+    DWORD WaitResult = WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, timeout_ms);
+
+    if (WaitResult == WAIT_OBJECT_0 || WaitResult == WAIT_TIMEOUT) {
+        return true;
+    }
+    if (WaitResult == WAIT_OBJECT_0 + 1) {
+        LOGE("SwapChainProcessor termination requested\n");
+    } else {
+        LOGE("WaitForMultipleObjects failed: 0x%x\n", HRESULT_FROM_WIN32(WaitResult));
+    }
+    return false;
+}
+
+// Queue the copy of the acquired surface into the staging texture, which is
+// kept while the mode stays the same
+bool IddSwapChainSource::copy(int* width, int* height)
+{
+    ComPtr<ID3D11Texture2D> AcquiredImage;
     HRESULT hr;
-    ID3D11Texture2D* pAcquiredImage = NULL;
-    ID3D11Texture2D* pStagingTexture = NULL;
-    IDXGISurface* pStagingSurface = NULL;
-    int result = -1;
 
     SURFACE_LOG_DEBUG();
-    hr = AcquiredBuffer->QueryInterface(__uuidof(ID3D11Texture2D), reinterpret_cast<void**>(&pAcquiredImage));
+    hr = m_buffer.As(&AcquiredImage);
     if (FAILED(hr)) {
         LOGE("Failed to query ID3D11Texture2D: 0x%x\n", hr);
-        goto cleanup;
+        return false;
     }
-    SURFACE_LOG_DEBUG();
     D3D11_TEXTURE2D_DESC srcDesc;
-    pAcquiredImage->GetDesc(&srcDesc);
+    AcquiredImage->GetDesc(&srcDesc);
+
+    if (m_staging == nullptr || m_staging_desc.Width != srcDesc.Width || m_staging_desc.Height != srcDesc.Height || m_staging_desc.Format != srcDesc.Format) {
+        D3D11_TEXTURE2D_DESC stagingDesc = srcDesc;
+        stagingDesc.Usage = D3D11_USAGE_STAGING;
+        stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        stagingDesc.BindFlags = 0;
+        stagingDesc.MiscFlags = 0;
+        stagingDesc.MipLevels = 1;
+        stagingDesc.ArraySize = 1;
+        stagingDesc.SampleDesc.Count = 1;
+
+        m_staging.Reset();
+        hr = m_Device->Device->CreateTexture2D(&stagingDesc, NULL, &m_staging);
+        if (FAILED(hr)) {
+            LOGE("Failed to create staging texture: 0x%x\n", hr);
+            return false;
+        }
+        m_staging_desc = stagingDesc;
+    }
 
     SURFACE_LOG_DEBUG();
-    D3D11_TEXTURE2D_DESC stagingDesc = srcDesc;
-    stagingDesc.Usage = D3D11_USAGE_STAGING;
-    stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    stagingDesc.BindFlags = 0;
-    stagingDesc.MiscFlags = 0;
-    stagingDesc.MipLevels = 1;
-    stagingDesc.ArraySize = 1;
-    stagingDesc.SampleDesc.Count = 1;
-
-    *pframeDescriptor = stagingDesc;
-    SURFACE_LOG_DEBUG();
-    hr = m_Device->Device->CreateTexture2D(&stagingDesc, NULL, &pStagingTexture);
+    m_Device->DeviceContext->CopyResource(m_staging.Get(), AcquiredImage.Get());
+    *width = (int)m_staging_desc.Width;
+    *height = (int)m_staging_desc.Height;
+    return true;
+}
+
+// The copy is queued, the OS only needs the commands using the surface submitted
+bool IddSwapChainSource::release()
+{
+    m_buffer.Reset();
+    HRESULT hr = IddCxSwapChainFinishedProcessingFrame(m_hSwapChain);
     if (FAILED(hr)) {
-        LOGE("Failed to create staging texture: 0x%x\n", hr);
-        goto cleanup;
+        LOGE("Failed to finish processing frame: 0x%x\n", hr);
+        return false;
     }
+    return true;
+}
 
-    SURFACE_LOG_DEBUG();
-    m_Device->DeviceContext->CopyResource(pStagingTexture, pAcquiredImage);
+// Map waits for the queued copy
+bool IddSwapChainSource::read(uint8_t* fb_buf)
+{
+    ComPtr<IDXGISurface> StagingSurface;
+    DXGI_MAPPED_RECT mappedRect;
+    HRESULT hr;
 
     SURFACE_LOG_DEBUG();
-    hr = pStagingTexture->QueryInterface(__uuidof(IDXGISurface), reinterpret_cast<void**>(&pStagingSurface));
+    hr = m_staging.As(&StagingSurface);
     if (FAILED(hr)) {
         LOGE("Failed to query IDXGISurface: 0x%x\n", hr);
-        goto cleanup;
+        return false;
     }
-
-    SURFACE_LOG_DEBUG();
-    DXGI_MAPPED_RECT mappedRect;
-    hr = pStagingSurface->Map(&mappedRect, DXGI_MAP_READ);
+    hr = StagingSurface->Map(&mappedRect, DXGI_MAP_READ);
     if (FAILED(hr)) {
         LOGE("Failed to map staging surface: 0x%x\n", hr);
-        goto cleanup;
+        return false;
     }
 
     SURFACE_LOG_DEBUG();
-    LOGI("fb_buf=%p, pBits=%p, Width=%d, Height=%d, Pitch=%d\n",fb_buf, mappedRect.pBits, stagingDesc.Width, stagingDesc.Height, mappedRect.Pitch);
+    LOGI("fb_buf=%p, pBits=%p, Width=%d, Height=%d, Pitch=%d\n",fb_buf, mappedRect.pBits, m_staging_desc.Width, m_staging_desc.Height, mappedRect.Pitch);
 
-    const int expected_pitch = stagingDesc.Width * 4;
+    const int expected_pitch = m_staging_desc.Width * 4;
     if (mappedRect.Pitch == expected_pitch) {
-        LOGI("Fast copy path: size=%d\n", stagingDesc.Width * stagingDesc.Height * 4);
-        memcpy(fb_buf, mappedRect.pBits, stagingDesc.Width * stagingDesc.Height * 4);
+        LOGI("Fast copy path: size=%d\n", m_staging_desc.Width * m_staging_desc.Height * 4);
+        memcpy(fb_buf, mappedRect.pBits, m_staging_desc.Width * m_staging_desc.Height * 4);
     } else {
         LOGI("Row-by-row copy: expected_pitch=%d\n", expected_pitch);
-        for (UINT i = 0; i < stagingDesc.Height; i++) {
+        for (UINT i = 0; i < m_staging_desc.Height; i++) {
             memcpy(&fb_buf[expected_pitch * i],&mappedRect.pBits[mappedRect.Pitch * i],expected_pitch);
         }
     }
 
     SURFACE_LOG_DEBUG();
-    pStagingSurface->Unmap();
-    result = 0;
+    StagingSurface->Unmap();
+    return true;
+}
 
-cleanup:
-    if (pStagingSurface) pStagingSurface->Release();
-    if (pStagingTexture) pStagingTexture->Release();
-    if (pAcquiredImage) pAcquiredImage->Release();
+static BOOL registry_read_dword(HKEY hKey, LPCTSTR name, DWORD* value)
+{
+    DWORD dwType = REG_DWORD;
+    DWORD dwSize = sizeof(*value);
 
-    return result;
+    return RegQueryValueEx(hKey, name, NULL, &dwType, (LPBYTE)value, &dwSize) == ERROR_SUCCESS && dwType == REG_DWORD;
 }
 
 VOID registry_config_base(void)
@@ -334,31 +434,38 @@ VOID registry_config_base(void)
         &hKey);
 
     if (result == ERROR_SUCCESS) {
-        DWORD dwType = REG_DWORD;
         DWORD dwValue = 0;
-        DWORD dwSize = sizeof(dwValue);
-
-        result = RegQueryValueEx(
-            hKey,
-            TEXT("debug_level"),
-            NULL,
-            &dwType,
-            (LPBYTE)&dwValue,
-            &dwSize);
 
-        if (result == ERROR_SUCCESS) {
+        if (registry_read_dword(hKey, TEXT("debug_level"), &dwValue)) {
             debug_level = (LONG)dwValue;
             LOGI("Loaded debug_level from registry: %d\n", debug_level);
         } else {
             LOGI("debug_level not found in registry, using default\n");
         }
 
+        // Encode pool: threads per frame (0 = one per CPU) and CPU mask hint
+        if (registry_read_dword(hKey, TEXT("encode_threads"), &dwValue)) {
+            g_encode_threads = (int)dwValue;
+        }
+        if (registry_read_dword(hKey, TEXT("encode_affinity"), &dwValue)) {
+            g_encode_affinity = dwValue;
+        }
+
+        // Coalescing window (ms, 0 = off) and the largest damage it holds back (tiles)
+        if (registry_read_dword(hKey, TEXT("coalesce_ms"), &dwValue)) {
+            g_coalesce_ms = (int)dwValue;
+        }
+        if (registry_read_dword(hKey, TEXT("coalesce_tiles"), &dwValue)) {
+            g_coalesce_tiles = (int)dwValue;
+        }
+
         RegCloseKey(hKey);
     } else {
         LOGI("Could not open registry key: %s\n", REGISTRY_PATH);
     }
 
-    LOGI("Registry config loaded, debug_level=%d\n", debug_level);
+    LOGI("Registry config loaded, debug_level=%d encode_threads=%d affinity=0x%llx coalesce=%dms/%d tiles\n", debug_level,
+         g_encode_threads, g_encode_affinity, g_coalesce_ms, g_coalesce_tiles);
 }
 
 #pragma endregion
@@ -366,12 +473,14 @@ VOID registry_config_base(void)
 
 #pragma region SwapChainProcessor
 
-SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, WDFDEVICE WdfDevice, HANDLE NewFrameEvent)
-    : m_hSwapChain(hSwapChain), m_Device(Device), mp_WdfDevice(WdfDevice), m_hAvailableBufferEvent(NewFrameEvent),m_pEncoder(nullptr), urb_list{}, max_out_pkg_size(0), fb_buf{}
+SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, IDDCX_MONITOR hMonitor, int index, std::shared_ptr<Direct3DDevice> Device, WDFDEVICE WdfDevice, HANDLE NewFrameEvent)
+    : m_hSwapChain(hSwapChain), m_hMonitor(hMonitor), m_index(index), m_Device(Device), mp_WdfDevice(WdfDevice), m_hAvailableBufferEvent(NewFrameEvent),m_pEncoder(nullptr), m_damage{}, m_motion{}, m_cache{}, m_refine{}, m_video{}, m_video_sent_us(0), m_rate{}, m_pace_fps(0), m_pacer{}, m_pacer_clock{}, m_jit{}, m_coalesce{}, m_held{}, m_coalesced(false), m_telemetry_seen(0), m_ping_seq(0), m_ping_sent_us(0), m_cursor{}, m_cursor_shape_id(0), m_cursor_slot(0), m_cursor_pending(false), m_updates{}, urb_list(nullptr), m_sched(nullptr), m_transport(nullptr), max_out_pkg_size(0), fb_buf(nullptr), m_capture_slot(-1), m_capture_time_us(0), m_capture_start_us(0), m_stop(false), m_resync(false), m_last_stores(false)
 {
     auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(WdfDevice);
-    pContext->purb_list = &urb_list;
-    
+    urb_list = pContext->session->urb_list();
+    m_sched = pContext->session->scheduler();
+    m_transport = pContext->session->transport();
+
     m_hTerminateEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
     // Immediately create and run the swap-chain processing thread, passing 'this' as the thread parameter
     m_hThread.Attach(CreateThread(nullptr, 0, RunThread, this, 0, nullptr));
@@ -382,10 +491,8 @@ SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, std::shared_p
 SwapChainProcessor::~SwapChainProcessor()
 {
     // Alert the swap-chain processing thread to terminate
-    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(this->mp_WdfDevice);
     SetEvent(m_hTerminateEvent.Get());
-    pContext->purb_list = NULL;
-    
+
     if (m_hThread.Get()) {
         // Wait for the thread to terminate
         WaitForSingleObject(m_hThread.Get(), INFINITE);
@@ -410,14 +517,33 @@ void SwapChainProcessor::Run()
     // Initialize USB transfers with screen dimensions from USB config
     auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
 
-    m_pEncoder = new ImageEncoder(pContext->config.img_type, pContext->config.img_qlt);
-    if(usb_resouce_init(&urb_list, pContext->config.w, pContext->config.h) >=0 ) {
-        // Main processing loop
+    // The session keeps the encoder and URB buffers of the last swap-chain
+    m_pEncoder = pContext->session->encoder(m_index, pContext->config.img_type, pContext->config.img_qlt);
+    m_pEncoder->set_jpeg_profile(pContext->config.jpeg_profile, pContext->config.decode_buffer);
+    // Full-frame clients cannot composite rects, reuse unchanged JPEG rows instead
+    m_pEncoder->set_row_cache(!(pContext->config.features & DEV_FEATURE_RECT));
+    m_pEncoder->set_region_tags((pContext->config.features & DEV_FEATURE_REGION) != 0);
+    m_pEncoder->set_packet_version((pContext->config.features & DEV_FEATURE_FRAME_V2) ? 2 : 1);
+    m_pEncoder->set_timestamps((pContext->config.features & DEV_FEATURE_TIMESTAMP) != 0);
+    m_pEncoder->set_pool(pContext->encode_pool);
+    rate_ctrl_init(&m_rate, pContext->config.img_qlt, pContext->config.fps);
+    m_pace_fps = m_rate.fps;
+    coalesce_init(&m_coalesce, g_coalesce_ms, g_coalesce_tiles);
+    perf_stats_t stats;
+    tools_perf_stats_snapshot(&pContext->perf_stats, &stats);
+    m_telemetry_seen = stats.telemetry_reports;
+    if (pContext->session->open(pContext->config.w, pContext->config.h)) {
+        // Main processing loop, sharing the link with the other monitors
+        m_sched->attach(m_index);
         main_function();
+        m_sched->detach(m_index);
     }
-    usb_resouce_distory(&urb_list);
 
-    delete m_pEncoder;
+    damage_exit(&m_damage);
+    motion_exit(&m_motion);
+    tile_cache_exit(&m_cache);
+    refine_exit(&m_refine);
+    video_exit(&m_video);
     m_pEncoder = nullptr;
     // Always delete the swap-chain object when swap-chain processing loop terminates in order to kick the system to
     // provide a new swap-chain if necessary.
@@ -428,7 +554,806 @@ void SwapChainProcessor::Run()
 }
 
 
+// The device missed an update, resend everything with the next frame
+void SwapChainProcessor::reset_update_state()
+{
+    damage_invalidate(&m_damage);
+    motion_reset(&m_motion);
+    tile_cache_reset(&m_cache);
+}
+
+// Adapt JPEG quality and pacing to the latest device telemetry
+void SwapChainProcessor::apply_telemetry()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    perf_stats_t stats;
+
+    // The USB reader updates the telemetry fields together
+    tools_perf_stats_snapshot(&pContext->perf_stats, &stats);
+    if (stats.telemetry_reports == m_telemetry_seen) {
+        return;
+    }
+    m_telemetry_seen = stats.telemetry_reports;
+
+    if (rate_ctrl_update(&m_rate, stats.avg_dev_decode_us, stats.dev_rx_fill_pct, stats.dev_refresh_us)) {
+        m_pEncoder->set_quality(m_rate.quality);
+        m_pace_fps = m_rate.fps;
+        LOGI("Rate control: quality %d fps %d (device decode %lldus, rx fill %d%%)\n",
+             m_rate.quality, m_rate.fps, stats.avg_dev_decode_us, stats.dev_rx_fill_pct);
+    }
+}
+
+// Clock sync ping every CLOCK_PING_INTERVAL_MS, in a transfer of its own so the
+// device answers before decoding anything
+void SwapChainProcessor::send_ping()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    const int64_t now_us = tools_get_time_us();
+
+    // One clock per device, the first monitor keeps it in sync
+    if (!(pContext->config.features & DEV_FEATURE_TIMESTAMP) || m_index != 0 || now_us - m_ping_sent_us < CLOCK_PING_INTERVAL_MS * 1000) {
+        return;
+    }
+
+    urb_item_t* purb = (urb_item_t*)InterlockedPopEntrySList(urb_list);
+    if (purb == NULL) {
+        return;
+    }
+
+    const int header_size = control_header_size();
+    int len = m_pEncoder->encode_ping(purb->urb_msg + header_size, purb->urb_msg_size - header_size, m_ping_seq++, tools_get_time_us());
+    if (send_control(purb, len)) {
+        m_ping_sent_us = now_us;
+    }
+}
+
+// Offset of the packets in a control transfer: room for the v2 container header
+int SwapChainProcessor::control_header_size() const
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    return (pContext->config.features & DEV_FEATURE_FRAME_V2) ? sizeof(frame_v2_header_t) : 0;
+}
+
+// Panel select packet in front of the packets of a transfer, multi-panel devices only
+int SwapChainProcessor::encode_panel(uint8_t* output, int buffer_size)
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    return pContext->config.panels > 1 ? m_pEncoder->encode_panel(output, buffer_size, m_index) : 0;
+}
+
+// Send the body_len bytes of packets at control_header_size() of purb as a
+// transfer of its own. Control transfers (pings, cursor) hold no flow control
+// credit, v2 devices get them in a container without FRAME_FLAG_COMPLETE.
+// They leave from the encode thread while the send thread submits frames,
+// usb_send_data_async keeps the two streams apart on the wire.
+// The URB goes back to the pool in any case.
+bool SwapChainProcessor::send_control(urb_item_t* purb, int body_len)
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    const int header_size = control_header_size();
+    int total_bytes = body_len;
+
+    purb->has_credit = FALSE;
+    if (total_bytes > 0 && header_size > 0) {
+        total_bytes = frame_packet_finish(purb->urb_msg, total_bytes, m_pEncoder->get_counter() - 1, 0, 0, 0, 0);
+    }
+    if (total_bytes <= 0) {
+        InterlockedPushEntrySList(urb_list, &(purb->node));
+        return false;
+    }
+    return NT_SUCCESS(usb_send_data_async(purb, pContext->BulkWritePipe, total_bytes));
+}
+
+// Let the OS hand us the cursor instead of drawing it into the desktop image.
+// Must follow IddCxSwapChainSetDevice.
+void SwapChainProcessor::setup_cursor()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+
+    if (!(pContext->config.features & DEV_FEATURE_CURSOR) || m_hMonitor == nullptr) {
+        return;
+    }
+
+    m_hCursorEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    if (!m_hCursorEvent.IsValid()) {
+        return;
+    }
+    m_cursor_buf.resize(CURSOR_MAX_SIZE * CURSOR_MAX_SIZE * 4);
+    cursor_cache_reset(&m_cursor);
+    m_cursor_shape_id = 0;
+
+    IDDCX_CURSOR_CAPS CursorCaps = {};
+    CursorCaps.Size = sizeof(CursorCaps);
+    CursorCaps.ColorXorCursorSupport = IDDCX_XOR_CURSOR_SUPPORT_FULL;
+    CursorCaps.AlphaCursorSupport = TRUE;
+    CursorCaps.MaxX = CURSOR_MAX_SIZE;
+    CursorCaps.MaxY = CURSOR_MAX_SIZE;
+
+    IDARG_IN_SETUP_HWCURSOR SetupCursor = {};
+    SetupCursor.CursorInfo = CursorCaps;
+    SetupCursor.hNewCursorDataAvailable = m_hCursorEvent.Get();
+
+    NTSTATUS status = IddCxMonitorSetupHardwareCursor(m_hMonitor, &SetupCursor);
+    if (!NT_SUCCESS(status)) {
+        // The OS keeps drawing the cursor into the frames
+        LOGW("IddCxMonitorSetupHardwareCursor failed 0x%x, software cursor\n", status);
+        m_hCursorEvent.Close();
+    }
+}
+
+// Send the current cursor position, preceded by its shape if the device cache
+// does not hold it. Position updates skip the frame pipeline and its credits,
+// a busy URB pool leaves the update pending for the next loop iteration.
+void SwapChainProcessor::send_cursor()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+
+    urb_item_t* purb = (urb_item_t*)InterlockedPopEntrySList(urb_list);
+    if (purb == NULL) {
+        m_cursor_pending = true;
+        return;
+    }
+    m_cursor_pending = false;
+
+    IDARG_IN_QUERY_HWCURSOR QueryIn = {};
+    QueryIn.LastShapeId = m_cursor_shape_id;
+    QueryIn.ShapeBufferSizeInBytes = (UINT)m_cursor_buf.size();
+    QueryIn.pShapeBuffer = m_cursor_buf.data();
+    IDARG_OUT_QUERY_HWCURSOR QueryOut = {};
+    NTSTATUS status = IddCxMonitorQueryHardwareCursor(m_hMonitor, &QueryIn, &QueryOut);
+    if (!NT_SUCCESS(status)) {
+        LOGW("IddCxMonitorQueryHardwareCursor failed 0x%x\n", status);
+        InterlockedPushEntrySList(urb_list, &(purb->node));
+        return;
+    }
+
+    const int header_size = control_header_size();
+    uint8_t* body = purb->urb_msg + header_size;
+    const int body_size = purb->urb_msg_size - header_size;
+    int body_len = encode_panel(body, body_size);
+    bool shape_sent = false;
+
+    if (QueryOut.IsCursorShapeUpdated) {
+        const IDDCX_CURSOR_SHAPE_INFO& info = QueryOut.CursorShapeInfo;
+        const int type = info.CursorType == IDDCX_CURSOR_SHAPE_TYPE_MASKED_COLOR ? CURSOR_SHAPE_MASKED : CURSOR_SHAPE_ALPHA;
+        const uint64_t hash = cursor_shape_hash(type, info.XHot, info.YHot, info.Width, info.Height, info.Pitch, m_cursor_buf.data());
+
+        if (!cursor_cache_lookup(&m_cursor, hash, &m_cursor_slot)) {
+            const int len = m_pEncoder->encode_cursor_shape(body + body_len, body_size - body_len, m_cursor_slot, type, info.XHot, info.YHot,
+                                                            info.Width, info.Height, info.Pitch, m_cursor_buf.data());
+            if (len <= 0) {
+                LOGW("Cursor shape %ux%u not sent\n", info.Width, info.Height);
+                cursor_cache_reset(&m_cursor);
+                InterlockedPushEntrySList(urb_list, &(purb->node));
+                return;
+            }
+            body_len += len;
+            shape_sent = true;
+        }
+    }
+    body_len += m_pEncoder->encode_cursor_pos(body + body_len, body_size - body_len, QueryOut.X, QueryOut.Y,
+                                              m_cursor_slot, QueryOut.IsCursorVisible != FALSE);
+
+    if (!send_control(purb, body_len)) {
+        // The device may not hold the shape, resend it with the next update
+        cursor_cache_reset(&m_cursor);
+        m_cursor_shape_id = 0;
+        m_cursor_pending = true;
+        return;
+    }
+    if (QueryOut.IsCursorShapeUpdated) {
+        m_cursor_shape_id = QueryOut.CursorShapeInfo.ShapeId;
+    }
+    PERF_STATS_ADD(&pContext->perf_stats, cursor_moves, 1);
+    if (shape_sent) {
+        PERF_STATS_ADD(&pContext->perf_stats, cursor_shapes, 1);
+    }
+}
+
+// Encode the frame in fb_buf into purb, returns the transfer size (0 = nothing changed).
+// Devices with DEV_FEATURE_COMMIT get the packets between frame begin/commit
+// markers, devices with DEV_FEATURE_FRAME_V2 get them in one frame_v2_header_t
+// container. Both carry the img_cnt of the first packet as frame sequence.
+int SwapChainProcessor::encode_frame(urb_item_t* purb, int width, int height, int64_t capture_us)
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    const bool frame_v2 = (pContext->config.features & DEV_FEATURE_FRAME_V2) != 0;
+    const bool commit = (pContext->config.features & DEV_FEATURE_COMMIT) != 0;
+    const int header_size = frame_v2 ? sizeof(frame_v2_header_t) : 0;
+    const _u32 frame_seq = m_pEncoder->get_counter();
+    uint8_t* body = purb->urb_msg + header_size;
+    const int body_size = purb->urb_msg_size - header_size;
+    int body_len;
+
+    m_pEncoder->set_capture_time(capture_us);
+    body_len = encode_panel(body, body_size);
+    if (commit) {
+        body_len += m_pEncoder->encode_frame_begin(body + body_len, body_size - body_len, width, height);
+    }
+
+    // img_cnt skips the begin marker of an unchanged frame, devices only check within a frame
+    int len = encode_updates(body + body_len, body_size - body_len, width, height);
+    if (len <= 0) {
+        return 0;
+    }
+    body_len += len;
+
+    if (commit) {
+        len = m_pEncoder->encode_frame_commit(body + body_len, body_size - body_len, width, height);
+        if (len <= 0) {
+            LOGW("No room for frame commit, dropping frame\n");
+            reset_update_state();
+            return 0;
+        }
+        body_len += len;
+    }
+
+    if (!frame_v2) {
+        return body_len;
+    }
+
+    int total_bytes = frame_packet_finish(purb->urb_msg, body_len, frame_seq, FRAME_FLAG_COMPLETE, width, height, capture_us);
+    if (total_bytes < 0) {
+        LOGE("Malformed v2 frame body, %d bytes\n", body_len);
+        reset_update_state();
+        return 0;
+    }
+    return total_bytes;
+}
+
+// Encode the frame in fb_buf into output as a list of packets, returns their size.
+// Devices with DEV_FEATURE_RECT get only the dirty tiles, merged into rectangles;
+// with DEV_FEATURE_MOVE rigid moves (window drags) are sent as move commands and
+// with a device tile cache, tiles seen before are drawn from their cache slot.
+// With DEV_FEATURE_REFINE, JPEG rects are refined while the link is idle: tiles
+// static for REFINE_STATIC_FRAMES are resent at high quality, then losslessly.
+// Tiles that keep changing (video) are sent at VIDEO_JPEG_QUALITY, at most
+// VIDEO_MAX_FPS times per second.
+// Damage of a few tiles is held back for the coalescing window, see coalesce_ctx_t.
+// Packet order: move, cache draws, rects, video rects, cache stores, refinement rects.
+int SwapChainProcessor::encode_updates(uint8_t* output_buf, int output_size, int width, int height)
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    const int stride = width * 4;
+    int total_bytes = 0;
+    disp_rect_t rects[DAMAGE_MAX_RECTS];
+
+    if (!(pContext->config.features & DEV_FEATURE_RECT)) {
+        return m_pEncoder->encode(output_buf, fb_buf, output_size, 0, 0, width, height);
+    }
+    m_last_damage.clear();
+    m_last_stores = false;
+
+    if (m_damage.width != width || m_damage.height != height) {
+        damage_exit(&m_damage);
+        motion_exit(&m_motion);
+        if (damage_init(&m_damage, width, height) < 0) {
+            LOGE("damage_init %dx%d failed, sending full frame\n", width, height);
+            return m_pEncoder->encode(output_buf, fb_buf, output_size, 0, 0, width, height);
+        }
+        if ((pContext->config.features & DEV_FEATURE_MOVE) && motion_init(&m_motion, width, height) < 0) {
+            LOGW("motion_init %dx%d failed, move detection disabled\n", width, height);
+        }
+        if (pContext->config.cache_slots > 0 && m_cache.slots == 0 &&
+            tile_cache_init(&m_cache, pContext->config.cache_slots) < 0) {
+            LOGW("tile_cache_init %d slots failed, tile cache disabled\n", pContext->config.cache_slots);
+        }
+        refine_exit(&m_refine);
+        if ((pContext->config.features & DEV_FEATURE_REFINE) && pContext->config.img_type == IMAGE_TYPE_JPG &&
+            refine_init(&m_refine, m_damage.tiles_x * m_damage.tiles_y) < 0) {
+            LOGW("refine_init failed, progressive refinement disabled\n");
+        }
+        video_exit(&m_video);
+        if (video_init(&m_video, m_damage.tiles_x * m_damage.tiles_y) < 0) {
+            LOGW("video_init failed, video detection disabled\n");
+        }
+        m_cache_draws.resize(m_damage.tiles_x * m_damage.tiles_y);
+        m_cache_stores.resize(m_damage.tiles_x * m_damage.tiles_y);
+    }
+
+    update_list_reset(&m_updates);
+    damage_update(&m_damage, fb_buf, stride);
+    // Keep the tiles dirty for the frame that sends them
+    if (coalesce_defer(&m_coalesce, m_damage.dirty_count, tools_get_mono_us())) {
+        damage_merge(&m_damage, m_damage.dirty);
+        PERF_STATS_ADD(&pContext->perf_stats, coalesced_frames, 1);
+        m_coalesced = true;
+        return 0;
+    }
+    refine_update(&m_refine, &m_damage);
+    // Moves and cache draws clear tiles from the dirty map, keep what changed for withdraw_stale
+    m_last_damage.assign(m_damage.dirty, m_damage.dirty + m_damage.tiles_x * m_damage.tiles_y);
+
+    int moved = motion_detect(&m_motion, &m_damage, fb_buf, stride, &m_updates);
+    if (moved > 0) {
+        PERF_STATS_ADD(&pContext->perf_stats, move_cmds, 1);
+        PERF_STATS_ADD(&pContext->perf_stats, moved_tiles, moved);
+    }
+
+    int draws = tile_cache_match(&m_cache, &m_damage, m_cache_draws.data(), (int)m_cache_draws.size());
+
+    // Video tiles are taken out before cache stores, they rarely repeat
+    const int64_t now_us = tools_get_time_us();
+    const int video_due = VIDEO_MAX_FPS <= 0 || now_us - m_video_sent_us >= 1000000 / VIDEO_MAX_FPS;
+    int video = video_split(&m_video, &m_damage, video_due);
+    if (video > 0) {
+        m_video_sent_us = now_us;
+        PERF_STATS_ADD(&pContext->perf_stats, video_tiles, video);
+    }
+    PERF_STATS_ADD(&pContext->perf_stats, video_deferred, m_video.deferred);
+
+    int stores = tile_cache_store(&m_cache, &m_damage, m_cache_stores.data(), (int)m_cache_stores.size());
+    if (draws > 0) {
+        update_list_add_marker(&m_updates, UPDATE_CMD_CACHE_DRAW);
+        PERF_STATS_ADD(&pContext->perf_stats, cache_hits, draws);
+    }
+
+    int count = damage_collect_rects(&m_damage, rects, DAMAGE_MAX_RECTS);
+    for (int i = 0; i < count; i++) {
+        update_list_add_rect(&m_updates, &rects[i]);
+    }
+
+    if (video > 0) {
+        count = damage_collect_mask(&m_damage, m_video.select, rects, VIDEO_MAX_RECTS);
+        for (int i = 0; i < count; i++) {
+            update_list_add_video(&m_updates, &rects[i]);
+        }
+    }
+
+    if (stores > 0) {
+        update_list_add_marker(&m_updates, UPDATE_CMD_CACHE_STORE);
+        PERF_STATS_ADD(&pContext->perf_stats, cache_stores, stores);
+        m_last_stores = true;
+    }
+
+    if (m_refine.tiles > 0 && m_damage.dirty_count <= REFINE_IDLE_TILES) {
+        int level;
+        int refined = refine_select(&m_refine, &m_damage, REFINE_MAX_TILES, &level);
+        if (refined > 0) {
+            count = damage_collect_mask(&m_damage, m_refine.select, rects, DAMAGE_MAX_RECTS);
+            for (int i = 0; i < count; i++) {
+                update_list_add_refine(&m_updates, &rects[i], level);
+            }
+            for (size_t i = 0; i < m_last_damage.size(); i++) {
+                m_last_damage[i] |= m_refine.select[i];
+            }
+            PERF_STATS_ADD(&pContext->perf_stats, refined_tiles, refined);
+        }
+    }
+
+    if (m_updates.count == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < m_updates.count; i++) {
+        const update_cmd_t* cmd = &m_updates.cmd[i];
+        uint8_t* output = output_buf + total_bytes;
+        const int buffer_size = output_size - total_bytes;
+        int len;
+
+        m_pEncoder->set_region(cmd->region == UPDATE_REGION_VIDEO ? FRAME_REGION_VIDEO : FRAME_REGION_DESKTOP);
+        if (cmd->type == UPDATE_CMD_MOVE) {
+            len = m_pEncoder->encode_move(output, buffer_size, cmd->rect.x, cmd->rect.y, cmd->rect.w, cmd->rect.h, cmd->src_x, cmd->src_y);
+        } else if (cmd->type == UPDATE_CMD_CACHE_DRAW) {
+            len = m_pEncoder->encode_cache_refs(output, buffer_size, IMAGE_TYPE_CACHE_DRAW, m_cache_draws.data(), draws);
+        } else if (cmd->type == UPDATE_CMD_CACHE_STORE) {
+            len = m_pEncoder->encode_cache_refs(output, buffer_size, IMAGE_TYPE_CACHE_STORE, m_cache_stores.data(), stores);
+        } else if (cmd->level == REFINE_LEVEL_HIGH) {
+            len = m_pEncoder->encode_rect_as(IMAGE_TYPE_JPG, REFINE_HIGH_QUALITY, output, fb_buf, stride, buffer_size, cmd->rect.x, cmd->rect.y, cmd->rect.w, cmd->rect.h);
+        } else if (cmd->level == REFINE_LEVEL_LOSSLESS) {
+            len = m_pEncoder->encode_rect_as(IMAGE_TYPE_RGB888, 0, output, fb_buf, stride, buffer_size, cmd->rect.x, cmd->rect.y, cmd->rect.w, cmd->rect.h);
+        } else if (cmd->region == UPDATE_REGION_VIDEO && pContext->config.img_type == IMAGE_TYPE_JPG) {
+            const int quality = pContext->config.img_qlt < VIDEO_JPEG_QUALITY ? pContext->config.img_qlt : VIDEO_JPEG_QUALITY;
+            len = m_pEncoder->encode_rect_as(IMAGE_TYPE_JPG, quality, output, fb_buf, stride, buffer_size, cmd->rect.x, cmd->rect.y, cmd->rect.w, cmd->rect.h);
+        } else {
+            len = m_pEncoder->encode_rect(output, fb_buf, stride, buffer_size, cmd->rect.x, cmd->rect.y, cmd->rect.w, cmd->rect.h);
+        }
+
+        if (len <= 0 && cmd->level > 0) {
+            // Refinement is optional, retry the remaining tiles on a later frame
+            for (; i < m_updates.count; i++) {
+                refine_cancel(&m_refine, &m_damage, &m_updates.cmd[i].rect);
+            }
+            break;
+        }
+        if (len <= 0) {
+            LOGW("Update %d/%d does not fit in URB, sending full frame\n", i, m_updates.count);
+            m_pEncoder->set_region(FRAME_REGION_DESKTOP);
+            total_bytes = m_pEncoder->encode(output_buf, fb_buf, output_size, 0, 0, width, height);
+            // Planned cache stores were not sent
+            tile_cache_reset(&m_cache);
+            refine_reset(&m_refine);
+            m_last_damage.assign(m_last_damage.size(), 1);
+            m_last_stores = false;
+            break;
+        }
+        total_bytes += len;
+    }
+    m_pEncoder->set_region(FRAME_REGION_DESKTOP);
+    LOGD("[Update] cmds:%d moved:%d cached:%d stored:%d video:%d size:%d\n", m_updates.count, moved, draws, stores, video, total_bytes);
+
+    motion_commit(&m_motion, &m_damage, fb_buf, stride);
+    return total_bytes;
+}
+
 #define MAIN_DEBUG_LOG()  // LOGI("%s.%d\n",__func__,__LINE__)
+DWORD CALLBACK SwapChainProcessor::RunEncodeThread(LPVOID Argument)
+{
+    reinterpret_cast<SwapChainProcessor*>(Argument)->encode_loop();
+    return 0;
+}
+
+DWORD CALLBACK SwapChainProcessor::RunSendThread(LPVOID Argument)
+{
+    reinterpret_cast<SwapChainProcessor*>(Argument)->send_loop();
+    return 0;
+}
+
+// Allocate the frame slots and start the encode and send stages
+bool SwapChainProcessor::start_pipeline()
+{
+    for (int i = 0; i < PIPELINE_FRAMES; i++) {
+        m_frames[i].resize(DISP_MAX_WIDTH * DISP_MAX_HEIGHT * 4);
+        m_free_frames.put(i);
+    }
+
+    m_stop = false;
+    m_resync = false;
+    m_held.slot = -1;
+    m_hFrameEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hSendEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    if (!m_hFrameEvent.IsValid() || !m_hSendEvent.IsValid()) {
+        LOGE("Pipeline events could not be created\n");
+        return false;
+    }
+
+    m_hEncodeThread.Attach(CreateThread(nullptr, 0, RunEncodeThread, this, 0, nullptr));
+    m_hSendThread.Attach(CreateThread(nullptr, 0, RunSendThread, this, 0, nullptr));
+    if (!m_hEncodeThread.IsValid() || !m_hSendThread.IsValid()) {
+        LOGE("Pipeline threads could not be created\n");
+        stop_pipeline();
+        return false;
+    }
+    return true;
+}
+
+// Stop the encode and send stages, URBs still queued go back to the pool
+void SwapChainProcessor::stop_pipeline()
+{
+    PipelineTransfer* transfer;
+    PipelineFrame frame;
+
+    m_stop = true;
+    if (m_hFrameEvent.IsValid()) SetEvent(m_hFrameEvent.Get());
+    if (m_hSendEvent.IsValid()) SetEvent(m_hSendEvent.Get());
+    if (m_hEncodeThread.IsValid()) {
+        WaitForSingleObject(m_hEncodeThread.Get(), INFINITE);
+        m_hEncodeThread.Close();
+    }
+    if (m_hSendThread.IsValid()) {
+        WaitForSingleObject(m_hSendThread.Get(), INFINITE);
+        m_hSendThread.Close();
+    }
+
+    transfer = m_outbox.take();
+    if (transfer != nullptr) {
+        release_transfer(transfer);
+    }
+    if (m_held.slot >= 0) {
+        m_free_frames.put(m_held.slot);
+        m_held.slot = -1;
+    }
+    while (m_captured.pop(frame)) {
+        m_free_frames.put(frame.slot);
+    }
+}
+
+// Encode stage: captured frames, cursor updates, pings and rate control
+void SwapChainProcessor::encode_loop()
+{
+    DWORD AvTask = 0;
+    HANDLE AvTaskHandle = AvSetMmThreadCharacteristicsW(L"Distribution", &AvTask);
+    PipelineFrame frame;
+
+    while (!m_stop) {
+        HANDLE WaitHandles[] = {
+            m_hFrameEvent.Get(),
+            m_hCursorEvent.Get()
+        };
+        const DWORD WaitCount = m_hCursorEvent.IsValid() ? 2 : 1;
+        DWORD timeout_ms = WAIT_TIMEOUT_MS;
+        if (m_held.slot >= 0) {
+            const int64_t left_us = coalesce_remaining(&m_coalesce, tools_get_mono_us());
+            timeout_ms = (DWORD)((left_us + 999) / 1000);
+        }
+        DWORD WaitResult = WaitForMultipleObjects(WaitCount, WaitHandles, FALSE, timeout_ms);
+        if (m_stop) {
+            break;
+        }
+
+        if (WaitResult == WAIT_OBJECT_0 + 1 || m_cursor_pending) {
+            send_cursor();
+        }
+        while (m_captured.pop(frame)) {
+            // A newer frame carries the held damage
+            if (m_held.slot >= 0) {
+                m_free_frames.put(m_held.slot);
+                m_held.slot = -1;
+            }
+            encode_captured(frame);
+        }
+        // Nothing else changed within the window, send the held damage alone
+        if (m_held.slot >= 0 && coalesce_remaining(&m_coalesce, tools_get_mono_us()) <= 0) {
+            frame = m_held;
+            m_held.slot = -1;
+            encode_captured(frame);
+        }
+        apply_telemetry();
+        send_ping();
+    }
+
+    AvRevertMmThreadCharacteristics(AvTaskHandle);
+}
+
+// Encode a frame, or keep its slot while the frame is held back for coalescing
+void SwapChainProcessor::encode_captured(const PipelineFrame& frame)
+{
+    if (encode_stage(frame)) {
+        m_held = frame;
+    } else {
+        m_free_frames.put(frame.slot);
+    }
+}
+
+// Encode one captured frame into a URB for the send stage, returns true if
+// its damage was held back instead
+bool SwapChainProcessor::encode_stage(const PipelineFrame& frame)
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    const bool independent = !(pContext->config.features & DEV_FEATURE_RECT);
+
+    // Dirty-rect frames build on each other, an unsent one is merged into this one.
+    // Full frames stand alone and simply replace it once encoded.
+    if (!independent) {
+        withdraw_stale();
+    }
+
+    // The device missed a transfer, damage tracking no longer matches its framebuffer
+    if (m_resync.exchange(false)) {
+        reset_update_state();
+    }
+
+    // The other monitors keep their share of the pool
+    if (!m_sched->hold_urb(m_index)) {
+        PERF_STATS_ADD(&pContext->perf_stats, dropped_frames, 1);
+        return false;
+    }
+    urb_item_t* purb = (urb_item_t*)InterlockedPopEntrySList(urb_list);
+    if (purb == NULL) {
+        LOGW("No URB available, frame dropped\n");
+        m_sched->drop_urb(m_index);
+        PERF_STATS_ADD(&pContext->perf_stats, dropped_frames, 1);
+        return false;
+    }
+
+    // The send stage takes the flow control credit, this thread also sends cursor and pings
+    purb->has_credit = FALSE;
+
+    MAIN_DEBUG_LOG();
+    const int64_t encode_start = tools_get_time_us();
+    m_coalesced = false;
+    fb_buf = m_frames[frame.slot].data();
+    int total_bytes = encode_frame(purb, frame.width, frame.height, frame.capture_us);
+    fb_buf = nullptr;
+    const int64_t encode_us = tools_get_time_us() - encode_start;
+    if (total_bytes == 0) {
+        // Nothing changed since the last update, or too little to send yet
+        InterlockedPushEntrySList(urb_list, &(purb->node));
+        m_sched->drop_urb(m_index);
+        return m_coalesced;
+    }
+    jit_add(&m_jit.encode, encode_us);
+
+    PipelineTransfer* transfer = &m_transfers[purb->id];
+    *transfer = { purb, total_bytes, frame.grab_us, encode_us, frame.slot_us, frame.predicted_slack_us };
+    PipelineTransfer* replaced = m_outbox.post(transfer);
+    if (replaced != nullptr) {
+        release_transfer(replaced);
+        PERF_STATS_ADD(&pContext->perf_stats, stale_frames, 1);
+    }
+    SetEvent(m_hSendEvent.Get());
+    return false;
+}
+
+// The send stage has not started the last encoded frame yet: take it back and
+// mark its damage dirty again, so the frame about to be encoded carries both.
+// Its moves and cache stores never reach the device either, so move detection
+// starts over and the cache mirror is dropped when it stored tiles.
+void SwapChainProcessor::withdraw_stale()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    PipelineTransfer* stale = m_outbox.take();
+
+    if (stale == nullptr) {
+        return;
+    }
+    release_transfer(stale);
+    PERF_STATS_ADD(&pContext->perf_stats, stale_frames, 1);
+
+    if (m_last_damage.size() == (size_t)(m_damage.tiles_x * m_damage.tiles_y)) {
+        damage_merge(&m_damage, m_last_damage.data());
+    } else {
+        damage_invalidate(&m_damage);
+    }
+    motion_reset(&m_motion);
+    if (m_last_stores) {
+        tile_cache_reset(&m_cache);
+    }
+}
+
+// Give an encoded URB that will not be sent back to the pool, it holds no credit yet
+void SwapChainProcessor::release_transfer(PipelineTransfer* transfer)
+{
+    InterlockedPushEntrySList(urb_list, &(transfer->purb->node));
+    m_sched->drop_urb(m_index);
+}
+
+// Send stage: submit the frame in the mailbox once it is this monitor's turn,
+// the device granted a credit and the link is free. Until then the encode
+// stage may replace it with a newer one, a frame queued behind a busy decoder
+// only adds latency.
+void SwapChainProcessor::send_loop()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    const DWORD credit_wait_ms = pContext->config.fps > 0 ? 1000 / pContext->config.fps : WAIT_TIMEOUT_MS;
+    DWORD AvTask = 0;
+    HANDLE AvTaskHandle = AvSetMmThreadCharacteristicsW(L"Distribution", &AvTask);
+    // Print performance stats every 1000 frames
+    const int stats_print_interval = 1000;
+
+    while (!m_stop) {
+        WaitForSingleObject(m_hSendEvent.Get(), WAIT_TIMEOUT_MS);
+
+        while (!m_stop && !m_outbox.empty()) {
+            if (!m_sched->acquire(m_index, WAIT_TIMEOUT_MS)) {
+                continue;
+            }
+            if (!usb_flow_acquire(m_transport, credit_wait_ms)) {
+                m_sched->release(m_index, 0);
+                PERF_STATS_ADD(&pContext->perf_stats, throttled_frames, 1);
+                continue;
+            }
+            if (!usb_send_wait(m_transport, PIPELINE_IN_FLIGHT, WAIT_TIMEOUT_MS)) {
+                usb_flow_release(m_transport);
+                m_sched->release(m_index, 0);
+                continue;
+            }
+            PipelineTransfer* pending = m_outbox.take();
+            if (pending == nullptr) {
+                // Withdrawn by the encode stage
+                usb_flow_release(m_transport);
+                m_sched->release(m_index, 0);
+                break;
+            }
+            // The entry belongs to the URB, which may be reused as soon as it is sent
+            const PipelineTransfer transfer = *pending;
+            transfer.purb->has_credit = TRUE;
+            m_sched->drop_urb(m_index);
+            const int id = transfer.purb->id;
+            const int64_t send_start = tools_get_time_us();
+            NTSTATUS ret = usb_send_data_async(transfer.purb, pContext->BulkWritePipe, transfer.size);
+            if (!NT_SUCCESS(ret)) {
+                LOGW("1.USB send failed with status 0x%x, attempting recovery, URB id=%d\n", ret, id);
+                // The URB and its credit went back already
+                m_resync = true;
+            }
+            m_sched->release(m_index, transfer.size);
+            const int64_t send_time = tools_get_time_us() - send_start;
+            const int64_t slack_us = transfer.slot_us - tools_get_mono_us();
+            jit_add(&m_jit.send, send_time);
+
+            LOGI("[Frame] id:%d size:%d grab:%lldus encode:%lldus send:%lldus slack:%lld/%lldus\n", id, transfer.size, transfer.grab_us, transfer.encode_us, send_time,
+                 transfer.predicted_slack_us, slack_us);
+
+            // Update performance statistics
+            const uint64_t frames = tools_perf_stats_update(&pContext->perf_stats, transfer.size, transfer.grab_us, transfer.encode_us, send_time, NT_SUCCESS(ret));
+            tools_perf_stats_slack(&pContext->perf_stats, transfer.predicted_slack_us, slack_us);
+
+            // Print stats periodically
+            if (frames % stats_print_interval == 0) {
+                tools_perf_stats_print(&pContext->perf_stats);
+            }
+        }
+    }
+
+    AvRevertMmThreadCharacteristics(AvTaskHandle);
+}
+
+// Stage timings reach m_jit from the capture, encode and send threads
+void SwapChainProcessor::jit_add(jit_estimate_t* estimate, int64_t us)
+{
+    std::lock_guard<std::mutex> guard(m_jit_lock);
+    jit_estimate_add(estimate, us);
+}
+
+// Consistent copy of the estimates for the capture schedule
+jit_sched_t SwapChainProcessor::jit_snapshot()
+{
+    std::lock_guard<std::mutex> guard(m_jit_lock);
+    return m_jit;
+}
+
+// Just in time: after a frame, sleep until its predicted cost before the next
+// send slot and take the newest buffer then, instead of sleeping on a captured one
+bool SwapChainProcessor::pace()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+
+    if (pContext->config.sleep > 0) {
+        LOGW("Sleep %dmS for debug \n", pContext->config.sleep * 100);
+        Sleep(pContext->config.sleep * 100);
+    } else {
+        int missed;
+        frame_pacer_set_fps(&m_pacer, m_pace_fps);
+        const jit_sched_t jit = jit_snapshot();
+        const int64_t jitter_us = frame_pacer_wait(&m_pacer, jit_sched_lead(&jit), &missed);
+        tools_perf_stats_pace(&pContext->perf_stats, jitter_us, missed);
+    }
+    return WaitForSingleObject(m_hTerminateEvent.Get(), 0) != WAIT_OBJECT_0;
+}
+
+// A free frame slot for the acquired surface, nullptr drops the frame
+uint8_t* SwapChainProcessor::begin_frame()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+
+    if (pContext->config.sample_only) {
+        LOGE("Frame dropped: sample_only=%d\n", pContext->config.sample_only);
+        PERF_STATS_ADD(&pContext->perf_stats, dropped_frames, 1);
+        return nullptr;
+    }
+
+    // Check USB state
+    if (!usb_is_connected(mp_WdfDevice)) {
+        LOGE("Usb is disconnected\n");
+        PERF_STATS_ADD(&pContext->perf_stats, dropped_frames, 1);
+        return nullptr;
+    }
+
+    if (!m_free_frames.take(m_capture_slot)) {
+        // The encode stage still holds every slot
+        LOGW("No frame slot available, frame dropped\n");
+        PERF_STATS_ADD(&pContext->perf_stats, dropped_frames, 1);
+        return nullptr;
+    }
+    m_capture_time_us = tools_get_time_us();
+    m_capture_start_us = tools_get_mono_us();
+    return m_frames[m_capture_slot].data();
+}
+
+void SwapChainProcessor::commit_frame(int width, int height)
+{
+    // Content that arrived after the planned start moves the slot with it
+    const jit_sched_t jit = jit_snapshot();
+    const int64_t lead_us = jit_sched_lead(&jit);
+    const int64_t slot_us = m_pacer.slot_us > m_capture_start_us + lead_us ? m_pacer.slot_us : m_capture_start_us + lead_us;
+    PipelineFrame frame = { m_capture_slot, width, height, m_capture_time_us, tools_get_time_us() - m_capture_time_us,
+                            slot_us, slot_us - m_capture_start_us - jit_sched_cost(&jit) };
+    jit_add(&m_jit.grab, frame.grab_us);
+    m_captured.push(frame);
+    SetEvent(m_hFrameEvent.Get());
+}
+
+void SwapChainProcessor::abort_frame()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+
+    // Kept on this thread for the next frame, the encode stage is the only producer of the queue
+    m_free_frames.give_back(m_capture_slot);
+    PERF_STATS_ADD(&pContext->perf_stats, error_frames, 1);
+}
+
+// Capture stage: copy each new surface into a free frame slot for the encode stage
 void SwapChainProcessor::main_function()
 {
     ComPtr<IDXGIDevice> DxgiDevice;
@@ -448,6 +1373,7 @@ void SwapChainProcessor::main_function()
         LOGE("Failed to set swap-chain device: error code =0x%x\n", hr);
         return;
     }
+    setup_cursor();
 
     // Set USB state to connected
     NTSTATUS status =usb_device_connect(mp_WdfDevice);
@@ -455,128 +1381,20 @@ void SwapChainProcessor::main_function()
 		LOGI("usb_device_connect failed 0x%x\n", status);
 		return ;
 	}
+    if (!start_pipeline()) {
+        return;
+    }
+    if (tools_pacer_clock_init(&m_pacer_clock) < 0) {
+        LOGW("No waitable timer, pacing falls back to Sleep\n");
+    }
+    frame_pacer_init(&m_pacer, &m_pacer_clock, m_pace_fps);
     LOGI("SwapChainProcessor started, FPS target: %d\n", pContext->config.fps);
 
-    // Print performance stats every 100 frames
-    const int stats_print_interval = 1000;
-    for (;;) {
-#if 1
-        ComPtr<IDXGIResource> AcquiredBuffer;
-        IDARG_OUT_RELEASEANDACQUIREBUFFER Buffer = {};
-        hr = IddCxSwapChainReleaseAndAcquireBuffer(m_hSwapChain, &Buffer);
-        MAIN_DEBUG_LOG();
-        if (hr == E_PENDING) {
-            HANDLE WaitHandles[] = {
-                m_hAvailableBufferEvent,
-                m_hTerminateEvent.Get()
-            };
-            MAIN_DEBUG_LOG();
-            DWORD WaitResult = WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, 16);
-
-            if (WaitResult == WAIT_OBJECT_0 || WaitResult == WAIT_TIMEOUT) {
-                MAIN_DEBUG_LOG();
-                continue;
-            }
-            else if (WaitResult == WAIT_OBJECT_0 + 1) {
-                LOGE("SwapChainProcessor termination requested\n");
-                break;
-            }
-            else {
-                hr = HRESULT_FROM_WIN32(WaitResult);
-                LOGE("WaitForMultipleObjects failed: 0x%x\n", hr);
-                break;
-            }
-        }
-        else if (SUCCEEDED(hr)) {
-            MAIN_DEBUG_LOG();
-            AcquiredBuffer.Attach(Buffer.MetaData.pSurface);
-
-            if (pContext->config.sample_only) {
-                LOGE("Frame dropped: sample_only=%d\n", pContext->config.sample_only);
-                pContext->perf_stats.dropped_frames++;
-                goto next_frame;
-            }
-
-            // Check USB state
-            if (!usb_is_connected(mp_WdfDevice)) {
-                LOGE("Usb is disconnected\n");
-                pContext->perf_stats.dropped_frames++;
-                goto next_frame;
-            }
-
-            MAIN_DEBUG_LOG();
-            PSLIST_ENTRY pentry = InterlockedPopEntrySList(&urb_list);
-            urb_item_t* purb = (urb_item_t*)pentry;
-            if (purb != NULL) {
-                MAIN_DEBUG_LOG();
-                int64_t grab_start = tools_get_time_us();
-                D3D11_TEXTURE2D_DESC frameDescriptor;
-                fetch_grab_surface(m_Device, AcquiredBuffer, fb_buf, &frameDescriptor);
-
-
-                MAIN_DEBUG_LOG();
-                int64_t grab_end = tools_get_time_us();
-                int total_bytes =m_pEncoder->encode(purb->urb_msg,fb_buf,purb->urb_msg_size,0,0,frameDescriptor.Width,frameDescriptor.Height);
-                if (total_bytes % pContext->max_out_pkg_size == 0) {
-                    total_bytes +=m_pEncoder->encode(purb->urb_msg,nullptr,purb->urb_msg_size,0,0,0,0);
-                }
-
-
-                MAIN_DEBUG_LOG();
-                int64_t encode_end = tools_get_time_us();
-                NTSTATUS ret = usb_send_data_async(purb, pContext->BulkWritePipe, total_bytes);
-                // NTSTATUS ret = usb_send_data_sync(purb, pContext->BulkWritePipe, total_bytes);
-                if (!NT_SUCCESS(ret)) {
-                    LOGW("1.USB send failed with status 0x%x, attempting recovery, URB id=%d\n", ret, purb->id);
-                    // 发送失败时直接将URB推回list，completion routine不会被调用
-                    InterlockedPushEntrySList(&urb_list, &(purb->node));
-                }
-
-                int64_t send_end = tools_get_time_us();
-                const int64_t grab_time = grab_end - grab_start;
-                const int64_t encode_time = encode_end - grab_end;
-                const int64_t send_time = send_end - encode_end;
-                const int64_t total_time = send_end - grab_start;
-
-                LOGI("[Frame] id:%d size:%d grab:%lldus encode:%lldus send:%lldus total:%lldus\n",purb->id, total_bytes, grab_time, encode_time, send_time, total_time);
-
-                // Update performance statistics
-                tools_perf_stats_update(&pContext->perf_stats, total_bytes,grab_time, encode_time, send_time,NT_SUCCESS(ret));
-
-                // Print stats periodically
-                MAIN_DEBUG_LOG();
-                if (pContext->perf_stats.total_frames % stats_print_interval == 0) {
-                    tools_perf_stats_print(&pContext->perf_stats);
-                }
-            } else {
-                LOGW("No URB available, frame dropped\n");
-                pContext->perf_stats.dropped_frames++;
-            }
-        next_frame:
-            if(pContext->config.sleep > 0) {
-                LOGW("Sleep %dmS for debug \n",pContext->config.sleep * 100);
-                Sleep(pContext->config.sleep * 100);
-            }
-            else {
-                tools_sample_tick(pContext->config.fps);
-            }
+    IddSwapChainSource source(m_hSwapChain, m_Device, m_hAvailableBufferEvent, m_hTerminateEvent.Get());
+    CaptureLoop(source, *this).run();
 
-            AcquiredBuffer.Reset();
-            hr = IddCxSwapChainFinishedProcessingFrame(m_hSwapChain);
-            if (FAILED(hr)) {
-                LOGE("Failed to finish processing frame: 0x%x\n", hr);
-                break;
-            }
-        }
-        else {
-            LOGE("Swap-chain abandoned, exiting loop: 0x%x\n", hr);
-            break;
-        }
-#else
-        Sleep(100);
-        LOGE("sleep 5s in cycle\n");
-#endif 
-    }
+    stop_pipeline();
+    tools_pacer_clock_exit(&m_pacer_clock);
 
     // Print final statistics
     tools_perf_stats_print(&pContext->perf_stats);
@@ -660,16 +1478,26 @@ const BYTE IndirectDeviceContext::s_KnownMonitorEdid[] =
 };
 
 IndirectDeviceContext::IndirectDeviceContext(_In_ WDFDEVICE WdfDevice) :
-    m_WdfDevice(WdfDevice), m_Adapter(nullptr), m_Monitor(nullptr)
+    m_WdfDevice(WdfDevice), m_Adapter(nullptr), m_Monitors{}
 {
 }
 
 IndirectDeviceContext::~IndirectDeviceContext()
 {
-    m_ProcessingThread.reset();
+    for (auto& processor : m_ProcessingThreads) {
+        processor.reset();
+    }
 }
 
-#define NUM_VIRTUAL_DISPLAYS 1
+int IndirectDeviceContext::monitor_index(IDDCX_MONITOR Monitor) const
+{
+    for (int i = 0; i < DISP_MAX_MONITORS; i++) {
+        if (m_Monitors[i] == Monitor) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 void IndirectDeviceContext::InitAdapter()
 {
@@ -680,11 +1508,12 @@ void IndirectDeviceContext::InitAdapter()
     // This is also where static per-adapter capabilities are determined.
     // ==============================
     
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(m_WdfDevice);
     IDDCX_ADAPTER_CAPS AdapterCaps = {};
     AdapterCaps.Size = sizeof(AdapterCaps);
     
-    // Declare basic feature support for the adapter (required)
-    AdapterCaps.MaxMonitorsSupported = NUM_VIRTUAL_DISPLAYS;
+    // Declare basic feature support for the adapter (required), a monitor per device panel
+    AdapterCaps.MaxMonitorsSupported = pDeviceContext->config.panels;
     AdapterCaps.EndPointDiagnostics.Size = sizeof(AdapterCaps.EndPointDiagnostics);
     AdapterCaps.EndPointDiagnostics.GammaSupport = IDDCX_FEATURE_IMPLEMENTATION_NONE;
     AdapterCaps.EndPointDiagnostics.TransmissionType = IDDCX_TRANSMISSION_TYPE_WIRED_OTHER;
@@ -733,7 +1562,8 @@ void IndirectDeviceContext::FinishInit()
     g_maxHeight = pDeviceContext->config.h;
     LOGI("Global resolution limits from USB config: %dx%d\n", g_maxWidth, g_maxHeight);
 
-    for (unsigned int i = 0; i < NUM_VIRTUAL_DISPLAYS; i++) {
+    LOGI("Creating %d monitors\n", pDeviceContext->config.panels);
+    for (unsigned int i = 0; i < (unsigned int)pDeviceContext->config.panels; i++) {
         CreateMonitor(i);
     }
 } 
@@ -779,7 +1609,7 @@ void IndirectDeviceContext::CreateMonitor(unsigned int index) {
     NTSTATUS Status = IddCxMonitorCreate(m_Adapter, &MonitorCreate, &MonitorCreateOut);
     if (NT_SUCCESS(Status))
     {
-        m_Monitor = MonitorCreateOut.MonitorObject;
+        m_Monitors[index] = MonitorCreateOut.MonitorObject;
 
         // Associate the monitor with this device context
         auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(MonitorCreateOut.MonitorObject);
@@ -787,13 +1617,20 @@ void IndirectDeviceContext::CreateMonitor(unsigned int index) {
 
         // Tell the OS that the monitor has been plugged in
         IDARG_OUT_MONITORARRIVAL ArrivalOut;
-        Status = IddCxMonitorArrival(m_Monitor, &ArrivalOut);
+        Status = IddCxMonitorArrival(m_Monitors[index], &ArrivalOut);
     }
 }
 
-void IndirectDeviceContext::AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID RenderAdapter, HANDLE NewFrameEvent)
+void IndirectDeviceContext::AssignSwapChain(IDDCX_MONITOR Monitor, IDDCX_SWAPCHAIN SwapChain, LUID RenderAdapter, HANDLE NewFrameEvent)
 {
-    m_ProcessingThread.reset();
+    const int index = monitor_index(Monitor);
+    if (index < 0) {
+        LOGE("Swap-chain for an unknown monitor\n");
+        WdfObjectDelete(SwapChain);
+        return;
+    }
+
+    m_ProcessingThreads[index].reset();
 
     auto Device = make_shared<Direct3DDevice>(RenderAdapter);
     if (FAILED(Device->Init()))
@@ -805,14 +1642,17 @@ void IndirectDeviceContext::AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID Rend
     else
     {
         // Create a new swap-chain processing thread
-        m_ProcessingThread.reset(new SwapChainProcessor(SwapChain, Device, m_WdfDevice, NewFrameEvent));
+        m_ProcessingThreads[index].reset(new SwapChainProcessor(SwapChain, Monitor, index, Device, m_WdfDevice, NewFrameEvent));
     }
 }
 
-void IndirectDeviceContext::UnassignSwapChain()
+void IndirectDeviceContext::UnassignSwapChain(IDDCX_MONITOR Monitor)
 {
-    // Stop processing the last swap-chain
-    m_ProcessingThread.reset();
+    // Stop processing the last swap-chain of the monitor, the others keep running
+    const int index = monitor_index(Monitor);
+    if (index >= 0) {
+        m_ProcessingThreads[index].reset();
+    }
 }
 
 #pragma endregion
@@ -1009,7 +1849,7 @@ _Use_decl_annotations_
 NTSTATUS IddSampleMonitorAssignSwapChain(IDDCX_MONITOR MonitorObject, const IDARG_IN_SETSWAPCHAIN* pInArgs)
 {
     auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(MonitorObject);
-    pContext->pContext->AssignSwapChain(pInArgs->hSwapChain, pInArgs->RenderAdapterLuid, pInArgs->hNextSurfaceAvailable);
+    pContext->pContext->AssignSwapChain(MonitorObject, pInArgs->hSwapChain, pInArgs->RenderAdapterLuid, pInArgs->hNextSurfaceAvailable);
     return STATUS_SUCCESS;
 }
 
@@ -1017,7 +1857,7 @@ _Use_decl_annotations_
 NTSTATUS IddSampleMonitorUnassignSwapChain(IDDCX_MONITOR MonitorObject)
 {
     auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(MonitorObject);
-    pContext->pContext->UnassignSwapChain();
+    pContext->pContext->UnassignSwapChain(MonitorObject);
     return STATUS_SUCCESS;
 }
 
@@ -1025,6 +1865,68 @@ NTSTATUS IddSampleMonitorUnassignSwapChain(IDDCX_MONITOR MonitorObject)
 
 #pragma region USB Device PrepareHardware
 
+// Choose encoder settings from the binary capabilities
+static void apply_dev_caps(display_config_t* config, const dev_caps_t* caps)
+{
+    static const struct {
+        uint32_t codec;
+        int img_type;
+    } codecs[] = {
+        { DEV_CODEC_JPEG,   IMAGE_TYPE_JPG },
+        { DEV_CODEC_RGB565, IMAGE_TYPE_RGB565 },
+        { DEV_CODEC_RGB888, IMAGE_TYPE_RGB888 },
+    };
+    bool supported = false;
+
+    if (caps->width != 0 && caps->height != 0) {
+        config->w = caps->width;
+        config->h = caps->height;
+    }
+
+    // Keep the product string codec if the device decodes it, else the most compact one
+    for (const auto& c : codecs) {
+        if ((caps->codecs & c.codec) && config->img_type == c.img_type) {
+            supported = true;
+        }
+    }
+    if (!supported) {
+        for (const auto& c : codecs) {
+            if (caps->codecs & c.codec) {
+                config->img_type = c.img_type;
+                break;
+            }
+        }
+    }
+    if (caps->jpeg_quality != 0) {
+        config->img_qlt = caps->jpeg_quality;
+    }
+
+    if (caps->fps != 0) {
+        config->fps = caps->fps;
+    }
+    // Full frames must not outrun the decoder
+    if (caps->decode_rate != 0 && config->img_type == IMAGE_TYPE_JPG) {
+        int decode_fps = (int)(caps->decode_rate / ((uint32_t)config->w * config->h));
+        if (decode_fps < 1) decode_fps = 1;
+        if (decode_fps < config->fps) config->fps = decode_fps;
+    }
+
+    config->features = caps->features & DEV_FEATURE_HOST_MASK;
+    config->cache_slots = caps->cache_slots;
+    config->max_transfer = caps->max_transfer;
+    config->rx_buffer = caps->rx_buffer;
+    config->rotation = caps->rotation;
+    config->decode_rate = caps->decode_rate;
+    config->jpeg_profile = caps->jpeg_profile;
+    config->decode_buffer = caps->decode_buffer;
+
+    // A monitor per panel, all of the same geometry
+    config->panels = 1;
+    if ((config->features & DEV_FEATURE_PANELS) && caps->panels > 1) {
+        config->panels = caps->panels < DISP_MAX_MONITORS ? caps->panels : DISP_MAX_MONITORS;
+    }
+}
+
 
 NTSTATUS
 idd_usbdisp_evt_device_prepareHardware(
@@ -1105,6 +2007,8 @@ idd_usbdisp_evt_device_prepareHardware(
 		pDeviceContext->config.img_type     = config.img_type;
 		pDeviceContext->config.img_qlt      = config.img_qlt;
 		pDeviceContext->config.fps          = config.fps;
+		pDeviceContext->config.features     = config.features;
+		pDeviceContext->config.cache_slots  = config.cache_slots;
 
 		LOGI("USB device configuration applied:\n");
 		LOGI("  Width: %d\n", pDeviceContext->config.w);
@@ -1114,12 +2018,56 @@ idd_usbdisp_evt_device_prepareHardware(
 		LOGI("  FPS: %d\n", pDeviceContext->config.fps);
         LOGI("  Sleep: %d\n", pDeviceContext->config.sleep);
         LOGI("  Debug level: %d\n", pDeviceContext->config.debug_level);
+        LOGI("  Features: 0x%x\n", pDeviceContext->config.features);
+        LOGI("  Cache slots: %d\n", pDeviceContext->config.cache_slots);
 	} else {
 		LOGI("USB device info string too short or invalid, using default configuration\n");
 		LOGI("Default config: width=%d, height=%d, enc=%d, fps=%d\n",
 		      pDeviceContext->config.w, pDeviceContext->config.h, pDeviceContext->config.img_type, pDeviceContext->config.fps);
 	}
 
+	// Pipes and striping are set up here only, swap-chains of all monitors share them
+	status = usb_select_interface(Device);
+	if (!NT_SUCCESS(status)) {
+		LOGE("Failed to select interfaces: 0x%x\n", status);
+		return status;
+	}
+	// Before the handshake, the caps reply comes through the reader
+	usb_reader_config(Device);
+
+	// The binary handshake overrides the product string when the device supports it
+	dev_caps_t caps;
+	NTSTATUS caps_status = usb_query_dev_caps(Device, &caps);
+	if (NT_SUCCESS(caps_status)) {
+		apply_dev_caps(&pDeviceContext->config, &caps);
+		LOGI("USB device caps applied: %dx%d enc=0x%x quality=%d fps=%d features=0x%x cache=%d rot=%d panels=%d\n",
+		     pDeviceContext->config.w, pDeviceContext->config.h, pDeviceContext->config.img_type,
+		     pDeviceContext->config.img_qlt, pDeviceContext->config.fps, pDeviceContext->config.features,
+		     pDeviceContext->config.cache_slots, pDeviceContext->config.rotation, pDeviceContext->config.panels);
+	} else {
+		LOGW("No device caps (0x%x), configured from the product string\n", caps_status);
+	}
+
+	usb_flow_init(pDeviceContext->session->transport(), (pDeviceContext->config.features & DEV_FEATURE_CREDIT) != 0, FLOW_INITIAL_CREDITS);
+	usb_stripe_init(Device);
+	// A striped URB needs several chunks even when the device sets no transfer limit
+	int max_transfer = pDeviceContext->config.max_transfer;
+	if ((pDeviceContext->config.features & DEV_FEATURE_STRIPE) && pDeviceContext->BulkWritePipeCount > 1 &&
+	    max_transfer == 0 && pDeviceContext->config.rx_buffer == 0) {
+		max_transfer = USB_STRIPE_CHUNK;
+	}
+	// v2 parsers take a zero-length packet as end of transfer, v1 devices get a NULL packet
+	usb_packetizer_init(pDeviceContext->session->transport(), pDeviceContext->max_out_pkg_size, pDeviceContext->config.rx_buffer, max_transfer,
+	                    (pDeviceContext->config.features & DEV_FEATURE_FRAME_V2) != 0);
+	// Touch and pointer reports are injected as host input
+	if ((pDeviceContext->config.features & DEV_FEATURE_INPUT) && pDeviceContext->BulkReadPipe != NULL) {
+		if (pDeviceContext->injector == nullptr) {
+			pDeviceContext->injector = new InputInjector();
+			usb_input_set_sink(pDeviceContext->session->transport(), InputInjector::sink, pDeviceContext->injector);
+		}
+		pDeviceContext->injector->set_panel(pDeviceContext->config.w, pDeviceContext->config.h);
+	}
+
 	LOGI("USB device connected successfully\n");
 
 	return status;
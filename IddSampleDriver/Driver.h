@@ -21,11 +21,36 @@
 #include "Trace.h"
 #include "encoder.h"
 #include "basetype.h"
+#include "usb_driver.h"
+#include "damage.h"
+#include "motion.h"
+#include "tile_cache.h"
+#include "refine.h"
+#include "video.h"
+#include "rate_ctrl.h"
+#include "clock_sync.h"
+#include "frame_pacer.h"
+#include "jit_sched.h"
+#include "coalesce.h"
+#include "cursor.h"
+#include "bounded_queue.h"
+#include "mailbox.h"
+#include "frame_slots.h"
+#include "work_pool.h"
+#include "capture_loop.h"
+#include "transport_session.h"
+#include "input_inject.h"
 
 
 #define DISP_MAX_WIDTH  1920
 #define DISP_MAX_HEIGHT 1080
 #define UDISP_CONFIG_STR_LEN  256
+#define DISP_MAX_MONITORS     SEND_SCHED_MAX_CLIENTS    // panels of a DEV_FEATURE_PANELS device
+
+// Capture/encode/send pipeline: frame slots shared by the capture and encode stages
+#define PIPELINE_FRAMES       3
+#define PIPELINE_QUEUE_SIZE   4     // power of two >= PIPELINE_FRAMES
+#define PIPELINE_IN_FLIGHT    1     // URBs on the wire before the next frame waits in the mailbox
 
 namespace Microsoft
 {
@@ -61,34 +86,156 @@ namespace Microsoft
 
 
 
+        // A captured frame, owned by the stage holding it
+        struct PipelineFrame
+        {
+            int slot;               // index in m_frames
+            int width, height;
+            int64_t capture_us;
+            int64_t grab_us;        // capture stage duration
+            int64_t slot_us;        // send slot, tools_get_mono_us time
+            int64_t predicted_slack_us;
+        };
+
+        // An encoded URB on its way to the send stage, one per URB id
+        struct PipelineTransfer
+        {
+            urb_item_t* purb;
+            int size;
+            int64_t grab_us;
+            int64_t encode_us;
+            int64_t slot_us;
+            int64_t predicted_slack_us;
+        };
+
+        // IddCx swap-chain behind the capture loop: the acquired surface is copied
+        // into a staging texture, handed back, then read
+        class IddSwapChainSource : public SwapChainSource
+        {
+        public:
+            IddSwapChainSource(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, HANDLE hAvailableBufferEvent, HANDLE hTerminateEvent);
+
+            int acquire() override;
+            bool wait(int timeout_ms) override;
+            bool copy(int* width, int* height) override;
+            bool release() override;
+            bool read(uint8_t* dst) override;
+
+        private:
+            IDDCX_SWAPCHAIN m_hSwapChain;
+            std::shared_ptr<Direct3DDevice> m_Device;
+            HANDLE m_hAvailableBufferEvent;
+            HANDLE m_hTerminateEvent;
+            Microsoft::WRL::ComPtr<IDXGIResource> m_buffer;         // acquired surface until release
+            Microsoft::WRL::ComPtr<ID3D11Texture2D> m_staging;
+            D3D11_TEXTURE2D_DESC m_staging_desc;
+        };
+
         /// <summary>
         /// Manages a thread that consumes buffers from an indirect display swap-chain object.
+        /// Frames flow through three stages with a thread each: capture (swap-chain thread)
+        /// copies the surface into a free frame slot, encode turns it into a URB, send
+        /// submits the URB. Frame N+1 is captured while N is encoded and N-1 is on the wire.
+        /// The capture stage is a CaptureLoop, this class is the target it fills.
         /// </summary>
-        class SwapChainProcessor
+        class SwapChainProcessor : public CaptureTarget
         {
         public:
-            SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, WDFDEVICE WdfDevice, HANDLE NewFrameEvent);
+            SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, IDDCX_MONITOR hMonitor, int index, std::shared_ptr<Direct3DDevice> Device, WDFDEVICE WdfDevice, HANDLE NewFrameEvent);
             ~SwapChainProcessor();
 
         private:
             static DWORD CALLBACK RunThread(LPVOID Argument);
+            static DWORD CALLBACK RunEncodeThread(LPVOID Argument);
+            static DWORD CALLBACK RunSendThread(LPVOID Argument);
 
             void Run();
             void main_function();
+            bool pace() override;
+            uint8_t* begin_frame() override;
+            void commit_frame(int width, int height) override;
+            void abort_frame() override;
+            bool start_pipeline();
+            void stop_pipeline();
+            void encode_loop();
+            void send_loop();
+            bool encode_stage(const PipelineFrame& frame);
+            void encode_captured(const PipelineFrame& frame);
+            void withdraw_stale();
+            void release_transfer(PipelineTransfer* transfer);
+            int encode_frame(urb_item_t* purb, int width, int height, int64_t capture_us);
+            int encode_updates(uint8_t* output, int buffer_size, int width, int height);
+            void reset_update_state();
+            void apply_telemetry();
+            void send_ping();
+            bool send_control(urb_item_t* purb, int body_len);
+            int encode_panel(uint8_t* output, int buffer_size);
+            int control_header_size() const;
+            void setup_cursor();
+            void send_cursor();
+            void jit_add(jit_estimate_t* estimate, int64_t us);
+            jit_sched_t jit_snapshot();
 
         public:
             IDDCX_SWAPCHAIN m_hSwapChain;
+            IDDCX_MONITOR m_hMonitor;
+            int m_index;                    // monitor of the adapter, panel of the device
             std::shared_ptr<Direct3DDevice> m_Device;
             WDFDEVICE  mp_WdfDevice;
-            uint8_t		fb_buf[DISP_MAX_HEIGHT*DISP_MAX_WIDTH*4];
+            uint8_t*    fb_buf;         // frame being encoded, a slot of m_frames
+            std::vector<uint8_t> m_frames[PIPELINE_FRAMES];
+            FrameSlots<PIPELINE_QUEUE_SIZE> m_free_frames;                   // encode -> capture
+            int m_capture_slot;             // slot between begin_frame and commit_frame
+            int64_t m_capture_time_us;
+            int64_t m_capture_start_us;
+            BoundedQueue<PipelineFrame, PIPELINE_QUEUE_SIZE> m_captured;     // capture -> encode
+            PipelineTransfer m_transfers[MAX_URB_SIZE];                      // indexed by URB id
+            Mailbox<PipelineTransfer> m_outbox;                               // encode -> send, latest wins
+            PipelineFrame m_held;           // frame with coalesced damage, slot -1 = none
+            bool m_coalesced;               // the frame being encoded was held back
+            std::vector<uint8_t> m_last_damage; // tiles changed by the last encoded frame
+            bool m_last_stores;                 // the last encoded frame stored tiles in the device cache
+            std::atomic<bool> m_stop;
+            std::atomic<bool> m_resync;     // send failed, the encoder must resend everything
 
             ImageEncoder *m_pEncoder;
-            SLIST_HEADER urb_list;
+            damage_map_t m_damage;
+            motion_ctx_t m_motion;
+            tile_cache_t m_cache;
+            refine_map_t m_refine;
+            video_map_t m_video;
+            int64_t m_video_sent_us;
+            rate_ctrl_t m_rate;             // encode thread only
+            std::atomic<int> m_pace_fps;    // m_rate.fps published for the capture thread
+            frame_pacer_t m_pacer;          // capture rate, per swap-chain
+            pacer_clock_t m_pacer_clock;
+            jit_sched_t m_jit;              // capture lead before each send slot
+            std::mutex m_jit_lock;          // m_jit is fed by all three stages, read by capture
+            coalesce_ctx_t m_coalesce;      // small damage waiting for more
+            uint64_t m_telemetry_seen;
+            _u32 m_ping_seq;
+            int64_t m_ping_sent_us;
+            cursor_cache_t m_cursor;
+            std::vector<uint8_t> m_cursor_buf;
+            UINT m_cursor_shape_id;     // last shape the device has
+            int m_cursor_slot;
+            bool m_cursor_pending;      // an update is waiting for a free URB
+            std::vector<tile_cache_ref_t> m_cache_draws;
+            std::vector<tile_cache_ref_t> m_cache_stores;
+            update_list_t m_updates;
+            PSLIST_HEADER urb_list;         // pool of the device's TransportSession
+            SendScheduler* m_sched;         // send turns and URB share among the monitors
+            usb_transport_t* m_transport;   // of the device, shared with the other monitors
             int max_out_pkg_size;
 
             HANDLE m_hAvailableBufferEvent;
             Microsoft::WRL::Wrappers::Thread m_hThread;
             Microsoft::WRL::Wrappers::Event m_hTerminateEvent;
+            Microsoft::WRL::Wrappers::Event m_hCursorEvent;
+            Microsoft::WRL::Wrappers::Event m_hFrameEvent;     // a frame was captured
+            Microsoft::WRL::Wrappers::Event m_hSendEvent;      // a URB was encoded
+            Microsoft::WRL::Wrappers::Thread m_hEncodeThread;
+            Microsoft::WRL::Wrappers::Thread m_hSendThread;
         };
 
         /// <summary>
@@ -105,16 +252,18 @@ namespace Microsoft
 
             void CreateMonitor(unsigned int index);
 
-            void AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID RenderAdapter, HANDLE NewFrameEvent);
-            void UnassignSwapChain();
+            void AssignSwapChain(IDDCX_MONITOR Monitor, IDDCX_SWAPCHAIN SwapChain, LUID RenderAdapter, HANDLE NewFrameEvent);
+            void UnassignSwapChain(IDDCX_MONITOR Monitor);
 
         protected:
+            int monitor_index(IDDCX_MONITOR Monitor) const;
 
             WDFDEVICE m_WdfDevice;
             IDDCX_ADAPTER m_Adapter;
-            IDDCX_MONITOR m_Monitor;
 
-            std::unique_ptr<SwapChainProcessor> m_ProcessingThread;
+            // One swap-chain processor per monitor, all on the device's TransportSession
+            IDDCX_MONITOR m_Monitors[DISP_MAX_MONITORS];
+            std::unique_ptr<SwapChainProcessor> m_ProcessingThreads[DISP_MAX_MONITORS];
 
         public:
             static const DISPLAYCONFIG_VIDEO_SIGNAL_INFO s_KnownMonitorModes[];
@@ -140,6 +289,15 @@ typedef struct {
     int sample_only;
     int debug_level;
     int sleep;
+    int features;
+    int cache_slots;
+    int max_transfer;   // from dev_caps_t, 0 = unknown
+    int rx_buffer;
+    int rotation;
+    int decode_rate;
+    int jpeg_profile;   // JPEG_PROFILE_*
+    int decode_buffer;  // device JPEG decode buffer in pixels, 0 = whole frame
+    int panels;         // monitors to create, > 1 only for DEV_FEATURE_PANELS devices
 } display_config_t;
 
 class IndirectDeviceContextWrapper {
@@ -152,8 +310,10 @@ public:
     WDFUSBPIPE                      BulkReadPipe;
 	ULONG max_in_pkg_size;
 
-    WDFUSBPIPE                      BulkWritePipe;
+    WDFUSBPIPE                      BulkWritePipe;     // first of BulkWritePipes
 	ULONG max_out_pkg_size;
+    WDFUSBPIPE                      BulkWritePipes[USB_MAX_OUT_PIPES];  // endpoint order
+    int                             BulkWritePipeCount;
     ULONG							UsbDeviceTraits;
 
     PSLIST_HEADER purb_list;
@@ -166,6 +326,10 @@ public:
     // Error recovery state
     usb_connection_state_t usb_state;
     perf_stats_t perf_stats;
+    clock_sync_t clock;     // device clock, updated by the bulk IN reader
+    WorkPool* encode_pool;  // shared by the encoders of all swap-chains
+    TransportSession* session;  // URBs and encoders, outlive each swap-chain
+    InputInjector* injector;    // input sink of DEV_FEATURE_INPUT devices, NULL otherwise
 
     void Cleanup();
 };
\ No newline at end of file
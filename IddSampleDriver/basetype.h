@@ -26,8 +26,154 @@ typedef uint32_t pixel_type_t;
 #define IMAGE_TYPE_YUV420  (('Y' << 0) | ('4' << 8) | ('2' << 16) | ('0' << 24))
 #define IMAGE_TYPE_JPG     (('J' << 0) | ('P' << 8) | ('E' << 16) | ('G' << 24))
 #define IMAGE_TYPE_NULL    (('N' << 0) | ('U' << 8) | ('L' << 16) | ('L' << 24))
+#define IMAGE_TYPE_MOVE    (('M' << 0) | ('O' << 8) | ('V' << 16) | ('E' << 24))
+#define IMAGE_TYPE_CACHE_DRAW   (('C' << 0) | ('D' << 8) | ('R' << 16) | ('W' << 24))
+#define IMAGE_TYPE_CACHE_STORE  (('C' << 0) | ('S' << 8) | ('T' << 16) | ('R' << 24))
+#define IMAGE_TYPE_FRAME_BEGIN  (('F' << 0) | ('B' << 8) | ('G' << 16) | ('N' << 24))
+#define IMAGE_TYPE_FRAME_COMMIT (('F' << 0) | ('C' << 8) | ('M' << 16) | ('T' << 24))
+#define IMAGE_TYPE_CAPS_QUERY   (('C' << 0) | ('A' << 8) | ('P' << 16) | ('Q' << 24))
+#define IMAGE_TYPE_PING         (('P' << 0) | ('I' << 8) | ('N' << 16) | ('G' << 24))
+#define IMAGE_TYPE_CURSOR_SHAPE (('C' << 0) | ('S' << 8) | ('H' << 16) | ('P' << 24))
+#define IMAGE_TYPE_CURSOR_POS   (('C' << 0) | ('P' << 8) | ('O' << 16) | ('S' << 24))
+#define IMAGE_TYPE_PANEL        (('P' << 0) | ('A' << 8) | ('N' << 16) | ('L' << 24))
 #define FRAME_MAGIC_ID     (('l' << 0) | ('v' << 8) | ('s' << 16) | ('n' << 24))
 
+// Device feature bits, reported with the 'C' token of the product string
+#define DEV_FEATURE_RECT      (1 << 0)   // device composites partial rectangles
+#define DEV_FEATURE_MOVE      (1 << 1)   // device executes IMAGE_TYPE_MOVE commands
+#define DEV_FEATURE_REFINE    (1 << 2)   // device decodes JPEG and RGB888 rects in one stream
+#define DEV_FEATURE_REGION    (1 << 3)   // header reserved[1] carries a FRAME_REGION_* tag
+#define DEV_FEATURE_FRAME_V2  (1 << 4)   // device parses frame_v2_header_t containers
+#define DEV_FEATURE_COMMIT    (1 << 5)   // device flips on IMAGE_TYPE_FRAME_COMMIT
+#define DEV_FEATURE_CREDIT    (1 << 6)   // device grants transfer credits with DEV_MSG_CREDIT
+#define DEV_FEATURE_TIMESTAMP (1 << 7)   // header reserved[0] carries the capture time, device answers pings
+#define DEV_FEATURE_CURSOR    (1 << 8)   // device composites a hardware cursor
+#define DEV_FEATURE_INPUT     (1 << 9)   // device reports touch/pointer input with DEV_MSG_INPUT
+#define DEV_FEATURE_PANELS    (1 << 10)  // device drives dev_caps_t.panels panels, see IMAGE_TYPE_PANEL
+#define DEV_FEATURE_STRIPE    (1 << 11)  // device reads transfers striped over all its bulk OUT pipes
+#define DEV_FEATURE_HOST_MASK (DEV_FEATURE_RECT | DEV_FEATURE_MOVE | DEV_FEATURE_REFINE | \
+                               DEV_FEATURE_REGION | DEV_FEATURE_FRAME_V2 | DEV_FEATURE_COMMIT | \
+                               DEV_FEATURE_CREDIT | DEV_FEATURE_TIMESTAMP | DEV_FEATURE_CURSOR | \
+                               DEV_FEATURE_INPUT | DEV_FEATURE_PANELS | DEV_FEATURE_STRIPE)
+
+// Codec bits of dev_caps_t
+#define DEV_CODEC_RGB565      (1 << 0)
+#define DEV_CODEC_RGB888      (1 << 1)
+#define DEV_CODEC_YUV420      (1 << 2)
+#define DEV_CODEC_JPEG        (1 << 3)
+
+// JPEG profiles of dev_caps_t
+#define JPEG_PROFILE_DEFAULT  0   // libjpeg defaults, one JPEG per rect
+#define JPEG_PROFILE_ESP32    1   // baseline 4:2:0, standard Huffman tables, strips of decode_buffer pixels
+
+// Region tags
+#define FRAME_REGION_DESKTOP  0
+#define FRAME_REGION_VIDEO    1
+
+// Striping (DEV_FEATURE_STRIPE): a device with several bulk OUT pipes gets
+// each transfer cut into chunks as packetizer.h describes (USB_STRIPE_CHUNK
+// bytes if the device sets no max_transfer or rx_buffer), dealt round robin
+// to its OUT pipes in endpoint order starting with the first for every
+// transfer. The device reads the pipes in the same order; the short chunk
+// or ZLP ending the transfer arrives on the pipe whose turn it is.
+
+// Multi-panel devices (DEV_FEATURE_PANELS): a transfer for one panel starts
+// with an IMAGE_TYPE_PANEL packet, img_x = panel index, which routes the rest
+// of the transfer to that panel's framebuffer, tile cache and cursor. Pings
+// address the device and carry no panel packet.
+
+// Capability handshake: at connect time the host sends an IMAGE_TYPE_CAPS_QUERY
+// packet (payload host_caps_t) on the bulk OUT pipe and the device answers with
+// dev_caps_t on the bulk IN pipe. Devices that do not answer are configured from
+// the product string. Both structures may grow, receivers honour the size field.
+#define DEV_CAPS_MAGIC        (('l' << 0) | ('v' << 8) | ('s' << 16) | ('c' << 24))
+#define DEV_CAPS_VERSION      1
+
+typedef struct _host_caps {
+    uint16_t version;           // DEV_CAPS_VERSION
+    uint16_t size;              // sizeof(host_caps_t)
+    uint32_t features;          // DEV_FEATURE_* the host implements
+} host_caps_t;
+
+typedef struct _dev_caps {
+    uint32_t magic;             // DEV_CAPS_MAGIC
+    uint16_t version;           // DEV_CAPS_VERSION
+    uint16_t size;              // sizeof(dev_caps_t) on the device
+    uint32_t codecs;            // DEV_CODEC_* bits
+    uint32_t features;          // DEV_FEATURE_* bits
+    uint32_t max_transfer;      // largest transfer the device accepts, 0 = unlimited
+    uint32_t rx_buffer;         // device receive buffer in bytes, 0 = unknown
+    uint16_t width, height;     // panel geometry
+    uint16_t rotation;          // panel rotation in degrees (0, 90, 180, 270)
+    uint16_t fps;               // max refresh rate
+    uint32_t decode_rate;       // JPEG decode throughput in pixels per second, 0 = unknown
+    uint16_t cache_slots;       // tile cache size, 0 = no cache
+    uint16_t jpeg_quality;      // preferred JPEG quality, 0 = host default
+    uint16_t jpeg_profile;      // JPEG_PROFILE_*
+    uint16_t panels;            // panels of width x height each, 0 = one
+    uint32_t decode_buffer;     // pixels the JPEG decoder outputs at once, 0 = whole frame
+    uint32_t reserved[2];
+} dev_caps_t;
+
+// Device to host messages on the bulk IN pipe, several may share one transfer.
+// size covers the header and lets the host skip unknown message types.
+#define DEV_MSG_MAGIC         (('l' << 0) | ('v' << 8) | ('s' << 16) | ('m' << 24))
+#define DEV_MSG_CREDIT        1   // dev_msg_credit_t
+#define DEV_MSG_TELEMETRY     2   // dev_msg_telemetry_t
+#define DEV_MSG_PONG          3   // dev_msg_pong_t
+#define DEV_MSG_PRESENT       4   // dev_msg_present_t
+#define DEV_MSG_INPUT         5   // input_report_t and input_event_t, see input.h
+
+typedef struct _dev_msg_header {
+    uint32_t magic;             // DEV_MSG_MAGIC
+    uint16_t type;              // DEV_MSG_*
+    uint16_t size;              // message bytes including this header
+} dev_msg_header_t;
+
+// The device consumed transfers and grants that many new ones
+typedef struct _dev_msg_credit {
+    dev_msg_header_t header;
+    uint32_t credits;
+    uint32_t frame_seq;         // img_cnt of the last transfer it finished
+} dev_msg_credit_t;
+
+// Decoder state, sent by the device after decoded frames (rate is up to the device)
+typedef struct _dev_msg_telemetry {
+    dev_msg_header_t header;
+    uint32_t frame_seq;         // img_cnt of the frame the numbers refer to
+    uint32_t decode_us;         // decode time of that frame
+    uint32_t rx_fill;           // bytes waiting in the receive buffer
+    uint32_t rx_size;           // receive buffer size
+    uint32_t dropped_frames;    // frames dropped by the device since connect
+    uint32_t refresh_us;        // panel refresh period, 0 = unknown
+} dev_msg_telemetry_t;
+
+// Clock sync: the host sends an IMAGE_TYPE_PING transfer with host_ping_t, the
+// device answers at once with dev_msg_pong_t. Device times are in its own
+// microsecond clock. Pings do not consume flow control credits.
+typedef struct _host_ping {
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t host_us;           // host send time (t1)
+} host_ping_t;
+
+typedef struct _dev_msg_pong {
+    dev_msg_header_t header;
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t host_us;           // t1 echoed
+    uint64_t rx_us;             // device receive time (t2)
+    uint64_t tx_us;             // device send time (t3)
+} dev_msg_pong_t;
+
+// A frame reached the panel
+typedef struct _dev_msg_present {
+    dev_msg_header_t header;
+    uint32_t frame_seq;         // img_cnt of the first packet of the frame
+    uint32_t capture_us;        // header timestamp of the frame, echoed
+    uint64_t present_us;        // device time the frame was scanned out
+} dev_msg_present_t;
+
 // USB device connection state
 typedef enum _usb_connection_state {
     USB_STATE_CONNECTED = 0,
@@ -43,14 +189,72 @@ typedef enum _error_recovery_strategy {
     RECOVERY_REINIT = 2
 } error_recovery_strategy_t;
 
+// Bulk OUT pipes with their own statistics
+#define PERF_MAX_PIPES        4
+
+// Latency histogram, the last bucket collects everything above
+#define LATENCY_BUCKET_US     2000
+#define LATENCY_BUCKETS       128
+
 // Performance statistics
+// One per device, written by the capture, encode and send threads of every
+// monitor and by the USB reader and completions: plain counters only through
+// PERF_STATS_ADD, everything else through tools_perf_stats_* under lock
 typedef struct _perf_stats {
+    SRWLOCK lock;
     uint64_t total_frames;
     uint64_t dropped_frames;
+    uint64_t stale_frames;      // encoded frames replaced by a newer one before sending
     uint64_t error_frames;
     uint64_t total_bytes;
     uint64_t urbs_sent;
     uint64_t urbs_failed;
+    uint64_t move_cmds;
+    uint64_t moved_tiles;
+    uint64_t cache_hits;
+    uint64_t cache_stores;
+    uint64_t refined_tiles;
+    uint64_t video_tiles;
+    uint64_t video_deferred;
+    uint64_t throttled_frames;  // send turns given up waiting for a credit, the frame stays queued
+    uint64_t coalesced_frames;  // small updates held back to go out with later damage
+    uint64_t credits_received;
+    // Device side, from DEV_MSG_TELEMETRY
+    uint64_t telemetry_reports;
+    uint64_t dev_dropped_frames;
+    int64_t avg_dev_decode_us;
+    int64_t dev_refresh_us;
+    int dev_rx_fill_pct;
+    // Capture to photon latency, from DEV_MSG_PRESENT
+    uint64_t latency_samples;
+    int64_t min_latency_us;
+    int64_t max_latency_us;
+    int64_t avg_latency_us;
+    uint32_t latency_hist[LATENCY_BUCKETS];
+    int64_t clock_rtt_us;       // round trip of the clock sync sample in use
+    uint64_t cursor_moves;
+    uint64_t cursor_shapes;     // shapes sent, the rest came from the device cache
+    // Touch/pointer input, from DEV_MSG_INPUT
+    uint64_t input_events;
+    uint64_t input_dropped;     // lost reports and queue overflows
+    int64_t avg_input_latency_us;   // device sample to injection
+    int64_t max_input_latency_us;
+    // Capture pacing, see frame_pacer_t
+    uint64_t pace_ticks;
+    uint64_t pace_missed;
+    int64_t avg_pace_jitter_us;
+    int64_t max_pace_jitter_us;
+    // Just-in-time capture: send slot minus send submit time, see jit_sched_t
+    uint64_t slack_frames;
+    uint64_t late_frames;       // submitted after their slot
+    int64_t avg_predicted_slack_us;
+    int64_t avg_actual_slack_us;
+    // Bulk OUT pipes a transfer is striped over, updated from completions
+    int pipe_count;
+    int64_t pipe_start_us;
+    volatile int64_t pipe_transfers[PERF_MAX_PIPES];
+    volatile int64_t pipe_bytes[PERF_MAX_PIPES];
+    volatile int64_t pipe_failed[PERF_MAX_PIPES];
     int64_t avg_grab_time_us;
     int64_t avg_encode_time_us;
     int64_t avg_send_time_us;
@@ -74,4 +278,6 @@ typedef struct _usb_dev_config {
     int fps;         // Target FPS
     int sleep;         // Sleep time in cycles 
     int debug;          //debug level
+    int features;       // DEV_FEATURE_* bits
+    int cache_slots;    // device tile cache size, 0 = no cache
 } usb_dev_config_t;
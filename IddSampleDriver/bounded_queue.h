@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+
+// Bounded single-producer single-consumer ring, lock free. Items move from
+// the producer thread to the consumer thread together with the ownership of
+// whatever they refer to (frame slots, URBs). push fails when the ring is
+// full, pop when it is empty; waiting is up to the caller.
+template <typename T, unsigned Capacity>
+class BoundedQueue
+{
+public:
+    BoundedQueue() : m_head(0), m_tail(0), m_items{} {}
+
+    // Producer side
+    bool push(const T& item)
+    {
+        const unsigned tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        m_items[tail % Capacity] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T& item)
+    {
+        const unsigned head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = m_items[head % Capacity];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    unsigned size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+private:
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    std::atomic<unsigned> m_head;   // next item to pop, written by the consumer
+    std::atomic<unsigned> m_tail;   // next free item, written by the producer
+    T m_items[Capacity];
+};
@@ -0,0 +1,42 @@
+#include "capture_loop.h"
+
+void CaptureLoop::run()
+{
+    bool pace = false;
+
+    for (;;) {
+        // Pace before the acquire, not while holding a surface or a stale copy
+        if (pace) {
+            pace = false;
+            if (!m_target.pace()) {
+                break;
+            }
+        }
+
+        const int status = m_source.acquire();
+        if (status == SWAPCHAIN_PENDING) {
+            if (!m_source.wait(CAPTURE_WAIT_MS)) {
+                break;
+            }
+            continue;
+        }
+        if (status != SWAPCHAIN_FRAME) {
+            break;
+        }
+
+        int width = 0, height = 0;
+        uint8_t* buffer = m_target.begin_frame();
+        const bool copied = buffer != nullptr && m_source.copy(&width, &height);
+        const bool released = m_source.release();
+
+        if (copied && m_source.read(buffer)) {
+            m_target.commit_frame(width, height);
+        } else if (buffer != nullptr) {
+            m_target.abort_frame();
+        }
+        if (!released) {
+            break;
+        }
+        pace = true;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CAPTURE_WAIT_MS     16      // wait for a new buffer before polling again
+
+// Result of SwapChainSource::acquire
+#define SWAPCHAIN_FRAME     0       // a surface is held until release
+#define SWAPCHAIN_PENDING   1       // no new frame yet
+#define SWAPCHAIN_LOST      2       // abandoned, the loop ends
+
+// What the capture loop needs from an IddCx swap-chain, faked in tests
+class SwapChainSource
+{
+public:
+    virtual ~SwapChainSource() {}
+
+    virtual int acquire() = 0;
+
+    // Wait up to timeout_ms for a new frame, false = stop
+    virtual bool wait(int timeout_ms) = 0;
+
+    // Submit the copy of the held surface, false = failed
+    virtual bool copy(int* width, int* height) = 0;
+
+    // Give the surface back to the OS, false = lost
+    virtual bool release() = 0;
+
+    // Wait for the copy and read it into dst (width * 4 bytes per row)
+    virtual bool read(uint8_t* dst) = 0;
+};
+
+// Where captured frames go, the pipeline side of the loop
+class CaptureTarget
+{
+public:
+    virtual ~CaptureTarget() {}
+
+    // Wait for the next capture time, false = stop
+    virtual bool pace() = 0;
+
+    // Buffer for the next frame, nullptr if it is not wanted (dropped)
+    virtual uint8_t* begin_frame() = 0;
+    virtual void commit_frame(int width, int height) = 0;
+    virtual void abort_frame() = 0;
+};
+
+// Capture loop: acquire, submit the copy, release the surface, read the copy,
+// hand it on, pace. The surface goes back to the OS as soon as the GPU copy
+// is submitted, so neither reading nor pacing holds the compositor.
+class CaptureLoop
+{
+public:
+    CaptureLoop(SwapChainSource& source, CaptureTarget& target) : m_source(source), m_target(target) {}
+
+    // Until the swap-chain is lost or the target stops
+    void run();
+
+private:
+    SwapChainSource& m_source;
+    CaptureTarget& m_target;
+};
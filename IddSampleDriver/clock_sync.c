@@ -0,0 +1,39 @@
+#include <string.h>
+#include "clock_sync.h"
+
+void clock_sync_init(clock_sync_t* sync)
+{
+    memset(sync, 0, sizeof(clock_sync_t));
+}
+
+void clock_sync_add(clock_sync_t* sync, int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+{
+    int64_t rtt = (t4 - t1) - (t3 - t2);
+    int best = 0;
+
+    // Device time going backwards or a reply from an older ping
+    if (rtt < 0 || t4 < t1) {
+        return;
+    }
+
+    sync->offset_us[sync->next] = ((t2 - t1) + (t3 - t4)) / 2;
+    sync->rtt_us[sync->next] = rtt;
+    sync->next = (sync->next + 1) % CLOCK_SYNC_SAMPLES;
+    if (sync->count < CLOCK_SYNC_SAMPLES) {
+        sync->count++;
+    }
+
+    for (int i = 1; i < sync->count; i++) {
+        if (sync->rtt_us[i] < sync->rtt_us[best]) {
+            best = i;
+        }
+    }
+    sync->offset = sync->offset_us[best];
+    sync->rtt = sync->rtt_us[best];
+    sync->valid = 1;
+}
+
+int64_t clock_sync_to_host(const clock_sync_t* sync, int64_t device_us)
+{
+    return device_us - sync->offset;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NTP-style host/device clock offset from ping exchanges:
+// t1 host send, t2 device receive, t3 device send, t4 host receive.
+// The sample with the smallest round trip in the window is the least skewed
+// by queueing, its offset is used.
+#define CLOCK_SYNC_SAMPLES      8
+#define CLOCK_PING_INTERVAL_MS  1000
+
+typedef struct _clock_sync {
+    int64_t offset_us[CLOCK_SYNC_SAMPLES];  // device - host
+    int64_t rtt_us[CLOCK_SYNC_SAMPLES];
+    int count;
+    int next;
+    int64_t offset;         // offset of the best sample
+    int64_t rtt;            // round trip of the best sample
+    int valid;
+} clock_sync_t;
+
+void clock_sync_init(clock_sync_t* sync);
+void clock_sync_add(clock_sync_t* sync, int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+// Device timestamp in host time, valid only once a sample was added
+int64_t clock_sync_to_host(const clock_sync_t* sync, int64_t device_us);
+
+#ifdef __cplusplus
+}
+#endif
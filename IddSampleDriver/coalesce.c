@@ -0,0 +1,47 @@
+#include <string.h>
+#include "coalesce.h"
+
+void coalesce_init(coalesce_ctx_t* ctx, int window_ms, int max_tiles)
+{
+    if (ctx == NULL) return;
+
+    memset(ctx, 0, sizeof(coalesce_ctx_t));
+    ctx->window_us = window_ms > 0 ? (int64_t)window_ms * 1000 : 0;
+    ctx->max_tiles = max_tiles;
+}
+
+int coalesce_defer(coalesce_ctx_t* ctx, int dirty, int64_t now_us)
+{
+    if (ctx == NULL) return 0;
+
+    if (ctx->window_us <= 0 || dirty <= 0 || dirty > ctx->max_tiles) {
+        ctx->since_us = 0;
+        return 0;
+    }
+
+    if (ctx->since_us == 0) {
+        ctx->since_us = now_us;
+    } else if (now_us - ctx->since_us >= ctx->window_us) {
+        ctx->since_us = 0;
+        ctx->expired++;
+        return 0;
+    }
+    ctx->deferred++;
+    return 1;
+}
+
+int64_t coalesce_remaining(const coalesce_ctx_t* ctx, int64_t now_us)
+{
+    int64_t left;
+
+    if (ctx == NULL || ctx->since_us == 0) return -1;
+
+    left = ctx->since_us + ctx->window_us - now_us;
+    return left > 0 ? left : 0;
+}
+
+void coalesce_reset(coalesce_ctx_t* ctx)
+{
+    if (ctx == NULL) return;
+    ctx->since_us = 0;
+}
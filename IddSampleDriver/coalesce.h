@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Coalescing of small updates: damage of at most max_tiles tiles (a caret,
+// a clock, a spinner) is held back for up to the window, so what changes
+// meanwhile goes out in the same transfer. Larger damage, or any damage once
+// the window has run out, is sent at once together with what was held.
+#define COALESCE_WINDOW_MS      8   // default window, 0 = off
+#define COALESCE_MAX_TILES      8   // default size of small damage, in DAMAGE_TILE_SIZE tiles
+
+typedef struct _coalesce_ctx {
+    int64_t window_us;      // 0 = not coalescing
+    int max_tiles;
+    int64_t since_us;       // when the held damage came, 0 = none held
+    uint64_t deferred;      // updates held back
+    uint64_t expired;       // updates sent because the window ran out
+} coalesce_ctx_t;
+
+void coalesce_init(coalesce_ctx_t* ctx, int window_ms, int max_tiles);
+
+// Decide for an update of dirty tiles, including any held ones, at now_us:
+// 1 = hold it back, 0 = send it now.
+int coalesce_defer(coalesce_ctx_t* ctx, int dirty, int64_t now_us);
+
+// Time until the held damage must be sent, 0 = due now, -1 = none held
+int64_t coalesce_remaining(const coalesce_ctx_t* ctx, int64_t now_us);
+
+// Forget the held damage, e.g. after the damage map was reset
+void coalesce_reset(coalesce_ctx_t* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,53 @@
+#include <string.h>
+#include "cursor.h"
+
+void cursor_cache_reset(cursor_cache_t* cache)
+{
+    if (cache == NULL) return;
+
+    memset(cache, 0, sizeof(cursor_cache_t));
+}
+
+int cursor_cache_lookup(cursor_cache_t* cache, uint64_t hash, int* slot)
+{
+    int victim = 0;
+
+    cache->clock++;
+    for (int i = 0; i < CURSOR_CACHE_SLOTS; i++) {
+        if (cache->used[i] != 0 && cache->hash[i] == hash) {
+            cache->used[i] = cache->clock;
+            cache->hits++;
+            *slot = i;
+            return 1;
+        }
+        if (cache->used[i] < cache->used[victim]) {
+            victim = i;
+        }
+    }
+
+    cache->hash[victim] = hash;
+    cache->used[victim] = cache->clock;
+    cache->misses++;
+    *slot = victim;
+    return 0;
+}
+
+uint64_t cursor_shape_hash(int type, int hot_x, int hot_y, int width, int height, int pitch, const uint8_t* pixels)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const int meta[5] = { type, hot_x, hot_y, width, height };
+
+    for (int i = 0; i < 5; i++) {
+        h ^= (uint64_t)(uint32_t)meta[i];
+        h *= 0x100000001b3ULL;
+    }
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = pixels + (size_t)y * pitch;
+        for (int x = 0; x < width * 4; x++) {
+            h ^= row[x];
+            h *= 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hardware cursor of DEV_FEATURE_CURSOR devices: the shape is sent once per
+// device cache slot with IMAGE_TYPE_CURSOR_SHAPE, moves are IMAGE_TYPE_CURSOR_POS
+// packets naming the slot. The device composites the cursor over its framebuffer.
+// Cursor transfers are sent outside the frames and hold no flow control credit.
+#define CURSOR_MAX_SIZE         64      // largest cursor the OS hands us, in pixels
+#define CURSOR_CACHE_SLOTS      8
+
+#define CURSOR_SHAPE_ALPHA      0       // 32bpp premultiplied BGRA
+#define CURSOR_SHAPE_MASKED     1       // 32bpp BGR, alpha 0xFF = XOR with the screen
+
+// Payload of IMAGE_TYPE_CURSOR_SHAPE, followed by width * height 32bpp pixels.
+// img_w/img_h of the packet carry the cursor size.
+typedef struct _cursor_shape {
+    uint16_t slot;
+    uint16_t type;              // CURSOR_SHAPE_*
+    uint16_t hot_x, hot_y;
+} cursor_shape_t;
+
+// Payload of IMAGE_TYPE_CURSOR_POS. Position of the cursor's top left pixel,
+// may be negative when the cursor is partially off screen.
+typedef struct _cursor_pos {
+    int16_t x, y;
+    uint16_t slot;
+    uint16_t visible;
+} cursor_pos_t;
+
+// Host mirror of the device cursor cache: shape hash -> slot, LRU eviction
+typedef struct _cursor_cache {
+    uint64_t hash[CURSOR_CACHE_SLOTS];
+    uint32_t used[CURSOR_CACHE_SLOTS];  // last use, 0 = empty
+    uint32_t clock;
+    uint64_t hits, misses;
+} cursor_cache_t;
+
+void cursor_cache_reset(cursor_cache_t* cache);
+
+// Slot for hash. Returns 1 if the device already holds the shape there, 0 if
+// the slot was (re)assigned and the shape has to be sent.
+int  cursor_cache_lookup(cursor_cache_t* cache, uint64_t hash, int* slot);
+
+// Shape identity: type, hotspot, size and the width * height pixels of the
+// pitch-strided 32bpp image.
+uint64_t cursor_shape_hash(int type, int hot_x, int hot_y, int width, int height, int pitch, const uint8_t* pixels);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include "damage.h"
+
+#define HASH_SEED   0xcbf29ce484222325ull
+#define HASH_PRIME  0x9e3779b97f4a7c15ull
+
+int damage_init(damage_map_t* map, int width, int height)
+{
+    int tiles;
+
+    if (map == NULL || width <= 0 || height <= 0) {
+        return -1;
+    }
+
+    memset(map, 0, sizeof(damage_map_t));
+    map->width = width;
+    map->height = height;
+    map->tiles_x = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    map->tiles_y = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    tiles = map->tiles_x * map->tiles_y;
+
+    map->hash = (uint64_t*)calloc(tiles, sizeof(uint64_t));
+    map->prev_hash = (uint64_t*)calloc(tiles, sizeof(uint64_t));
+    map->dirty = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    map->pending = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    if (map->hash == NULL || map->prev_hash == NULL || map->dirty == NULL || map->pending == NULL) {
+        damage_exit(map);
+        return -2;
+    }
+
+    map->full_refresh = 1;
+    return 0;
+}
+
+void damage_exit(damage_map_t* map)
+{
+    if (map == NULL) return;
+
+    free(map->hash);
+    free(map->prev_hash);
+    free(map->dirty);
+    free(map->pending);
+    memset(map, 0, sizeof(damage_map_t));
+}
+
+void damage_invalidate(damage_map_t* map)
+{
+    if (map == NULL) return;
+    map->full_refresh = 1;
+}
+
+void damage_merge(damage_map_t* map, const uint8_t* mask)
+{
+    if (map == NULL || map->pending == NULL || mask == NULL) return;
+
+    for (int i = 0; i < map->tiles_x * map->tiles_y; i++) {
+        map->pending[i] |= mask[i];
+    }
+}
+
+uint64_t damage_hash_block(const uint8_t* fb, int stride, int x, int y, int w, int h)
+{
+    uint64_t hash = HASH_SEED;
+
+    for (int row = 0; row < h; row++) {
+        const uint32_t* line = (const uint32_t*)(fb + (y + row) * stride) + x;
+        for (int col = 0; col < w; col++) {
+            hash ^= line[col];
+            hash *= HASH_PRIME;
+            hash ^= hash >> 29;
+        }
+    }
+    return hash;
+}
+
+void damage_tile_rect(const damage_map_t* map, int tx, int ty, disp_rect_t* rect)
+{
+    rect->x = tx * DAMAGE_TILE_SIZE;
+    rect->y = ty * DAMAGE_TILE_SIZE;
+    rect->w = map->width - rect->x;
+    rect->h = map->height - rect->y;
+    if (rect->w > DAMAGE_TILE_SIZE) rect->w = DAMAGE_TILE_SIZE;
+    if (rect->h > DAMAGE_TILE_SIZE) rect->h = DAMAGE_TILE_SIZE;
+}
+
+int damage_update(damage_map_t* map, const uint8_t* fb, int stride)
+{
+    uint64_t* swap;
+    disp_rect_t rect;
+
+    if (map == NULL || fb == NULL || map->hash == NULL) {
+        return 0;
+    }
+
+    swap = map->prev_hash;
+    map->prev_hash = map->hash;
+    map->hash = swap;
+    map->dirty_count = 0;
+
+    for (int ty = 0; ty < map->tiles_y; ty++) {
+        for (int tx = 0; tx < map->tiles_x; tx++) {
+            const int idx = ty * map->tiles_x + tx;
+
+            damage_tile_rect(map, tx, ty, &rect);
+            map->hash[idx] = damage_hash_block(fb, stride, rect.x, rect.y, rect.w, rect.h);
+            map->dirty[idx] = map->full_refresh || map->pending[idx] || (map->hash[idx] != map->prev_hash[idx]);
+            map->pending[idx] = 0;
+            map->dirty_count += map->dirty[idx];
+        }
+    }
+
+    map->full_refresh = 0;
+    return map->dirty_count;
+}
+
+int damage_collect_rects(const damage_map_t* map, disp_rect_t* rects, int max)
+{
+    if (map->dirty_count == 0) {
+        return 0;
+    }
+    return damage_collect_mask(map, map->dirty, rects, max);
+}
+
+int damage_collect_mask(const damage_map_t* map, const uint8_t* mask, disp_rect_t* rects, int max)
+{
+    // Rects are built in tile units first: row runs of set tiles are
+    // extended downwards while the run below has exactly the same span.
+    int count = 0;
+    int min_tx = map->tiles_x, min_ty = map->tiles_y, max_tx = -1, max_ty = -1;
+
+    if (max <= 0) {
+        return 0;
+    }
+
+    for (int ty = 0; ty < map->tiles_y; ty++) {
+        int tx = 0;
+        while (tx < map->tiles_x) {
+            int start, found = 0;
+
+            if (!mask[ty * map->tiles_x + tx]) {
+                tx++;
+                continue;
+            }
+
+            start = tx;
+            while (tx < map->tiles_x && mask[ty * map->tiles_x + tx]) {
+                tx++;
+            }
+
+            if (start < min_tx) min_tx = start;
+            if (tx - 1 > max_tx) max_tx = tx - 1;
+            if (ty < min_ty) min_ty = ty;
+            if (ty > max_ty) max_ty = ty;
+
+            for (int i = 0; i < count && count <= max; i++) {
+                if (rects[i].x == start && rects[i].w == tx - start && rects[i].y + rects[i].h == ty) {
+                    rects[i].h++;
+                    found = 1;
+                    break;
+                }
+            }
+
+            if (!found) {
+                if (count < max) {
+                    rects[count].x = start;
+                    rects[count].y = ty;
+                    rects[count].w = tx - start;
+                    rects[count].h = 1;
+                }
+                count++;
+            }
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Too fragmented, send the bounding box instead
+    if (count > max) {
+        rects[0].x = min_tx;
+        rects[0].y = min_ty;
+        rects[0].w = max_tx - min_tx + 1;
+        rects[0].h = max_ty - min_ty + 1;
+        count = 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        disp_rect_t last;
+        damage_tile_rect(map, rects[i].x + rects[i].w - 1, rects[i].y + rects[i].h - 1, &last);
+        rects[i].x *= DAMAGE_TILE_SIZE;
+        rects[i].y *= DAMAGE_TILE_SIZE;
+        rects[i].w = last.x + last.w - rects[i].x;
+        rects[i].h = last.y + last.h - rects[i].y;
+    }
+
+    return count;
+}
+
+void update_list_reset(update_list_t* list)
+{
+    list->count = 0;
+}
+
+int update_list_add_rect(update_list_t* list, const disp_rect_t* rect)
+{
+    if (list->count >= UPDATE_LIST_MAX) {
+        return -1;
+    }
+
+    update_cmd_t* cmd = &list->cmd[list->count++];
+    cmd->type = UPDATE_CMD_RECT;
+    cmd->rect = *rect;
+    cmd->src_x = rect->x;
+    cmd->src_y = rect->y;
+    cmd->level = 0;
+    cmd->region = UPDATE_REGION_DESKTOP;
+    return 0;
+}
+
+int update_list_add_move(update_list_t* list, const disp_rect_t* rect, int src_x, int src_y)
+{
+    if (list->count >= UPDATE_LIST_MAX) {
+        return -1;
+    }
+
+    update_cmd_t* cmd = &list->cmd[list->count++];
+    cmd->type = UPDATE_CMD_MOVE;
+    cmd->rect = *rect;
+    cmd->src_x = src_x;
+    cmd->src_y = src_y;
+    cmd->level = 0;
+    cmd->region = UPDATE_REGION_DESKTOP;
+    return 0;
+}
+
+int update_list_add_marker(update_list_t* list, int type)
+{
+    if (list->count >= UPDATE_LIST_MAX) {
+        return -1;
+    }
+
+    update_cmd_t* cmd = &list->cmd[list->count++];
+    memset(cmd, 0, sizeof(update_cmd_t));
+    cmd->type = type;
+    return 0;
+}
+
+int update_list_add_refine(update_list_t* list, const disp_rect_t* rect, int level)
+{
+    if (update_list_add_rect(list, rect) < 0) {
+        return -1;
+    }
+
+    list->cmd[list->count - 1].level = level;
+    return 0;
+}
+
+int update_list_add_video(update_list_t* list, const disp_rect_t* rect)
+{
+    if (update_list_add_rect(list, rect) < 0) {
+        return -1;
+    }
+
+    list->cmd[list->count - 1].region = UPDATE_REGION_VIDEO;
+    return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tile grid used for change detection, tile size in pixels
+#define DAMAGE_TILE_SIZE      32
+#define DAMAGE_MAX_RECTS      64
+#define UPDATE_LIST_MAX       (DAMAGE_MAX_RECTS + 8)
+
+// Update command types
+#define UPDATE_CMD_RECT         0   // encode pixels of rect
+#define UPDATE_CMD_MOVE         1   // copy (src_x,src_y,w,h) to rect on the device
+#define UPDATE_CMD_CACHE_DRAW   2   // position of the cached tile draw batch
+#define UPDATE_CMD_CACHE_STORE  3   // position of the cache store batch
+
+// Content class of a rect
+#define UPDATE_REGION_DESKTOP   0
+#define UPDATE_REGION_VIDEO     1
+
+typedef struct _disp_rect {
+    int x, y;
+    int w, h;
+} disp_rect_t;
+
+typedef struct _update_cmd {
+    int type;
+    disp_rect_t rect;
+    int src_x, src_y;
+    int level;          // refinement level of a rect, 0 = normal quality
+    int region;         // UPDATE_REGION_*
+} update_cmd_t;
+
+typedef struct _update_list {
+    int count;
+    update_cmd_t cmd[UPDATE_LIST_MAX];
+} update_list_t;
+
+// Per-frame tile hashes and dirty flags (framebuffer is 32bpp)
+typedef struct _damage_map {
+    int width, height;       // frame size in pixels
+    int tiles_x, tiles_y;    // grid size in tiles
+    uint64_t* hash;          // tile hashes of the current frame
+    uint64_t* prev_hash;     // tile hashes of the previous frame
+    uint8_t* dirty;          // 1 if the tile must be sent
+    uint8_t* pending;        // tiles forced dirty on the next update, see damage_merge
+    int dirty_count;
+    int full_refresh;        // mark every tile dirty on next update
+} damage_map_t;
+
+int  damage_init(damage_map_t* map, int width, int height);
+void damage_exit(damage_map_t* map);
+
+// Force the next damage_update to report the whole frame
+void damage_invalidate(damage_map_t* map);
+
+// Mark the tiles set in mask (laid out like map->dirty) dirty on the next
+// damage_update, whether they changed or not. Used for damage the device never got.
+void damage_merge(damage_map_t* map, const uint8_t* mask);
+
+// Hash all tiles of fb and compare with the previous frame, returns dirty tile count
+int  damage_update(damage_map_t* map, const uint8_t* fb, int stride);
+
+// Pixel rect covered by tile (tx,ty), clipped to the frame
+void damage_tile_rect(const damage_map_t* map, int tx, int ty, disp_rect_t* rect);
+
+// Merge dirty tiles into rectangles, returns rect count
+int  damage_collect_rects(const damage_map_t* map, disp_rect_t* rects, int max);
+
+// Same for any per-tile mask laid out like map->dirty
+int  damage_collect_mask(const damage_map_t* map, const uint8_t* mask, disp_rect_t* rects, int max);
+
+uint64_t damage_hash_block(const uint8_t* fb, int stride, int x, int y, int w, int h);
+
+void update_list_reset(update_list_t* list);
+int  update_list_add_rect(update_list_t* list, const disp_rect_t* rect);
+int  update_list_add_move(update_list_t* list, const disp_rect_t* rect, int src_x, int src_y);
+int  update_list_add_marker(update_list_t* list, int type);
+int  update_list_add_refine(update_list_t* list, const disp_rect_t* rect, int level);
+int  update_list_add_video(update_list_t* list, const disp_rect_t* rect);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,6 +9,7 @@
 
 #include "encoder.h"
 #include "tools.h"
+#include "work_pool.h"
 
 
 
@@ -16,45 +17,77 @@
 // RGB565 Encoder Implementation
 // ============================================================================
 
-int ImageEncoder::encode_rgb565(uint8_t* output, const uint8_t* input,int buffer_size, int x, int y, int width, int height)
+int ImageEncoder::encode_rgb565(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height)
 {
-    UNREFERENCED_PARAMETER(buffer_size);
     UNREFERENCED_PARAMETER(x);
     UNREFERENCED_PARAMETER(y);
 
-    int pos = 0;
-    const uint32_t* framebuffer = (const uint32_t*)input;
+    if (width * height * 2 > buffer_size) {
+        LOGE("RGB565 %dx%d exceeds buffer size %d\n", width, height, buffer_size);
+        return 0;
+    }
 
-    for (int row = 0; row < height; row++) {
-        for (int col = 0; col < width; col++) {
-            uint32_t pixel = *framebuffer++;
+    auto convert = [&](int first, int last) {
+        for (int row = first; row < last; row++) {
+            const uint32_t* framebuffer = (const uint32_t*)(input + row * stride);
+            uint8_t* out = output + row * width * 2;
+            for (int col = 0; col < width; col++) {
+                uint32_t pixel = *framebuffer++;
 
-            uint8_t r = (pixel >> 16) & 0xFF;
-            uint8_t g = (pixel >> 8) & 0xFF;
-            uint8_t b = pixel & 0xFF;
+                uint8_t r = (pixel >> 16) & 0xFF;
+                uint8_t g = (pixel >> 8) & 0xFF;
+                uint8_t b = pixel & 0xFF;
 
-            uint16_t rgb565 = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+                uint16_t rgb565 = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
 
-            output[pos++] = rgb565 & 0xFF;
-            output[pos++] = (rgb565 >> 8) & 0xFF;
+                *out++ = rgb565 & 0xFF;
+                *out++ = (rgb565 >> 8) & 0xFF;
+            }
         }
+    };
+
+    const int jobs = parallel_jobs(height, width * height);
+    if (jobs > 1) {
+        m_pool->run(jobs, [&](int job) { convert(height * job / jobs, height * (job + 1) / jobs); });
+    } else {
+        convert(0, height);
     }
-    return pos;
+    return width * height * 2;
 }
 
 // ============================================================================
 // RGB888 Encoder Implementation
 // ============================================================================
 
-int ImageEncoder::encode_rgb888(uint8_t* output, const uint8_t* input,int buffer_size, int x, int y, int width, int height)
+int ImageEncoder::encode_rgb888(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height)
 {
-    UNREFERENCED_PARAMETER(buffer_size);
     UNREFERENCED_PARAMETER(x);
     UNREFERENCED_PARAMETER(y);
 
-    const int total_pixels = width * height;
-    memcpy(output, input, total_pixels * 4);
-    return total_pixels * 4;
+    const int row_size = width * 4;
+
+    if (row_size * height > buffer_size) {
+        LOGE("RGB888 %dx%d exceeds buffer size %d\n", width, height, buffer_size);
+        return 0;
+    }
+
+    auto copy = [&](int first, int last) {
+        if (stride == row_size) {
+            memcpy(&output[row_size * first], &input[stride * first], row_size * (last - first));
+        } else {
+            for (int row = first; row < last; row++) {
+                memcpy(&output[row_size * row], &input[stride * row], row_size);
+            }
+        }
+    };
+
+    const int jobs = parallel_jobs(height, width * height);
+    if (jobs > 1) {
+        m_pool->run(jobs, [&](int job) { copy(height * job / jobs, height * (job + 1) / jobs); });
+    } else {
+        copy(0, height);
+    }
+    return row_size * height;
 }
 
 // ============================================================================
@@ -68,52 +101,97 @@ static void jpeg_error_exit(j_common_ptr cinfo)
     longjmp(myerr->setjmp_buffer, 1);
 }
 
-void ImageEncoder::create_jpeg_encoder()
+static jpeg_encoder_private_t* jpeg_private_create()
 {
     // Allocate private structure for JPEG resources
-    m_jpeg_private = new struct jpeg_encoder_private_t;
-    if (m_jpeg_private == nullptr) {
+    jpeg_encoder_private_t* priv = new struct jpeg_encoder_private_t;
+    if (priv == nullptr) {
         LOGE("Failed to allocate JPEG private structure\n");
-        return;
+        return nullptr;
     }
 
     // Setup error handling
-    m_jpeg_private->cinfo.err = jpeg_std_error(&m_jpeg_private->jerr.pub);
-    m_jpeg_private->jerr.pub.error_exit = &jpeg_error_exit;
+    priv->cinfo.err = jpeg_std_error(&priv->jerr.pub);
+    priv->jerr.pub.error_exit = &jpeg_error_exit;
 
     // Initialize JPEG compression object
-    jpeg_create_compress(&m_jpeg_private->cinfo);
+    jpeg_create_compress(&priv->cinfo);
+    return priv;
+}
+
+static void jpeg_private_destroy(jpeg_encoder_private_t* priv)
+{
+    if (priv != nullptr) {
+        // Cleanup JPEG compression object
+        jpeg_destroy_compress(&priv->cinfo);
+
+        // Free private structure
+        delete priv;
+    }
+}
 
+void ImageEncoder::create_jpeg_encoder()
+{
+    m_jpeg_private = jpeg_private_create();
     LOGD("Created JPEG encoder\n");
 }
 
 void ImageEncoder::destroy_jpeg_encoder()
 {
-    if (m_jpeg_private != nullptr) {
-        jpeg_encoder_private_t* priv = m_jpeg_private;
+    jpeg_private_destroy(m_jpeg_private);
+    m_jpeg_private = nullptr;
+    for (jpeg_encoder_private_t* priv : m_jpeg_workers) {
+        jpeg_private_destroy(priv);
+    }
+    m_jpeg_workers.clear();
+}
 
-        // Cleanup JPEG compression object
-        jpeg_destroy_compress(&priv->cinfo);
+// ============================================================================
+// Parallel encoding
+// ============================================================================
 
+void ImageEncoder::set_pool(WorkPool* pool)
+{
+    m_pool = pool;
+}
 
-        // Free private structure
-        delete priv;
-        m_jpeg_private = nullptr;
+int ImageEncoder::parallel_jobs(int items, int pixels) const
+{
+    if (m_pool == nullptr || pixels < ENCODE_PARALLEL_MIN_PIXELS) {
+        return 1;
+    }
+    return items < m_pool->threads() ? items : m_pool->threads();
+}
+
+// Compressor of parallel JPEG job index, job 0 uses the main one. Created on
+// the encoding thread before the jobs start.
+jpeg_encoder_private_t* ImageEncoder::jpeg_job_private(int index)
+{
+    if (index == 0) {
+        return m_jpeg_private;
+    }
+    while ((int)m_jpeg_workers.size() < index) {
+        m_jpeg_workers.push_back(jpeg_private_create());
     }
+    return m_jpeg_workers[index - 1];
 }
 
-int ImageEncoder::encode_jpeg(uint8_t* output, const uint8_t* input,int buffer_size, int x, int y, int width, int height)
+int ImageEncoder::encode_jpeg(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height)
 {
     UNREFERENCED_PARAMETER(x);
     UNREFERENCED_PARAMETER(y);
-    if (m_jpeg_private == nullptr) {
+    return compress_jpeg(m_jpeg_private, output, input, stride, buffer_size, width, height);
+}
+
+int ImageEncoder::compress_jpeg(jpeg_encoder_private_t* priv, uint8_t* output, const uint8_t* input, int stride, int buffer_size, int width, int height)
+{
+    if (priv == nullptr) {
         LOGE("JPEG encoder not initialized\n");
         return 0;
     }
 
     int pixel_bytes=4;
 
-    jpeg_encoder_private_t* priv = m_jpeg_private;
     struct jpeg_compress_struct* cinfo = &priv->cinfo;
     JSAMPROW row_ptr[1];
 
@@ -125,27 +203,358 @@ int ImageEncoder::encode_jpeg(uint8_t* output, const uint8_t* input,int buffer_s
     cinfo->input_components = pixel_bytes;
     cinfo->in_color_space = JCS_EXT_BGRX;
     jpeg_set_defaults(cinfo);
+    if (m_jpeg_profile == JPEG_PROFILE_ESP32) {
+        // Pin what the ESP32 decoders handle fastest instead of relying on library defaults
+        jpeg_set_colorspace(cinfo, JCS_YCbCr);
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 2;
+        for (int c = 1; c < 3; c++) {
+            cinfo->comp_info[c].h_samp_factor = 1;
+            cinfo->comp_info[c].v_samp_factor = 1;
+        }
+        cinfo->optimize_coding = FALSE;
+        cinfo->arith_code = FALSE;
+        cinfo->restart_interval = 0;
+    }
     jpeg_set_quality(cinfo, m_quality, TRUE);
 
-    // Set destination
+    // Set destination, libjpeg switches to its own buffer when output is too small
+    unsigned char* jpeg_buf = output;
     unsigned long jpeg_size = buffer_size;
-    jpeg_mem_dest(cinfo, &output, &jpeg_size);
+    jpeg_mem_dest(cinfo, &jpeg_buf, &jpeg_size);
 
     // Start compression
     jpeg_start_compress(cinfo, TRUE);
 
     // Process each row
-    int row_size =width * pixel_bytes;
     for (int row = 0; row < height; row++) {
-        row_ptr[0] = (JSAMPROW)(&input[row_size * row]);
+        row_ptr[0] = (JSAMPROW)(&input[stride * row]);
         jpeg_write_scanlines(cinfo, row_ptr, 1);
     }
 
     // Finish compression
     jpeg_finish_compress(cinfo);
+
+    if (jpeg_buf != output) {
+        LOGE("JPEG %dx%d size %lu exceeds buffer size %d\n", width, height, jpeg_size, buffer_size);
+        free(jpeg_buf);
+        return 0;
+    }
     return jpeg_size;
 }
 
+// ============================================================================
+// Incremental JPEG: MCU row cache
+// ============================================================================
+//
+// Full-frame JPEG is encoded with a restart marker after every MCU row, so each
+// row is an independent entropy segment (DC prediction restarts). Only rows
+// whose pixels changed are compressed, as one stacked sub-image with the same
+// width and tables; the frame is then spliced from cached and fresh segments
+// with renumbered RSTn markers and stays a standard baseline JPEG.
+
+#define JPEG_MCU_ROW_HEIGHT  16   // 4:2:0 sampling from jpeg_set_defaults
+
+void ImageEncoder::set_row_cache(bool enable)
+{
+    // A spliced full frame cannot be decoded strip by strip
+    m_row_cache = enable && (m_type == IMAGE_TYPE_JPG) && (m_jpeg_profile == JPEG_PROFILE_DEFAULT);
+    m_row_width = 0;
+    m_row_height = 0;
+}
+
+void ImageEncoder::set_quality(int quality)
+{
+    m_quality = quality;
+}
+
+void ImageEncoder::set_jpeg_profile(int profile, int decode_pixels)
+{
+    m_jpeg_profile = profile;
+    m_decode_pixels = decode_pixels;
+    if (profile != JPEG_PROFILE_DEFAULT) {
+        m_row_cache = false;
+    }
+}
+
+int ImageEncoder::encode_jpeg_strips(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height)
+{
+    int strip_height = height;
+    int total_size = 0;
+
+    if (m_decode_pixels > 0) {
+        strip_height = (m_decode_pixels / width) / JPEG_MCU_ROW_HEIGHT * JPEG_MCU_ROW_HEIGHT;
+        if (strip_height < JPEG_MCU_ROW_HEIGHT) {
+            strip_height = JPEG_MCU_ROW_HEIGHT;
+        }
+    }
+
+    const int strips = (height + strip_height - 1) / strip_height;
+    const int jobs = parallel_jobs(strips, width * height);
+    if (jobs > 1) {
+        return encode_jpeg_strips_parallel(output, input, stride, buffer_size, x, y, width, height, strip_height, jobs);
+    }
+
+    for (int row = 0; row < height; row += strip_height) {
+        const int lines = height - row < strip_height ? height - row : strip_height;
+        const int body_size = buffer_size - total_size - (int)sizeof(image_frame_header_t);
+        uint8_t* packet = output + total_size;
+
+        if (body_size <= 0) {
+            return 0;
+        }
+        int image_size = encode_jpeg(packet + sizeof(image_frame_header_t), input + row * stride, stride, body_size, x, y + row, width, lines);
+        if (image_size <= 0) {
+            return 0;
+        }
+        total_size += write_header(packet, IMAGE_TYPE_JPG, image_size, x, y + row, width, lines);
+    }
+    LOGD("encode_jpeg_strips ...%dx%d in strips of %d lines, size:%d\n", width, height, strip_height, total_size);
+    return total_size;
+}
+
+// Strips are compressed by the pool into buffers of their own, job j taking
+// every jobs-th strip with compressor j, then packed in order.
+int ImageEncoder::encode_jpeg_strips_parallel(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height, int strip_height, int jobs)
+{
+    const int strips = (height + strip_height - 1) / strip_height;
+    std::vector<int> sizes(strips, 0);
+    int total_size = 0;
+
+    for (int j = 1; j < jobs; j++) {
+        if (jpeg_job_private(j) == nullptr) {
+            return 0;
+        }
+    }
+    if ((int)m_strip_buf.size() < strips) {
+        m_strip_buf.resize(strips);
+    }
+    for (int i = 0; i < strips; i++) {
+        // Raw size is a safe bound, the packet limit below is the real one
+        m_strip_buf[i].resize(strip_height * width * 4 + 1024);
+    }
+
+    m_pool->run(jobs, [&](int job) {
+        jpeg_encoder_private_t* priv = jpeg_job_private(job);
+        for (int i = job; i < strips; i += jobs) {
+            const int row = i * strip_height;
+            const int lines = height - row < strip_height ? height - row : strip_height;
+            sizes[i] = compress_jpeg(priv, m_strip_buf[i].data(), input + row * stride, stride, (int)m_strip_buf[i].size(), width, lines);
+        }
+    });
+
+    for (int i = 0; i < strips; i++) {
+        const int row = i * strip_height;
+        const int lines = height - row < strip_height ? height - row : strip_height;
+        uint8_t* packet = output + total_size;
+
+        if (sizes[i] <= 0 || total_size + (int)sizeof(image_frame_header_t) + sizes[i] > buffer_size) {
+            return 0;
+        }
+        memcpy(packet + sizeof(image_frame_header_t), m_strip_buf[i].data(), sizes[i]);
+        total_size += write_header(packet, IMAGE_TYPE_JPG, sizes[i], x, y + row, width, lines);
+    }
+    LOGD("encode_jpeg_strips ...%dx%d in strips of %d lines on %d jobs, size:%d\n", width, height, strip_height, jobs, total_size);
+    return total_size;
+}
+
+void ImageEncoder::set_region_tags(bool enable)
+{
+    m_region_tags = enable;
+}
+
+void ImageEncoder::set_region(_u32 region)
+{
+    m_region = region;
+}
+
+void ImageEncoder::set_timestamps(bool enable)
+{
+    m_timestamps = enable;
+}
+
+void ImageEncoder::set_capture_time(int64_t capture_us)
+{
+    m_capture_us = capture_us;
+}
+
+void ImageEncoder::set_packet_version(int version)
+{
+    m_packet_version = version;
+}
+
+static int jpeg_be16(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// Compress the MCU rows listed in rows (ascending) as one stacked sub-image with
+// priv and store their entropy segments in m_row_data. With header set, the
+// tables and frame header, patched to the full height, are returned in it.
+bool ImageEncoder::compress_rows(jpeg_encoder_private_t* priv, const uint8_t* input, int stride, int width, int height, const int* rows, int count, std::vector<uint8_t>* header)
+{
+    struct jpeg_compress_struct* cinfo = &priv->cinfo;
+    JSAMPROW row_ptr[1];
+
+    // The partial bottom row can only be the last one of the sub-image
+    const int last = rows[count - 1];
+    const int sub_height = (count - 1) * JPEG_MCU_ROW_HEIGHT +
+                           ((height - last * JPEG_MCU_ROW_HEIGHT < JPEG_MCU_ROW_HEIGHT) ? height - last * JPEG_MCU_ROW_HEIGHT : JPEG_MCU_ROW_HEIGHT);
+    unsigned char* jpeg_buf = nullptr;
+    unsigned long jpeg_size = 0;
+
+    jpeg_abort_compress(cinfo);
+    cinfo->image_width = width;
+    cinfo->image_height = sub_height;
+    cinfo->input_components = 4;
+    cinfo->in_color_space = JCS_EXT_BGRX;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, m_quality, TRUE);
+    cinfo->restart_in_rows = 1;
+    jpeg_mem_dest(cinfo, &jpeg_buf, &jpeg_size);
+
+    jpeg_start_compress(cinfo, TRUE);
+    for (int i = 0; i < count; i++) {
+        const int y = rows[i] * JPEG_MCU_ROW_HEIGHT;
+        for (int line = 0; line < JPEG_MCU_ROW_HEIGHT && y + line < height; line++) {
+            row_ptr[0] = (JSAMPROW)(&input[stride * (y + line)]);
+            jpeg_write_scanlines(cinfo, row_ptr, 1);
+        }
+    }
+    jpeg_finish_compress(cinfo);
+
+    // Locate SOF0 and the end of the SOS header
+    int pos = 2, sof = -1, scan = -1;
+    while (pos + 4 <= (int)jpeg_size && jpeg_buf[pos] == 0xFF) {
+        const int marker = jpeg_buf[pos + 1];
+        const int len = jpeg_be16(&jpeg_buf[pos + 2]);
+        if (marker == 0xC0) {
+            sof = pos;
+        }
+        pos += 2 + len;
+        if (marker == 0xDA) {
+            scan = pos;
+            break;
+        }
+    }
+
+    // Split the entropy data on RSTn markers
+    int seg = 0;
+    int start = scan;
+    for (int i = scan; scan > 0 && i + 1 < (int)jpeg_size && seg < count; i++) {
+        if (jpeg_buf[i] != 0xFF) continue;
+        const int marker = jpeg_buf[i + 1];
+        if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0xD9) {
+            m_row_data[rows[seg++]].assign(jpeg_buf + start, jpeg_buf + i);
+            start = i + 2;
+            i++;
+        }
+    }
+
+    if (sof < 0 || scan < 0 || seg != count) {
+        LOGE("JPEG row split failed: sof=%d sos=%d segments=%d/%d\n", sof, scan, seg, count);
+        free(jpeg_buf);
+        return false;
+    }
+
+    if (header != nullptr) {
+        header->assign(jpeg_buf, jpeg_buf + scan);
+        (*header)[sof + 5] = (uint8_t)(height >> 8);
+        (*header)[sof + 6] = (uint8_t)(height & 0xFF);
+    }
+    free(jpeg_buf);
+    return true;
+}
+
+// Changed rows are compressed in contiguous groups, one per parallel job. The
+// groups share quality and tables, so their segments splice like cached ones.
+int ImageEncoder::encode_jpeg_rows(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int width, int height)
+{
+    const int rows = (height + JPEG_MCU_ROW_HEIGHT - 1) / JPEG_MCU_ROW_HEIGHT;
+    std::vector<int> changed;
+
+    if (m_jpeg_private == nullptr) {
+        LOGE("JPEG encoder not initialized\n");
+        return 0;
+    }
+
+    if (m_row_width != width || m_row_height != height || m_row_quality != m_quality) {
+        m_row_width = width;
+        m_row_height = height;
+        m_row_quality = m_quality;
+        m_row_header.clear();
+        m_row_hash.assign(rows, 0);
+        m_row_data.assign(rows, std::vector<uint8_t>());
+    }
+
+    for (int r = 0; r < rows; r++) {
+        const int y = r * JPEG_MCU_ROW_HEIGHT;
+        const int h = (height - y < JPEG_MCU_ROW_HEIGHT) ? height - y : JPEG_MCU_ROW_HEIGHT;
+        const uint64_t hash = damage_hash_block(input, stride, 0, y, width, h);
+
+        if (m_row_data[r].empty() || m_row_header.empty() || hash != m_row_hash[r]) {
+            m_row_hash[r] = hash;
+            changed.push_back(r);
+        }
+    }
+
+    if (!changed.empty()) {
+        const int count = (int)changed.size();
+        int jobs = parallel_jobs(count, count * JPEG_MCU_ROW_HEIGHT * width);
+        bool ok = true;
+
+        for (int j = 1; j < jobs; j++) {
+            if (jpeg_job_private(j) == nullptr) {
+                jobs = 1;
+                break;
+            }
+        }
+        std::vector<uint8_t>* header = m_row_header.empty() ? &m_row_header : nullptr;
+        if (jobs > 1) {
+            std::vector<char> done(jobs, 0);
+            m_pool->run(jobs, [&](int job) {
+                const int first = count * job / jobs;
+                const int last = count * (job + 1) / jobs;
+                done[job] = compress_rows(jpeg_job_private(job), input, stride, width, height,
+                                          &changed[first], last - first, job == 0 ? header : nullptr);
+            });
+            for (int j = 0; j < jobs; j++) {
+                ok = ok && done[j];
+            }
+        } else {
+            ok = compress_rows(m_jpeg_private, input, stride, width, height, changed.data(), count, header);
+        }
+
+        if (!ok) {
+            m_row_width = 0;
+            return encode_jpeg(output, input, stride, buffer_size, 0, 0, width, height);
+        }
+    }
+
+    // Splice header, segments with renumbered restart markers and EOI
+    int size = (int)m_row_header.size();
+    for (int r = 0; r < rows; r++) {
+        size += (int)m_row_data[r].size() + 2;
+    }
+    if (size > buffer_size) {
+        LOGE("JPEG rows size %d exceeds buffer size %d\n", size, buffer_size);
+        return 0;
+    }
+
+    uint8_t* out = output;
+    memcpy(out, m_row_header.data(), m_row_header.size());
+    out += m_row_header.size();
+    for (int r = 0; r < rows; r++) {
+        memcpy(out, m_row_data[r].data(), m_row_data[r].size());
+        out += m_row_data[r].size();
+        *out++ = 0xFF;
+        *out++ = (r == rows - 1) ? 0xD9 : (uint8_t)(0xD0 + (r & 7));
+    }
+
+    LOGD("encode_jpeg_rows ...changed %d/%d rows size:%d\n", (int)changed.size(), rows, size);
+    return size;
+}
+
 // ============================================================================
 // ImageEncoder Class Implementation
 // ============================================================================
@@ -153,9 +562,22 @@ int ImageEncoder::encode_jpeg(uint8_t* output, const uint8_t* input,int buffer_s
 ImageEncoder::ImageEncoder(int type, int quality)
 {
     m_counter=0;
+    m_frame_seq = 0;
     m_type =type;
     m_quality=quality;
     m_jpeg_private = nullptr;
+    m_row_cache = false;
+    m_row_width = 0;
+    m_row_height = 0;
+    m_row_quality = 0;
+    m_region_tags = false;
+    m_region = FRAME_REGION_DESKTOP;
+    m_packet_version = 1;
+    m_timestamps = false;
+    m_capture_us = 0;
+    m_jpeg_profile = JPEG_PROFILE_DEFAULT;
+    m_decode_pixels = 0;
+    m_pool = nullptr;
     if(m_type == IMAGE_TYPE_JPG){
         create_jpeg_encoder();
     }
@@ -175,34 +597,213 @@ ImageEncoder::~ImageEncoder()
 
 int ImageEncoder::encode(uint8_t* output, const uint8_t* input,int buffer_size, int x, int y, int width, int height)
 {
-    int image_size=0,total_size=0;
+    if (m_row_cache && (width > 0) && (height > 0)) {
+        int image_size = encode_jpeg_rows(output + sizeof(image_frame_header_t), input, width * 4,
+                                          buffer_size - (int)sizeof(image_frame_header_t), width, height);
+        if (image_size <= 0) {
+            return 0;
+        }
+        return write_header(output, m_type, image_size, x, y, width, height);
+    }
+    return encode_pixels(output, input, width * 4, buffer_size, x, y, width, height);
+}
+
+int ImageEncoder::encode_rect(uint8_t* output, const uint8_t* frame, int stride, int buffer_size, int x, int y, int width, int height)
+{
+    return encode_pixels(output, frame + y * stride + x * 4, stride, buffer_size, x, y, width, height);
+}
+
+int ImageEncoder::encode_rect_as(_u32 type, int quality, uint8_t* output, const uint8_t* frame, int stride, int buffer_size, int x, int y, int width, int height)
+{
+    const int type_saved = m_type;
+    const int quality_saved = m_quality;
+    int size;
+
+    if (type == IMAGE_TYPE_JPG && m_jpeg_private == nullptr) {
+        LOGE("JPEG encoder not initialized\n");
+        return 0;
+    }
+
+    m_type = type;
+    m_quality = quality;
+    size = encode_rect(output, frame, stride, buffer_size, x, y, width, height);
+    m_type = type_saved;
+    m_quality = quality_saved;
+    return size;
+}
+
+int ImageEncoder::encode_pixels(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height)
+{
+    int image_size=0;
+    int body_size = buffer_size - (int)sizeof(image_frame_header_t);
     uint8_t* buffer_body = output + sizeof(image_frame_header_t);
-    image_frame_header_t* header = (image_frame_header_t*)output;
 
     if((width > 0) && (height > 0)) {
         if (m_type == IMAGE_TYPE_RGB565) {
-            image_size = encode_rgb565(buffer_body, input, buffer_size, x, y, width, height);
+            image_size = encode_rgb565(buffer_body, input, stride, body_size, x, y, width, height);
             LOGD("encode_rgb565 ...size:%d\n",image_size);
         }
         else if (m_type == IMAGE_TYPE_RGB888) {
-            image_size = encode_rgb888(buffer_body, input, buffer_size, x, y, width, height);
+            image_size = encode_rgb888(buffer_body, input, stride, body_size, x, y, width, height);
             LOGD("encode_rgb888 ...size:%d\n",image_size);
         }
+        else if (m_jpeg_profile == JPEG_PROFILE_ESP32) {
+            return encode_jpeg_strips(output, input, stride, buffer_size, x, y, width, height);
+        }
         else  { //IMAGE_TYPE_JPG
-            image_size = encode_jpeg(buffer_body, input, buffer_size, x, y, width, height);
+            image_size = encode_jpeg(buffer_body, input, stride, body_size, x, y, width, height);
             LOGD("encode_jpeg ...size:%d\n",image_size);
         }
+
+        if (image_size <= 0) {
+            return 0;
+        }
+    }
+
+    return write_header(output, m_type, image_size, x, y, width, height);
+}
+
+int ImageEncoder::encode_move(uint8_t* output, int buffer_size, int x, int y, int width, int height, int src_x, int src_y)
+{
+    image_move_t* move = (image_move_t*)(output + sizeof(image_frame_header_t));
+
+    if (buffer_size < (int)(sizeof(image_frame_header_t) + sizeof(image_move_t))) {
+        return 0;
+    }
+
+    move->src_x = (src_x);
+    move->src_y = (src_y);
+    LOGD("encode_move ...(%d,%d) -> (%d,%d) %dx%d\n", src_x, src_y, x, y, width, height);
+    return write_header(output, IMAGE_TYPE_MOVE, sizeof(image_move_t), x, y, width, height);
+}
+
+int ImageEncoder::encode_frame_begin(uint8_t* output, int buffer_size, int width, int height)
+{
+    if (buffer_size < (int)sizeof(image_frame_header_t)) {
+        return 0;
+    }
+
+    m_frame_seq = m_counter;
+    return write_header(output, IMAGE_TYPE_FRAME_BEGIN, 0, 0, 0, width, height);
+}
+
+int ImageEncoder::encode_frame_commit(uint8_t* output, int buffer_size, int width, int height)
+{
+    image_commit_t* commit = (image_commit_t*)(output + sizeof(image_frame_header_t));
+
+    if (buffer_size < (int)(sizeof(image_frame_header_t) + sizeof(image_commit_t))) {
+        return 0;
+    }
+
+    commit->frame_seq = m_frame_seq;
+    commit->packets = m_counter - m_frame_seq - 1;
+    return write_header(output, IMAGE_TYPE_FRAME_COMMIT, sizeof(image_commit_t), 0, 0, width, height);
+}
+
+int ImageEncoder::encode_panel(uint8_t* output, int buffer_size, int panel)
+{
+    if (buffer_size < (int)sizeof(image_frame_header_t)) {
+        return 0;
+    }
+    return write_header(output, IMAGE_TYPE_PANEL, 0, panel, 0, 0, 0);
+}
+
+int ImageEncoder::encode_ping(uint8_t* output, int buffer_size, _u32 seq, int64_t host_us)
+{
+    host_ping_t* ping = (host_ping_t*)(output + sizeof(image_frame_header_t));
+
+    if (buffer_size < (int)(sizeof(image_frame_header_t) + sizeof(host_ping_t))) {
+        return 0;
     }
+
+    ping->seq = seq;
+    ping->reserved = 0;
+    ping->host_us = host_us;
+    return write_header(output, IMAGE_TYPE_PING, sizeof(host_ping_t), 0, 0, 0, 0);
+}
+
+int ImageEncoder::encode_cursor_shape(uint8_t* output, int buffer_size, int slot, int type, int hot_x, int hot_y, int width, int height, int pitch, const uint8_t* pixels)
+{
+    cursor_shape_t* shape = (cursor_shape_t*)(output + sizeof(image_frame_header_t));
+    uint8_t* dst = output + sizeof(image_frame_header_t) + sizeof(cursor_shape_t);
+    const int image_size = (int)sizeof(cursor_shape_t) + width * height * 4;
+
+    if (width <= 0 || height <= 0 || width > CURSOR_MAX_SIZE || height > CURSOR_MAX_SIZE) {
+        return 0;
+    }
+    if (buffer_size < (int)sizeof(image_frame_header_t) + image_size) {
+        return 0;
+    }
+
+    shape->slot = slot;
+    shape->type = type;
+    shape->hot_x = hot_x;
+    shape->hot_y = hot_y;
+    for (int y = 0; y < height; y++) {
+        memcpy(dst + y * width * 4, pixels + y * pitch, width * 4);
+    }
+    LOGD("encode_cursor_shape ...slot:%d type:%d %dx%d\n", slot, type, width, height);
+    return write_header(output, IMAGE_TYPE_CURSOR_SHAPE, image_size, 0, 0, width, height);
+}
+
+int ImageEncoder::encode_cursor_pos(uint8_t* output, int buffer_size, int x, int y, int slot, bool visible)
+{
+    cursor_pos_t* pos = (cursor_pos_t*)(output + sizeof(image_frame_header_t));
+
+    if (buffer_size < (int)(sizeof(image_frame_header_t) + sizeof(cursor_pos_t))) {
+        return 0;
+    }
+
+    pos->x = (int16_t)x;
+    pos->y = (int16_t)y;
+    pos->slot = slot;
+    pos->visible = visible ? 1 : 0;
+    return write_header(output, IMAGE_TYPE_CURSOR_POS, sizeof(cursor_pos_t), 0, 0, 0, 0);
+}
+
+int ImageEncoder::encode_cache_refs(uint8_t* output, int buffer_size, _u32 type, const tile_cache_ref_t* refs, int count)
+{
+    const int image_size = count * (int)sizeof(tile_cache_ref_t);
+
+    if (buffer_size < (int)sizeof(image_frame_header_t) + image_size) {
+        return 0;
+    }
+
+    memcpy(output + sizeof(image_frame_header_t), refs, image_size);
+    LOGD("encode_cache_refs ...type:0x%x count:%d\n", type, count);
+    return write_header(output, type, image_size, 0, 0, DAMAGE_TILE_SIZE, DAMAGE_TILE_SIZE);
+}
+
+int ImageEncoder::write_header(uint8_t* output, _u32 type, int image_size, int x, int y, int width, int height)
+{
+    int total_size=0;
+    image_frame_header_t* header = (image_frame_header_t*)output;
+
+    static_assert(sizeof(image_frame_header_t) == sizeof(frame_v2_rect_t), "v1 and v2 packet headers must be interchangeable");
+    if (m_packet_version == 2) {
+        frame_v2_rect_t* rect = (frame_v2_rect_t*)output;
+        memset(rect, 0, sizeof(frame_v2_rect_t));
+        rect->img_type = type;
+        rect->img_len = image_size;
+        rect->x = x;
+        rect->y = y;
+        rect->w = width;
+        rect->h = height;
+        rect->region = (_u16)m_region;
+        m_counter++;
+        return frame_packet_entry_size(image_size);
+    }
+
     header->magic_id = (FRAME_MAGIC_ID);
-    header->img_type = (m_type);
+    header->img_type = (type);
     header->img_len = (image_size);
     header->img_cnt = (m_counter);
     header->img_x = (x);
     header->img_y = (y);
     header->img_w = (width);
     header->img_h = (height);
-    header->reserved[0] =0X12345678;
-    header->reserved[1] =0X87654321;
+    header->reserved[0] = m_timestamps ? (_u32)m_capture_us : 0X12345678;
+    header->reserved[1] = m_region_tags ? m_region : 0X87654321;
     m_counter++;
 
     total_size = image_size + sizeof(image_frame_header_t);
@@ -1,10 +1,14 @@
 #pragma once
 
 #include "basetype.h"
+#include "tile_cache.h"
+#include "frame_packet.h"
+#include "cursor.h"
 #include "jerror.h"
 #include "jpeglib.h"
 #include <stdint.h>
 #include <memory>
+#include <vector>
 
 #ifdef _MSC_VER
 #define PACK(__Declaration__) __pragma(pack(push, 1)) __Declaration__ __pragma(pack(pop))
@@ -12,6 +16,11 @@
 
 #define FB_DISP_DEFAULT_PIXEL_BITS  32
 
+// Smaller images are encoded on the calling thread alone
+#define ENCODE_PARALLEL_MIN_PIXELS  (256 * 256)
+
+class WorkPool;
+
 typedef struct _image_frame_header_t {
     _u32 magic_id;
     _u32 img_type;
@@ -22,6 +31,24 @@ typedef struct _image_frame_header_t {
     _u32 reserved[2];
 } image_frame_header_t;
 
+// Payload of an IMAGE_TYPE_MOVE packet: the device copies the (img_w x img_h)
+// block at (src_x,src_y) of its current framebuffer to (img_x,img_y).
+// Packets of one update are concatenated in a transfer, each 32-byte aligned.
+typedef struct _image_move_t {
+    _u16 src_x, src_y;
+    _u32 reserved;
+} image_move_t;
+
+// Frames of a DEV_FEATURE_COMMIT device are framed by an IMAGE_TYPE_FRAME_BEGIN
+// packet (no payload, img_w/img_h = frame size) and an IMAGE_TYPE_FRAME_COMMIT
+// packet carrying this payload. frame_seq is the img_cnt of the begin packet and
+// the packets in between have consecutive img_cnt values, so a device that sees
+// a gap or no commit discards the frame instead of flipping a torn one.
+typedef struct _image_commit_t {
+    _u32 frame_seq;
+    _u32 packets;       // packets between begin and commit
+} image_commit_t;
+
 
 // ============================================================================
 // JPEG Encoder Implementation
@@ -54,18 +81,94 @@ public:
 
     // Public interface
     int encode(uint8_t* output, const uint8_t* input,int buffer_size,int x, int y, int width, int height);
+
+    // Encode rect (x,y,width,height) of a full frame with the given stride
+    int encode_rect(uint8_t* output, const uint8_t* frame, int stride, int buffer_size, int x, int y, int width, int height);
+
+    // Move command: copy (src_x,src_y) block of the device framebuffer to (x,y)
+    int encode_move(uint8_t* output, int buffer_size, int x, int y, int width, int height, int src_x, int src_y);
+
+    // IMAGE_TYPE_CACHE_DRAW / IMAGE_TYPE_CACHE_STORE batch of tile_cache_ref_t
+    int encode_cache_refs(uint8_t* output, int buffer_size, _u32 type, const tile_cache_ref_t* refs, int count);
+
+    // Frame begin/commit markers, see image_commit_t
+    int encode_frame_begin(uint8_t* output, int buffer_size, int width, int height);
+    int encode_frame_commit(uint8_t* output, int buffer_size, int width, int height);
+
+    // Panel select packet of DEV_FEATURE_PANELS devices, first in a transfer
+    int encode_panel(uint8_t* output, int buffer_size, int panel);
+
+    // Clock sync ping, a transfer of its own
+    int encode_ping(uint8_t* output, int buffer_size, _u32 seq, int64_t host_us);
+
+    // Hardware cursor, see cursor_shape_t / cursor_pos_t. pixels are 32bpp with the given pitch.
+    int encode_cursor_shape(uint8_t* output, int buffer_size, int slot, int type, int hot_x, int hot_y, int width, int height, int pitch, const uint8_t* pixels);
+    int encode_cursor_pos(uint8_t* output, int buffer_size, int x, int y, int slot, bool visible);
+
+    // img_cnt of the next packet
+    _u32 get_counter() const { return m_counter; }
+
+    // Encode rect with another codec or quality than the configured one
+    int encode_rect_as(_u32 type, int quality, uint8_t* output, const uint8_t* frame, int stride, int buffer_size, int x, int y, int width, int height);
+
+    // JPEG quality of the following frames
+    void set_quality(int quality);
+
+    // JPEG_PROFILE_* of the device. JPEG_PROFILE_ESP32 pins baseline 4:2:0 without
+    // optimized Huffman tables and cuts JPEG rects into horizontal strips of whole
+    // MCU rows, each a packet of its own with at most decode_pixels pixels
+    // (0 = no limit), so the device decodes and blits strip by strip.
+    void set_jpeg_profile(int profile, int decode_pixels);
+
+    // Reuse compressed MCU rows of unchanged content for full-frame JPEG
+    void set_row_cache(bool enable);
+
+    // Split large images into jobs on pool: row chunks for RGB, JPEG strips,
+    // groups of changed MCU rows for the row cache. nullptr = single-threaded.
+    void set_pool(WorkPool* pool);
+
+    // Tag packets with a FRAME_REGION_* in reserved[1] instead of the fixed pattern
+    void set_region_tags(bool enable);
+    void set_region(_u32 region);
+
+    // Put the capture time of the frame (low 32 bits, us) in reserved[0]
+    void set_timestamps(bool enable);
+    void set_capture_time(int64_t capture_us);
+
+    // 1: packets start with image_frame_header_t, 2: with frame_v2_rect_t
+    void set_packet_version(int version);
 private:
+    int encode_pixels(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height);
+
+    int write_header(uint8_t* output, _u32 type, int image_size, int x, int y, int width, int height);
+
     // Encoder implementation for RGB565
-    int encode_rgb565(uint8_t* output, const uint8_t* input,int buffer_size,int x, int y, int width, int height);
+    int encode_rgb565(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height);
 
     // Encoder implementation for RGB888
-    int encode_rgb888(uint8_t* output, const uint8_t* input,int buffer_size,int x, int y, int width, int height);
+    int encode_rgb888(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height);
 
     // Encoder implementation for JPEG
-    int encode_jpeg(uint8_t* output, const uint8_t* input,int buffer_size,int x, int y, int width, int height);
+    int encode_jpeg(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height);
+    int compress_jpeg(jpeg_encoder_private_t* priv, uint8_t* output, const uint8_t* input, int stride, int buffer_size, int width, int height);
+
+    // JPEG rect as independent strips, see set_jpeg_profile
+    int encode_jpeg_strips(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height);
+    int encode_jpeg_strips_parallel(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int x, int y, int width, int height, int strip_height, int jobs);
+
+    // Full-frame JPEG spliced from per MCU row segments
+    int encode_jpeg_rows(uint8_t* output, const uint8_t* input, int stride, int buffer_size, int width, int height);
+    bool compress_rows(jpeg_encoder_private_t* priv, const uint8_t* input, int stride, int width, int height, const int* rows, int count, std::vector<uint8_t>* header);
+
+    // Jobs to split items (rows, strips) of an image with pixels pixels into
+    int parallel_jobs(int items, int pixels) const;
+    jpeg_encoder_private_t* jpeg_job_private(int index);
 
     // JPEG private resources
     struct jpeg_encoder_private_t* m_jpeg_private;
+    std::vector<jpeg_encoder_private_t*> m_jpeg_workers;    // parallel jobs 1..n
+    std::vector<std::vector<uint8_t>> m_strip_buf;
+    WorkPool* m_pool;
 
     void create_jpeg_encoder();
 
@@ -74,5 +177,20 @@ private:
     int m_type;
     int m_quality;
     _u32 m_counter;
+    _u32 m_frame_seq;
+    bool m_region_tags;
+    _u32 m_region;
+    int m_packet_version;
+    bool m_timestamps;
+    int64_t m_capture_us;
+    int m_jpeg_profile;
+    int m_decode_pixels;
+
+    // MCU row cache, one compressed segment per 16-line row
+    bool m_row_cache;
+    int m_row_width, m_row_height, m_row_quality;
+    std::vector<uint8_t> m_row_header;
+    std::vector<uint64_t> m_row_hash;
+    std::vector<std::vector<uint8_t>> m_row_data;
 };
 
@@ -0,0 +1,92 @@
+#include <string.h>
+#include "frame_pacer.h"
+
+static int64_t fps_period(int fps)
+{
+    return fps > 0 ? 1000000 / fps : 0;
+}
+
+void frame_pacer_init(frame_pacer_t* pacer, const pacer_clock_t* clock, int fps)
+{
+    if (pacer == NULL || clock == NULL) return;
+
+    memset(pacer, 0, sizeof(frame_pacer_t));
+    pacer->clock = *clock;
+    pacer->period_us = fps_period(fps);
+}
+
+void frame_pacer_set_fps(frame_pacer_t* pacer, int fps)
+{
+    const int64_t period_us = fps_period(fps);
+
+    if (pacer == NULL || period_us == pacer->period_us) return;
+
+    if (pacer->started) {
+        pacer->next_us += period_us - pacer->period_us;
+    }
+    pacer->period_us = period_us;
+    if (period_us == 0) {
+        pacer->started = 0;
+    }
+}
+
+void frame_pacer_reset(frame_pacer_t* pacer)
+{
+    if (pacer == NULL) return;
+    pacer->started = 0;
+}
+
+int64_t frame_pacer_wait(frame_pacer_t* pacer, int64_t lead_us, int* missed)
+{
+    int64_t now, target, lateness;
+    int skipped = 0;
+
+    if (missed != NULL) *missed = 0;
+    if (pacer == NULL || pacer->period_us <= 0) return 0;
+
+    now = pacer->clock.now_us(pacer->clock.context);
+    if (!pacer->started) {
+        pacer->started = 1;
+        pacer->slot_us = now + lead_us;
+        pacer->next_us = pacer->slot_us + pacer->period_us;
+        return 0;
+    }
+
+    // Coarse sleep, stopping short by the spin tail and the overshoot seen so far
+    target = pacer->next_us - lead_us;
+    if (target - now > PACER_SPIN_US + pacer->overshoot_us) {
+        const int64_t request = target - now - PACER_SPIN_US - pacer->overshoot_us;
+        const int64_t before = now;
+        int64_t over;
+
+        pacer->clock.sleep_us(pacer->clock.context, request);
+        now = pacer->clock.now_us(pacer->clock.context);
+
+        over = now - before - request;
+        if (over < 0) over = 0;
+        if (over > PACER_MAX_OVERSHOOT_US) over = PACER_MAX_OVERSHOOT_US;
+        pacer->overshoot_us = (pacer->overshoot_us * 7 + over) / 8;
+    }
+
+    while (now < target) {
+        now = pacer->clock.now_us(pacer->clock.context);
+    }
+
+    // A frame that took longer than a period: skip to the last deadline passed
+    lateness = now - target;
+    if (lateness >= pacer->period_us) {
+        skipped = (int)(lateness / pacer->period_us);
+        pacer->next_us += skipped * pacer->period_us;
+        lateness -= skipped * pacer->period_us;
+        pacer->missed += skipped;
+    }
+    pacer->slot_us = pacer->next_us;
+    pacer->next_us += pacer->period_us;
+
+    pacer->ticks++;
+    if (lateness > pacer->max_jitter_us) pacer->max_jitter_us = lateness;
+    pacer->avg_jitter_us = (pacer->ticks == 1) ? lateness : (pacer->avg_jitter_us * 15 + lateness) / 16;
+
+    if (missed != NULL) *missed = skipped;
+    return lateness;
+}
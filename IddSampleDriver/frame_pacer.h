@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frame pacing on an absolute deadline schedule: deadline N is start + N
+// periods, so time spent between waits never shifts later frames. The wait
+// sleeps until spin_us before the deadline, less the overshoot the clock's
+// sleep showed so far, then spins the rest. A deadline missed by more than
+// a period skips the missed slots but keeps the phase.
+#define PACER_SPIN_US           1000    // busy-wait tail before each deadline
+#define PACER_MAX_OVERSHOOT_US  4000    // sleep overshoot the wait corrects for
+
+// Time source of a pacer, replaced by a mock clock in tests.
+// sleep_us may return early or late, the pacer only needs it to be coarse.
+typedef struct _pacer_clock {
+    int64_t (*now_us)(void* context);
+    void (*sleep_us)(void* context, int64_t us);
+    void* context;
+} pacer_clock_t;
+
+typedef struct _frame_pacer {
+    pacer_clock_t clock;
+    int64_t period_us;      // 0 = not pacing
+    int64_t next_us;        // absolute deadline of the next frame
+    int64_t slot_us;        // deadline of the frame the last wait released
+    int started;
+    int64_t overshoot_us;   // average sleep overshoot
+    // Jitter: how late each wait returned after its wake-up time
+    uint64_t ticks;
+    uint64_t missed;        // deadlines skipped because a frame took too long
+    int64_t avg_jitter_us;
+    int64_t max_jitter_us;
+} frame_pacer_t;
+
+void frame_pacer_init(frame_pacer_t* pacer, const pacer_clock_t* clock, int fps);
+
+// Change the rate, the next deadline moves to one new period after the last one
+void frame_pacer_set_fps(frame_pacer_t* pacer, int fps);
+
+// Start over with the next wait, e.g. after a pause
+void frame_pacer_reset(frame_pacer_t* pacer);
+
+// Wait until lead_us before the next deadline, which becomes slot_us. Returns
+// how late it returned (us), 0 for the first call which only starts the
+// schedule. *missed gets the skipped deadlines if not NULL.
+int64_t frame_pacer_wait(frame_pacer_t* pacer, int64_t lead_us, int* missed);
+
+#ifdef __cplusplus
+}
+#endif
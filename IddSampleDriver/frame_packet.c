@@ -0,0 +1,176 @@
+#include <string.h>
+#include "frame_packet.h"
+
+int frame_packet_entry_size(int len)
+{
+    return (int)((sizeof(frame_v2_rect_t) + len + FRAME_PACKET_ALIGN - 1) & ~(FRAME_PACKET_ALIGN - 1));
+}
+
+int frame_packet_add_rect(uint8_t* buf, int size, int* pos, const frame_rect_info_t* rect)
+{
+    const int entry = frame_packet_entry_size(rect->len);
+    frame_v2_rect_t* header;
+
+    if (*pos < (int)sizeof(frame_v2_header_t)) {
+        *pos = sizeof(frame_v2_header_t);
+    }
+    if (rect->len > (uint32_t)size || *pos + entry > size) {
+        return -1;
+    }
+
+    header = (frame_v2_rect_t*)(buf + *pos);
+    memset(header, 0, sizeof(frame_v2_rect_t));
+    header->img_type = rect->type;
+    header->img_len = rect->len;
+    header->x = rect->x;
+    header->y = rect->y;
+    header->w = rect->w;
+    header->h = rect->h;
+    header->region = rect->region;
+    if (rect->len > 0) {
+        memcpy(header + 1, rect->data, rect->len);
+    }
+    memset((uint8_t*)(header + 1) + rect->len, 0, entry - sizeof(frame_v2_rect_t) - rect->len);
+
+    *pos += entry;
+    return 0;
+}
+
+int frame_packet_finish(uint8_t* buf, int body_len, uint32_t seq, int flags, int width, int height, uint64_t capture_us)
+{
+    frame_v2_header_t* header = (frame_v2_header_t*)buf;
+    int count = 0;
+
+    // Walk the entries to count them and catch length mistakes before sending
+    for (int pos = 0; pos < body_len; count++) {
+        const frame_v2_rect_t* rect = (const frame_v2_rect_t*)(buf + sizeof(frame_v2_header_t) + pos);
+
+        if (body_len - pos < (int)sizeof(frame_v2_rect_t) || rect->img_len > (uint32_t)body_len ||
+            count == FRAME_PACKET_MAX_RECTS) {
+            return -1;
+        }
+        pos += frame_packet_entry_size(rect->img_len);
+        if (pos > body_len) {
+            return -1;
+        }
+    }
+
+    memset(header, 0, sizeof(frame_v2_header_t));
+    header->magic_id = FRAME_PACKET_MAGIC_V2;
+    header->version = FRAME_PACKET_VERSION;
+    header->header_size = sizeof(frame_v2_header_t);
+    header->frame_len = body_len;
+    header->frame_seq = seq;
+    header->rect_count = (uint16_t)count;
+    header->flags = (uint16_t)flags;
+    header->width = (uint16_t)width;
+    header->height = (uint16_t)height;
+    header->capture_us = capture_us;
+    return (int)sizeof(frame_v2_header_t) + body_len;
+}
+
+static int parse_v1(const uint8_t* buf, int len, frame_info_t* info, frame_rect_info_t* rects, int max)
+{
+    int pos = 0;
+
+    while (len - pos >= (int)sizeof(frame_v1_header_t)) {
+        const frame_v1_header_t* header = (const frame_v1_header_t*)(buf + pos);
+        int entry;
+
+        if (header->magic_id != FRAME_PACKET_MAGIC_V1 || header->img_len > (uint32_t)len) {
+            return -1;
+        }
+        entry = (int)((sizeof(frame_v1_header_t) + header->img_len + FRAME_PACKET_ALIGN - 1) & ~(FRAME_PACKET_ALIGN - 1));
+        if (header->img_type == FRAME_PACKET_TYPE_NULL) {
+            pos += entry;
+            break;
+        }
+        if (pos + (int)sizeof(frame_v1_header_t) + (int)header->img_len > len) {
+            return -1;
+        }
+
+        if (info->rect_count == 0) {
+            info->seq = header->img_cnt;
+        }
+        if (info->rect_count < max) {
+            frame_rect_info_t* rect = &rects[info->rect_count];
+            rect->type = header->img_type;
+            rect->len = header->img_len;
+            rect->x = header->img_x;
+            rect->y = header->img_y;
+            rect->w = header->img_w;
+            rect->h = header->img_h;
+            rect->region = 0;
+            rect->data = (const uint8_t*)(header + 1);
+        }
+        info->rect_count++;
+        pos += entry;
+    }
+
+    info->version = 1;
+    info->flags = FRAME_FLAG_COMPLETE;
+    info->size = pos < len ? pos : len;
+    return 0;
+}
+
+static int parse_v2(const uint8_t* buf, int len, frame_info_t* info, frame_rect_info_t* rects, int max)
+{
+    const frame_v2_header_t* header = (const frame_v2_header_t*)buf;
+    int pos;
+
+    // Newer minor revisions may grow the header, entries start after header_size
+    if (len < (int)sizeof(frame_v2_header_t) || header->header_size < sizeof(frame_v2_header_t) ||
+        header->frame_len > (uint32_t)(len - header->header_size)) {
+        return -1;
+    }
+
+    info->version = header->version;
+    info->seq = header->frame_seq;
+    info->flags = header->flags;
+    info->width = header->width;
+    info->height = header->height;
+    info->capture_us = header->capture_us;
+
+    pos = header->header_size;
+    for (int i = 0; i < header->rect_count; i++) {
+        const frame_v2_rect_t* entry = (const frame_v2_rect_t*)(buf + pos);
+        const int end = header->header_size + (int)header->frame_len;
+
+        if (end - pos < (int)sizeof(frame_v2_rect_t) || entry->img_len > (uint32_t)(end - pos - sizeof(frame_v2_rect_t))) {
+            return -1;
+        }
+        if (i < max) {
+            frame_rect_info_t* rect = &rects[i];
+            rect->type = entry->img_type;
+            rect->len = entry->img_len;
+            rect->x = entry->x;
+            rect->y = entry->y;
+            rect->w = entry->w;
+            rect->h = entry->h;
+            rect->region = entry->region;
+            rect->data = (const uint8_t*)(entry + 1);
+        }
+        pos += frame_packet_entry_size(entry->img_len);
+    }
+
+    info->rect_count = header->rect_count;
+    info->size = header->header_size + header->frame_len;
+    return 0;
+}
+
+int frame_packet_parse(const uint8_t* buf, int len, frame_info_t* info, frame_rect_info_t* rects, int max)
+{
+    memset(info, 0, sizeof(frame_info_t));
+    if (buf == NULL || len < 4) {
+        return -1;
+    }
+
+    switch (*(const uint32_t*)buf) {
+    case FRAME_PACKET_MAGIC_V1:
+        return parse_v1(buf, len, info, rects, max);
+    case FRAME_PACKET_MAGIC_V2:
+        return parse_v2(buf, len, info, rects, max);
+    default:
+        return -1;
+    }
+}
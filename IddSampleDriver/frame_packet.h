@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Wire format of a transfer.
+//
+// v1: one or more 32-byte image_frame_header_t packets, each followed by its
+//     payload and padded to 32 bytes. An IMAGE_TYPE_NULL packet ends the list.
+//
+// v2: one frame_v2_header_t, then rect_count entries of frame_v2_rect_t plus
+//     payload, each entry padded to 32 bytes. Sent only to devices announcing
+//     DEV_FEATURE_FRAME_V2, everything else keeps getting v1.
+//
+// Both headers are 32 bytes so an encoder can write either in front of a payload.
+// The packets of one URB may reach the device in several transfers, see packetizer.h.
+#define FRAME_PACKET_MAGIC_V1   (('l' << 0) | ('v' << 8) | ('s' << 16) | ('n' << 24))
+#define FRAME_PACKET_MAGIC_V2   (('l' << 0) | ('v' << 8) | ('s' << 16) | ('2' << 24))
+#define FRAME_PACKET_TYPE_NULL  (('N' << 0) | ('U' << 8) | ('L' << 16) | ('L' << 24))
+#define FRAME_PACKET_VERSION    2
+#define FRAME_PACKET_ALIGN      32
+#define FRAME_PACKET_MAX_RECTS  0xffff
+
+// frame_v2_header_t.flags
+#define FRAME_FLAG_COMPLETE     (1 << 0)   // last container of the frame, device may present
+
+#pragma pack(push, 1)
+typedef struct _frame_v1_header {
+    uint32_t magic_id;      // FRAME_PACKET_MAGIC_V1
+    uint32_t img_type;
+    uint32_t img_len;
+    uint32_t img_cnt;
+    uint16_t img_x, img_y;
+    uint16_t img_w, img_h;
+    uint32_t reserved[2];
+} frame_v1_header_t;
+
+typedef struct _frame_v2_header {
+    uint32_t magic_id;      // FRAME_PACKET_MAGIC_V2
+    uint16_t version;       // FRAME_PACKET_VERSION
+    uint16_t header_size;   // sizeof(frame_v2_header_t)
+    uint32_t frame_len;     // bytes of rect entries following this header
+    uint32_t frame_seq;
+    uint16_t rect_count;
+    uint16_t flags;         // FRAME_FLAG_*
+    uint16_t width, height; // frame size
+    uint64_t capture_us;    // host capture time (tools_get_time_us), 0 = unknown
+} frame_v2_header_t;
+
+typedef struct _frame_v2_rect {
+    uint32_t img_type;      // codec of this rect, IMAGE_TYPE_*
+    uint32_t img_len;       // payload bytes
+    uint16_t x, y;
+    uint16_t w, h;
+    uint16_t region;        // FRAME_REGION_*
+    uint16_t flags;
+    uint32_t reserved[3];
+} frame_v2_rect_t;
+#pragma pack(pop)
+
+// One rect of a parsed transfer, data points into the parsed buffer
+typedef struct _frame_rect_info {
+    uint32_t type;
+    uint32_t len;
+    uint16_t x, y, w, h;
+    uint16_t region;
+    const uint8_t* data;
+} frame_rect_info_t;
+
+typedef struct _frame_info {
+    int version;            // 1 or 2
+    uint32_t seq;           // v2 frame_seq, v1 img_cnt of the first packet
+    int flags;              // v1 transfers are always complete
+    int width, height;      // v2 only
+    uint64_t capture_us;    // v2 only
+    int rect_count;         // rects in the transfer, may exceed the rects array
+    int size;               // bytes consumed
+} frame_info_t;
+
+// Size of a rect entry with len payload bytes, header and padding included
+int frame_packet_entry_size(int len);
+
+// v2 serializer: body follows a reserved frame_v2_header_t at buf.
+// frame_packet_add_rect appends an entry at buf + *pos and advances *pos;
+// frame_packet_finish fills the frame header for a body of body_len bytes
+// and returns the transfer size, or < 0 if the body is malformed.
+int frame_packet_add_rect(uint8_t* buf, int size, int* pos, const frame_rect_info_t* rect);
+int frame_packet_finish(uint8_t* buf, int body_len, uint32_t seq, int flags, int width, int height, uint64_t capture_us);
+
+// Parse a v1 or v2 transfer into at most max rects, returns 0 or < 0 on malformed input
+int frame_packet_parse(const uint8_t* buf, int len, frame_info_t* info, frame_rect_info_t* rects, int max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "bounded_queue.h"
+
+// Free frame slots between the capture and the encode stage. The encode
+// stage gives slots back through the queue and is its only producer; a slot
+// the capture stage took but could not fill stays on the capture side as the
+// spare and is handed out first, so the queue never gets a second producer.
+template <unsigned Capacity>
+class FrameSlots
+{
+public:
+    FrameSlots() : m_spare(-1) {}
+
+    // Encode side, or either side while the other one is stopped
+    bool put(int slot)
+    {
+        return m_free.push(slot);
+    }
+
+    // Capture side: a free slot, false if the encode stage holds them all
+    bool take(int& slot)
+    {
+        if (m_spare >= 0) {
+            slot = m_spare;
+            m_spare = -1;
+            return true;
+        }
+        return m_free.pop(slot);
+    }
+
+    // Capture side: a taken slot that was not filled
+    void give_back(int slot)
+    {
+        m_spare = slot;
+    }
+
+    // Capture side, slots it can take right now
+    unsigned available() const
+    {
+        return m_free.size() + (m_spare >= 0 ? 1 : 0);
+    }
+
+private:
+    BoundedQueue<int, Capacity> m_free;
+    int m_spare;            // capture side only
+};
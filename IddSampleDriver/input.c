@@ -0,0 +1,83 @@
+#include <string.h>
+#include "input.h"
+
+int input_parse(const uint8_t* payload, int size, input_event_t* events, int max, uint32_t* seq)
+{
+    input_report_t report;
+
+    if (payload == NULL || size < (int)sizeof(input_report_t)) {
+        return -1;
+    }
+
+    memcpy(&report, payload, sizeof(input_report_t));
+    if (report.count > INPUT_MAX_EVENTS ||
+        size < (int)(sizeof(input_report_t) + report.count * sizeof(input_event_t))) {
+        return -1;
+    }
+    if (report.count > max) {
+        report.count = (uint16_t)max;
+    }
+
+    memcpy(events, payload + sizeof(input_report_t), report.count * sizeof(input_event_t));
+    if (seq != NULL) {
+        *seq = report.seq;
+    }
+    return report.count;
+}
+
+uint32_t input_seq_lost(uint32_t last, uint32_t seq)
+{
+    const int32_t gap = (int32_t)(seq - last);
+
+    return gap > 1 ? (uint32_t)(gap - 1) : 0;
+}
+
+void input_queue_reset(input_queue_t* queue)
+{
+    if (queue == NULL) return;
+
+    memset(queue, 0, sizeof(input_queue_t));
+}
+
+void input_queue_push(input_queue_t* queue, const input_event_t* event)
+{
+    // Only the latest position of a contact matters while it moves; stop at
+    // any other event of the contact so down/up stay ordered
+    if ((event->flags & INPUT_FLAG_MOVE) && !(event->flags & (INPUT_FLAG_DOWN | INPUT_FLAG_UP))) {
+        for (int i = queue->count - 1; i >= 0; i--) {
+            input_event_t* queued = &queue->events[(queue->head + i) % INPUT_QUEUE_SIZE];
+            if (queued->type != event->type || queued->contact != event->contact) {
+                continue;
+            }
+            if (queued->flags == event->flags) {
+                // Keep the sample time of the older event, its latency is what the user feels
+                const uint64_t device_us = queued->device_us;
+                *queued = *event;
+                queued->device_us = device_us;
+                queue->coalesced++;
+                return;
+            }
+            break;
+        }
+    }
+
+    if (queue->count == INPUT_QUEUE_SIZE) {
+        queue->head = (queue->head + 1) % INPUT_QUEUE_SIZE;
+        queue->count--;
+        queue->dropped++;
+    }
+    queue->events[(queue->head + queue->count) % INPUT_QUEUE_SIZE] = *event;
+    queue->count++;
+}
+
+int input_queue_pop(input_queue_t* queue, input_event_t* event)
+{
+    if (queue->count == 0) {
+        return 0;
+    }
+
+    *event = queue->events[queue->head];
+    queue->head = (queue->head + 1) % INPUT_QUEUE_SIZE;
+    queue->count--;
+    return 1;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Touch and pointer input of DEV_FEATURE_INPUT devices, carried by DEV_MSG_INPUT
+// messages on the bulk IN pipe: an input_report_t followed by count input_event_t.
+#define INPUT_EVENT_TOUCH       1
+#define INPUT_EVENT_POINTER     2
+
+#define INPUT_FLAG_DOWN         (1 << 0)    // contact landed / button pressed
+#define INPUT_FLAG_UP           (1 << 1)    // contact lifted / button released
+#define INPUT_FLAG_MOVE         (1 << 2)
+#define INPUT_FLAG_BUTTON_LEFT  (1 << 4)    // pointer buttons held
+#define INPUT_FLAG_BUTTON_RIGHT (1 << 5)
+
+#define INPUT_MAX_EVENTS        32          // per report
+#define INPUT_QUEUE_SIZE        64
+
+typedef struct _input_report {
+    uint16_t count;             // events that follow
+    uint16_t reserved;
+    uint32_t seq;               // report counter, gaps mean lost reports
+} input_report_t;
+
+typedef struct _input_event {
+    uint8_t type;               // INPUT_EVENT_*
+    uint8_t contact;            // touch contact id, 0 for the pointer
+    uint16_t flags;             // INPUT_FLAG_*
+    uint16_t x, y;              // panel pixels
+    uint16_t pressure;          // 0 = not reported
+    uint16_t reserved;
+    uint64_t device_us;         // device clock when the event was sampled
+} input_event_t;
+
+// Events waiting for the forwarding sink. A move replaces a move of the same
+// contact that is still queued, a full queue drops the oldest event.
+typedef struct _input_queue {
+    input_event_t events[INPUT_QUEUE_SIZE];
+    int head;                   // oldest event
+    int count;
+    uint64_t dropped;
+    uint64_t coalesced;
+} input_queue_t;
+
+// Events of a DEV_MSG_INPUT payload (the bytes after dev_msg_header_t) into
+// events, returns their number or -1 if the payload is malformed.
+int  input_parse(const uint8_t* payload, int size, input_event_t* events, int max, uint32_t* seq);
+
+// Reports lost between the last report seen and seq. A counter that repeats
+// or steps back is a device restart (resync), not a loss.
+uint32_t input_seq_lost(uint32_t last, uint32_t seq);
+
+void input_queue_reset(input_queue_t* queue);
+void input_queue_push(input_queue_t* queue, const input_event_t* event);
+
+// Oldest event, returns 0 if the queue is empty
+int  input_queue_pop(input_queue_t* queue, input_event_t* event);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,150 @@
+#include "Driver.h"
+#include "input_inject.h"
+
+#define TOUCH_CONTACT_RADIUS    2       // contact area reported around the point
+#define TOUCH_MAX_PRESSURE      1024
+
+InputInjector::InputInjector()
+    : m_touch(NULL), m_contacts{}, m_active{}, m_panel_width(1), m_panel_height(1), m_area{}, m_buttons(0)
+{
+    m_touch = CreateSyntheticPointerDevice(PT_TOUCH, INPUT_MAX_CONTACTS, POINTER_FEEDBACK_DEFAULT);
+    if (m_touch == NULL) {
+        LOGW("CreateSyntheticPointerDevice failed: %u, touch events are dropped\n", GetLastError());
+    }
+}
+
+InputInjector::~InputInjector()
+{
+    if (m_touch != NULL) {
+        DestroySyntheticPointerDevice(m_touch);
+    }
+}
+
+void InputInjector::set_panel(int width, int height)
+{
+    const bool default_area = m_area.right - m_area.left == m_panel_width && m_area.bottom - m_area.top == m_panel_height &&
+                              m_area.left == 0 && m_area.top == 0;
+
+    m_panel_width = width > 0 ? width : 1;
+    m_panel_height = height > 0 ? height : 1;
+    if (default_area) {
+        m_area = { 0, 0, m_panel_width, m_panel_height };
+    }
+}
+
+void InputInjector::set_area(const RECT& area)
+{
+    m_area = area;
+}
+
+void InputInjector::sink(void* context, const input_event_t* event)
+{
+    auto* injector = static_cast<InputInjector*>(context);
+
+    if (event->type == INPUT_EVENT_TOUCH) {
+        injector->inject_touch(event);
+    } else if (event->type == INPUT_EVENT_POINTER) {
+        injector->inject_pointer(event);
+    }
+}
+
+POINT InputInjector::to_desktop(int x, int y) const
+{
+    POINT pt;
+    pt.x = m_area.left + MulDiv(x, m_area.right - m_area.left, m_panel_width);
+    pt.y = m_area.top + MulDiv(y, m_area.bottom - m_area.top, m_panel_height);
+    return pt;
+}
+
+void InputInjector::inject_touch(const input_event_t* event)
+{
+    POINTER_TYPE_INFO frame[INPUT_MAX_CONTACTS];
+    const int slot = event->contact % INPUT_MAX_CONTACTS;
+    POINTER_TOUCH_INFO& touch = m_contacts[slot].touchInfo;
+    const POINT pt = to_desktop(event->x, event->y);
+    int count = 0;
+
+    if (m_touch == NULL) {
+        return;
+    }
+    // A lost report can leave a move of a contact that is not down, it lands
+    // the contact; a lift of a contact that is not down has nothing to lift
+    if (!m_active[slot] && (event->flags & INPUT_FLAG_UP)) {
+        return;
+    }
+
+    m_contacts[slot].type = PT_TOUCH;
+    touch.pointerInfo.pointerType = PT_TOUCH;
+    touch.pointerInfo.pointerId = slot;
+    touch.pointerInfo.ptPixelLocation = pt;
+    touch.touchFlags = TOUCH_FLAG_NONE;
+    touch.touchMask = TOUCH_MASK_CONTACTAREA;
+    touch.rcContact = { pt.x - TOUCH_CONTACT_RADIUS, pt.y - TOUCH_CONTACT_RADIUS,
+                        pt.x + TOUCH_CONTACT_RADIUS, pt.y + TOUCH_CONTACT_RADIUS };
+    if (event->pressure != 0) {
+        touch.touchMask |= TOUCH_MASK_PRESSURE;
+        touch.pressure = event->pressure < TOUCH_MAX_PRESSURE ? event->pressure : TOUCH_MAX_PRESSURE;
+    }
+    if (event->flags & INPUT_FLAG_UP) {
+        touch.pointerInfo.pointerFlags = POINTER_FLAG_UP;
+    } else if (!m_active[slot]) {
+        touch.pointerInfo.pointerFlags = POINTER_FLAG_DOWN | POINTER_FLAG_INRANGE | POINTER_FLAG_INCONTACT;
+        m_active[slot] = true;
+    } else {
+        touch.pointerInfo.pointerFlags = POINTER_FLAG_UPDATE | POINTER_FLAG_INRANGE | POINTER_FLAG_INCONTACT;
+    }
+
+    // Each injection carries every contact still down, the others repeat their last position
+    for (int i = 0; i < INPUT_MAX_CONTACTS; i++) {
+        if (m_active[i]) {
+            frame[count++] = m_contacts[i];
+        }
+    }
+    if (!InjectSyntheticPointerInput(m_touch, frame, count)) {
+        LOGD("InjectSyntheticPointerInput failed: %u\n", GetLastError());
+    }
+
+    if (event->flags & INPUT_FLAG_UP) {
+        m_active[slot] = false;
+    } else {
+        touch.pointerInfo.pointerFlags = POINTER_FLAG_UPDATE | POINTER_FLAG_INRANGE | POINTER_FLAG_INCONTACT;
+    }
+}
+
+void InputInjector::inject_pointer(const input_event_t* event)
+{
+    static const struct { uint16_t button; DWORD down; DWORD up; } buttons[] = {
+        { INPUT_FLAG_BUTTON_LEFT,  MOUSEEVENTF_LEFTDOWN,  MOUSEEVENTF_LEFTUP },
+        { INPUT_FLAG_BUTTON_RIGHT, MOUSEEVENTF_RIGHTDOWN, MOUSEEVENTF_RIGHTUP },
+    };
+    INPUT inputs[1 + ARRAYSIZE(buttons)] = {};
+    const POINT pt = to_desktop(event->x, event->y);
+    const int vx = GetSystemMetrics(SM_XVIRTUALSCREEN);
+    const int vy = GetSystemMetrics(SM_YVIRTUALSCREEN);
+    const int vw = GetSystemMetrics(SM_CXVIRTUALSCREEN);
+    const int vh = GetSystemMetrics(SM_CYVIRTUALSCREEN);
+    const uint16_t held = event->flags & (INPUT_FLAG_BUTTON_LEFT | INPUT_FLAG_BUTTON_RIGHT);
+    UINT count = 0;
+
+    if (vw <= 1 || vh <= 1) {
+        return;
+    }
+    // Absolute coordinates are normalized to 0..65535 over the virtual desktop
+    inputs[count].type = INPUT_MOUSE;
+    inputs[count].mi.dx = MulDiv(pt.x - vx, 65535, vw - 1);
+    inputs[count].mi.dy = MulDiv(pt.y - vy, 65535, vh - 1);
+    inputs[count].mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK;
+    count++;
+    for (const auto& b : buttons) {
+        if ((held ^ m_buttons) & b.button) {
+            inputs[count].type = INPUT_MOUSE;
+            inputs[count].mi.dwFlags = (held & b.button) ? b.down : b.up;
+            count++;
+        }
+    }
+    m_buttons = held;
+
+    if (SendInput(count, inputs, sizeof(INPUT)) != count) {
+        LOGD("SendInput failed: %u\n", GetLastError());
+    }
+}
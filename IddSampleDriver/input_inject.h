@@ -0,0 +1,40 @@
+#pragma once
+
+#define NOMINMAX
+#include <windows.h>
+#include "input.h"
+
+#define INPUT_MAX_CONTACTS  10      // touch contacts injected at once
+
+// Injects the events of a DEV_FEATURE_INPUT device as host input: touch
+// contacts through a synthetic touch device, the pointer through SendInput.
+// Panel pixels are scaled onto the desktop rectangle the panel shows. Set as
+// the input sink of the device transport, so it runs on the bulk IN reader
+// completion under the transport input lock.
+class InputInjector
+{
+public:
+    InputInjector();
+    ~InputInjector();
+
+    // Panel resolution and the desktop rectangle it shows, in virtual screen
+    // pixels; the rectangle defaults to the panel at the desktop origin
+    void set_panel(int width, int height);
+    void set_area(const RECT& area);
+
+    // usb_input_sink_t
+    static void sink(void* context, const input_event_t* event);
+
+private:
+    void inject_touch(const input_event_t* event);
+    void inject_pointer(const input_event_t* event);
+    POINT to_desktop(int x, int y) const;
+
+    HSYNTHETICPOINTERDEVICE m_touch;    // NULL if the host has no touch injection
+    POINTER_TYPE_INFO m_contacts[INPUT_MAX_CONTACTS];
+    bool m_active[INPUT_MAX_CONTACTS];
+    int m_panel_width;
+    int m_panel_height;
+    RECT m_area;
+    uint16_t m_buttons;     // pointer buttons held, INPUT_FLAG_BUTTON_*
+};
@@ -0,0 +1,43 @@
+#include <string.h>
+#include "jit_sched.h"
+
+void jit_sched_init(jit_sched_t* sched)
+{
+    if (sched == NULL) return;
+    memset(sched, 0, sizeof(jit_sched_t));
+}
+
+void jit_estimate_add(jit_estimate_t* estimate, int64_t us)
+{
+    int64_t diff;
+
+    if (estimate == NULL || us < 0) return;
+
+    if (!estimate->valid) {
+        estimate->avg_us = us;
+        estimate->dev_us = us / 2;
+        estimate->valid = 1;
+        return;
+    }
+
+    diff = us - estimate->avg_us;
+    estimate->avg_us += diff / 8;
+    estimate->dev_us += ((diff < 0 ? -diff : diff) - estimate->dev_us) / 4;
+}
+
+int64_t jit_sched_cost(const jit_sched_t* sched)
+{
+    if (sched == NULL) return 0;
+    return sched->grab.avg_us + sched->encode.avg_us + sched->send.avg_us;
+}
+
+int64_t jit_sched_lead(const jit_sched_t* sched)
+{
+    int64_t lead;
+
+    if (sched == NULL) return 0;
+
+    lead = jit_sched_cost(sched) + JIT_MARGIN_US +
+           JIT_DEV_FACTOR * (sched->grab.dev_us + sched->encode.dev_us + sched->send.dev_us);
+    return lead < JIT_MAX_LEAD_US ? lead : JIT_MAX_LEAD_US;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Just-in-time capture: each frame has a send slot (the pacer deadline) and
+// capture starts as late as the predicted grab, encode and send submit time
+// allows, so the pixels that reach the wire are as fresh as possible.
+// Costs are tracked like TCP round trips: a smoothed mean and mean deviation,
+// the lead adds JIT_DEV_FACTOR deviations and a fixed margin to their sum.
+#define JIT_MARGIN_US       1000
+#define JIT_DEV_FACTOR      2
+#define JIT_MAX_LEAD_US     100000  // bound for a stalled stage
+
+typedef struct _jit_estimate {
+    int64_t avg_us;
+    int64_t dev_us;
+    int valid;
+} jit_estimate_t;
+
+// Each estimate is fed by the stage it measures; stages on several threads
+// share a jit_sched_t under a lock, the functions here do not synchronize
+typedef struct _jit_sched {
+    jit_estimate_t grab;
+    jit_estimate_t encode;
+    jit_estimate_t send;
+} jit_sched_t;
+
+void jit_sched_init(jit_sched_t* sched);
+void jit_estimate_add(jit_estimate_t* estimate, int64_t us);
+
+// Predicted time from capture start to the end of the send submit
+int64_t jit_sched_cost(const jit_sched_t* sched);
+
+// How long before its send slot a frame's capture starts
+int64_t jit_sched_lead(const jit_sched_t* sched);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+
+// Single-slot mailbox, lock free, latest item wins. The producer posts items
+// that live in storage it owns; a post replaces an item the consumer has not
+// taken yet and hands it back to the producer. Either side may take the item,
+// whoever gets it owns it. Unlike BoundedQueue nothing ever waits behind a
+// stale item, at most one is pending.
+template <typename T>
+class Mailbox
+{
+public:
+    Mailbox() : m_item(nullptr) {}
+
+    // Producer side, returns the replaced item or nullptr
+    T* post(T* item)
+    {
+        return m_item.exchange(item, std::memory_order_acq_rel);
+    }
+
+    // Either side, returns the pending item or nullptr
+    T* take()
+    {
+        return m_item.exchange(nullptr, std::memory_order_acq_rel);
+    }
+
+    bool empty() const
+    {
+        return m_item.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+    std::atomic<T*> m_item;
+};
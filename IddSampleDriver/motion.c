@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <string.h>
+#include "motion.h"
+
+#define MOTION_PROBE_MATCHES    4   // matches kept per probe, guards repetitive content
+
+int motion_init(motion_ctx_t* ctx, int width, int height)
+{
+    int tiles_x, tiles_y, slots = 1;
+
+    if (ctx == NULL || width <= 0 || height <= 0) {
+        return -1;
+    }
+
+    memset(ctx, 0, sizeof(motion_ctx_t));
+    ctx->width = width;
+    ctx->height = height;
+    tiles_x = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    tiles_y = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+
+    while (slots < tiles_x * tiles_y * 2) {
+        slots <<= 1;
+    }
+    ctx->slot_mask = slots - 1;
+
+    ctx->prev_fb = (uint8_t*)malloc((size_t)width * height * 4);
+    ctx->slots = (int*)calloc(slots, sizeof(int));
+    ctx->mask = (uint8_t*)calloc(tiles_x * tiles_y, sizeof(uint8_t));
+    ctx->heights = (int*)calloc(tiles_x, sizeof(int));
+    if (ctx->prev_fb == NULL || ctx->slots == NULL || ctx->mask == NULL || ctx->heights == NULL) {
+        motion_exit(ctx);
+        return -2;
+    }
+    return 0;
+}
+
+void motion_exit(motion_ctx_t* ctx)
+{
+    if (ctx == NULL) return;
+
+    free(ctx->prev_fb);
+    free(ctx->slots);
+    free(ctx->mask);
+    free(ctx->heights);
+    memset(ctx, 0, sizeof(motion_ctx_t));
+}
+
+void motion_reset(motion_ctx_t* ctx)
+{
+    if (ctx == NULL) return;
+    ctx->prev_valid = 0;
+    ctx->last_valid = 0;
+}
+
+static void add_candidate(motion_vector_t* cands, int* count, int dx, int dy, int votes)
+{
+    if (dx == 0 && dy == 0) {
+        return;
+    }
+
+    for (int i = 0; i < *count; i++) {
+        if (cands[i].dx == dx && cands[i].dy == dy) {
+            cands[i].votes += votes;
+            return;
+        }
+    }
+
+    if (*count < MOTION_MAX_CANDIDATES) {
+        cands[*count].dx = dx;
+        cands[*count].dy = dy;
+        cands[*count].votes = votes;
+        (*count)++;
+    }
+}
+
+// cur(rect) == prev(rect - (dx,dy)), the first row is checked first to fail fast
+static int block_matches(const motion_ctx_t* ctx, const uint8_t* fb, int stride, const disp_rect_t* rect, int dx, int dy)
+{
+    const int pitch = ctx->width * 4;
+    const int sx = rect->x - dx;
+    const int sy = rect->y - dy;
+
+    if (sx < 0 || sy < 0 || sx + rect->w > ctx->width || sy + rect->h > ctx->height) {
+        return 0;
+    }
+
+    for (int row = 0; row < rect->h; row++) {
+        const uint8_t* cur = fb + (rect->y + row) * stride + rect->x * 4;
+        const uint8_t* prev = ctx->prev_fb + (sy + row) * pitch + sx * 4;
+        if (memcmp(cur, prev, rect->w * 4) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Tile-aligned moves: a dirty tile whose hash existed elsewhere in the previous frame
+static void grid_candidates(motion_ctx_t* ctx, const damage_map_t* map, motion_vector_t* cands, int* count)
+{
+    const int tiles = map->tiles_x * map->tiles_y;
+
+    memset(ctx->slots, 0, (ctx->slot_mask + 1) * sizeof(int));
+
+    // Slot holds tile index + 1, negated once the hash is seen twice:
+    // repeated content (solid background) gives no usable vector.
+    for (int i = 0; i < tiles; i++) {
+        int slot = (int)(map->prev_hash[i] & ctx->slot_mask);
+        while (ctx->slots[slot] != 0) {
+            int j = abs(ctx->slots[slot]) - 1;
+            if (map->prev_hash[j] == map->prev_hash[i]) {
+                ctx->slots[slot] = -(j + 1);
+                break;
+            }
+            slot = (slot + 1) & ctx->slot_mask;
+        }
+        if (ctx->slots[slot] == 0) {
+            ctx->slots[slot] = i + 1;
+        }
+    }
+
+    for (int i = 0; i < tiles; i++) {
+        int slot;
+
+        if (!map->dirty[i]) continue;
+
+        slot = (int)(map->hash[i] & ctx->slot_mask);
+        while (ctx->slots[slot] != 0) {
+            int j = abs(ctx->slots[slot]) - 1;
+            if (map->prev_hash[j] == map->hash[i]) {
+                if (ctx->slots[slot] > 0) {
+                    add_candidate(cands, count,
+                                  (i % map->tiles_x - j % map->tiles_x) * DAMAGE_TILE_SIZE,
+                                  (i / map->tiles_x - j / map->tiles_x) * DAMAGE_TILE_SIZE, 1);
+                }
+                break;
+            }
+            slot = (slot + 1) & ctx->slot_mask;
+        }
+    }
+}
+
+// Arbitrary moves: search one textured row of a few dirty tiles in the previous frame
+static void probe_candidates(motion_ctx_t* ctx, const damage_map_t* map, const uint8_t* fb, int stride,
+                             motion_vector_t* cands, int* count)
+{
+    const int pitch = ctx->width * 4;
+    const int step = map->dirty_count / MOTION_MAX_PROBES + 1;
+    int seen = 0, probes = 0;
+
+    for (int i = 0; i < map->tiles_x * map->tiles_y && probes < MOTION_MAX_PROBES; i++) {
+        disp_rect_t rect;
+        const uint32_t* row;
+        int textured = 0, matches = 0, width, py;
+
+        if (!map->dirty[i] || (seen++ % step) != 0) continue;
+
+        damage_tile_rect(map, i % map->tiles_x, i / map->tiles_x, &rect);
+        py = rect.y + rect.h / 2;
+        width = rect.w < MOTION_PROBE_WIDTH ? rect.w : MOTION_PROBE_WIDTH;
+        row = (const uint32_t*)(fb + py * stride) + rect.x;
+
+        for (int col = 1; col < width; col++) {
+            if (row[col] != row[0]) {
+                textured = 1;
+                break;
+            }
+        }
+        if (!textured) continue;
+        probes++;
+
+        for (int dy = -MOTION_SEARCH_RANGE; dy <= MOTION_SEARCH_RANGE && matches < MOTION_PROBE_MATCHES; dy++) {
+            const int sy = py - dy;
+            if (sy < 0 || sy >= ctx->height) continue;
+
+            for (int dx = -MOTION_SEARCH_RANGE; dx <= MOTION_SEARCH_RANGE; dx++) {
+                const int sx = rect.x - dx;
+                const uint32_t* prev;
+
+                if (sx < 0 || sx + width > ctx->width || (dx == 0 && dy == 0)) continue;
+
+                prev = (const uint32_t*)(ctx->prev_fb + sy * pitch) + sx;
+                if (prev[0] == row[0] && memcmp(prev, row, width * 4) == 0) {
+                    add_candidate(cands, count, dx, dy, 1);
+                    if (++matches >= MOTION_PROBE_MATCHES) break;
+                }
+            }
+        }
+    }
+}
+
+static int count_matches(const motion_ctx_t* ctx, const damage_map_t* map, const uint8_t* fb, int stride, int dx, int dy)
+{
+    int matched = 0;
+
+    for (int i = 0; i < map->tiles_x * map->tiles_y; i++) {
+        disp_rect_t rect;
+
+        if (!map->dirty[i]) continue;
+
+        damage_tile_rect(map, i % map->tiles_x, i / map->tiles_x, &rect);
+        matched += block_matches(ctx, fb, stride, &rect, dx, dy);
+    }
+    return matched;
+}
+
+int motion_detect(motion_ctx_t* ctx, damage_map_t* map, const uint8_t* fb, int stride, update_list_t* list)
+{
+    motion_vector_t cands[MOTION_MAX_CANDIDATES];
+    int count = 0, best = -1, best_matched = 0;
+    int x0 = map->tiles_x, y0 = map->tiles_y, x1 = -1, y1 = -1;
+    int rx = 0, ry = 0, rw = 0, rh = 0, moved = 0;
+    disp_rect_t rect, last;
+
+    if (ctx == NULL || ctx->prev_fb == NULL || !ctx->prev_valid || map->dirty_count < MOTION_MIN_TILES ||
+        ctx->width != map->width || ctx->height != map->height) {
+        return 0;
+    }
+
+    // Candidate vectors: last frame's move, grid-aligned hash hits, probe search
+    if (ctx->last_valid) {
+        add_candidate(cands, &count, ctx->last.dx, ctx->last.dy, 1);
+    }
+    grid_candidates(ctx, map, cands, &count);
+    probe_candidates(ctx, map, fb, stride, cands, &count);
+
+    for (int i = 0; i < count; i++) {
+        int matched;
+
+        if (best >= 0 && cands[i].votes * 4 < cands[best].votes) continue;
+
+        matched = count_matches(ctx, map, fb, stride, cands[i].dx, cands[i].dy);
+        if (matched > best_matched) {
+            best_matched = matched;
+            best = i;
+        }
+    }
+
+    if (best < 0 || best_matched < MOTION_MIN_TILES) {
+        ctx->last_valid = 0;
+        return 0;
+    }
+
+    // Match mask over the bounding box of matching dirty tiles; clean tiles that
+    // also match the vector may be covered by the move as well.
+    memset(ctx->mask, 0, map->tiles_x * map->tiles_y);
+    for (int i = 0; i < map->tiles_x * map->tiles_y; i++) {
+        if (!map->dirty[i]) continue;
+
+        damage_tile_rect(map, i % map->tiles_x, i / map->tiles_x, &rect);
+        if (block_matches(ctx, fb, stride, &rect, cands[best].dx, cands[best].dy)) {
+            ctx->mask[i] = 1;
+            if (i % map->tiles_x < x0) x0 = i % map->tiles_x;
+            if (i % map->tiles_x > x1) x1 = i % map->tiles_x;
+            if (i / map->tiles_x < y0) y0 = i / map->tiles_x;
+            if (i / map->tiles_x > y1) y1 = i / map->tiles_x;
+        }
+    }
+    for (int ty = y0; ty <= y1; ty++) {
+        for (int tx = x0; tx <= x1; tx++) {
+            const int idx = ty * map->tiles_x + tx;
+            if (!map->dirty[idx]) {
+                damage_tile_rect(map, tx, ty, &rect);
+                ctx->mask[idx] = (uint8_t)block_matches(ctx, fb, stride, &rect, cands[best].dx, cands[best].dy);
+            }
+        }
+    }
+
+    // Largest all-matching rectangle, one move per frame keeps the device
+    // side copy free of source/destination ordering hazards.
+    memset(ctx->heights, 0, map->tiles_x * sizeof(int));
+    for (int ty = y0; ty <= y1; ty++) {
+        for (int tx = x0; tx <= x1; tx++) {
+            ctx->heights[tx] = ctx->mask[ty * map->tiles_x + tx] ? ctx->heights[tx] + 1 : 0;
+        }
+        for (int tx = x0; tx <= x1; tx++) {
+            int min_h = ctx->heights[tx];
+            for (int end = tx; end <= x1 && min_h > 0; end++) {
+                if (ctx->heights[end] < min_h) min_h = ctx->heights[end];
+                if (min_h * (end - tx + 1) > rw * rh) {
+                    rx = tx;
+                    ry = ty - min_h + 1;
+                    rw = end - tx + 1;
+                    rh = min_h;
+                }
+            }
+        }
+    }
+
+    if (rw * rh < MOTION_MIN_TILES) {
+        ctx->last_valid = 0;
+        return 0;
+    }
+
+    damage_tile_rect(map, rx, ry, &rect);
+    damage_tile_rect(map, rx + rw - 1, ry + rh - 1, &last);
+    rect.w = last.x + last.w - rect.x;
+    rect.h = last.y + last.h - rect.y;
+
+    if (update_list_add_move(list, &rect, rect.x - cands[best].dx, rect.y - cands[best].dy) < 0) {
+        return 0;
+    }
+
+    for (int ty = ry; ty < ry + rh; ty++) {
+        for (int tx = rx; tx < rx + rw; tx++) {
+            const int idx = ty * map->tiles_x + tx;
+            if (map->dirty[idx]) {
+                map->dirty[idx] = 0;
+                map->dirty_count--;
+                moved++;
+            }
+        }
+    }
+
+    ctx->last = cands[best];
+    ctx->last_valid = 1;
+    return moved;
+}
+
+void motion_commit(motion_ctx_t* ctx, const damage_map_t* map, const uint8_t* fb, int stride)
+{
+    const int pitch = ctx->width * 4;
+    disp_rect_t rect;
+
+    if (ctx == NULL || ctx->prev_fb == NULL || ctx->width != map->width || ctx->height != map->height) {
+        return;
+    }
+
+    for (int ty = 0; ty < map->tiles_y; ty++) {
+        for (int tx = 0; tx < map->tiles_x; tx++) {
+            const int idx = ty * map->tiles_x + tx;
+
+            if (ctx->prev_valid && map->hash[idx] == map->prev_hash[idx]) continue;
+
+            damage_tile_rect(map, tx, ty, &rect);
+            for (int row = 0; row < rect.h; row++) {
+                memcpy(ctx->prev_fb + (rect.y + row) * pitch + rect.x * 4,
+                       fb + (rect.y + row) * stride + rect.x * 4, rect.w * 4);
+            }
+        }
+    }
+    ctx->prev_valid = 1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include "damage.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Block matching parameters
+#define MOTION_SEARCH_RANGE     64   // probe search window in pixels (+/-)
+#define MOTION_MAX_CANDIDATES   16
+#define MOTION_MAX_PROBES       4
+#define MOTION_PROBE_WIDTH      DAMAGE_TILE_SIZE
+#define MOTION_MIN_TILES        2    // smallest move worth a command
+
+typedef struct _motion_vector {
+    int dx, dy;     // cur(x, y) == prev(x - dx, y - dy)
+    int votes;
+} motion_vector_t;
+
+// Rigid 2D move detector working on the tile grid of damage_map_t
+typedef struct _motion_ctx {
+    int width, height;
+    uint8_t* prev_fb;           // last frame as the device holds it
+    int prev_valid;
+    motion_vector_t last;       // vector used in the previous frame
+    int last_valid;
+    int* slots;                 // hash table of prev_hash, tile index + 1
+    int slot_mask;
+    uint8_t* mask;              // per-tile match mask
+    int* heights;               // column histogram for the rect search
+} motion_ctx_t;
+
+int  motion_init(motion_ctx_t* ctx, int width, int height);
+void motion_exit(motion_ctx_t* ctx);
+
+// Device framebuffer is unknown (send failure, new session)
+void motion_reset(motion_ctx_t* ctx);
+
+// Find a moved region, append a move command to list and clear the dirty
+// flags it covers. Returns the number of moved tiles.
+int  motion_detect(motion_ctx_t* ctx, damage_map_t* map, const uint8_t* fb, int stride, update_list_t* list);
+
+// Record fb as the device framebuffer after the update was sent
+void motion_commit(motion_ctx_t* ctx, const damage_map_t* map, const uint8_t* fb, int stride);
+
+#ifdef __cplusplus
+}
+#endif
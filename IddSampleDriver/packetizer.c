@@ -0,0 +1,58 @@
+#include <string.h>
+#include "packetizer.h"
+#include "frame_packet.h"
+
+void packetizer_init(packetizer_t* p, int max_packet, int rx_buffer, int max_transfer, int use_zlp)
+{
+    int limit = max_transfer;
+
+    if (rx_buffer > 0 && (limit <= 0 || rx_buffer < limit)) {
+        limit = rx_buffer;
+    }
+    // Only the last transfer may end with a short packet
+    if (limit > 0 && max_packet > 0) {
+        limit -= limit % max_packet;
+        if (limit < max_packet) {
+            limit = max_packet;
+        }
+    }
+
+    p->max_packet = max_packet;
+    p->max_transfer = limit > 0 ? limit : 0;
+    p->use_zlp = use_zlp;
+}
+
+int packetizer_terminate(const packetizer_t* p, uint8_t* buf, int len, int size, int* zlp)
+{
+    frame_v1_header_t* pad;
+
+    *zlp = 0;
+    if (len <= 0 || p->max_packet <= 0 || len % p->max_packet != 0) {
+        return len;
+    }
+    // Padding cannot shorten the last packet of an endpoint with tiny packets
+    if (p->use_zlp || (int)sizeof(frame_v1_header_t) % p->max_packet == 0) {
+        *zlp = 1;
+        return len;
+    }
+
+    // The stream is a list of 32-byte aligned packets, a NULL packet ends it
+    if (size - len < (int)sizeof(frame_v1_header_t)) {
+        return -1;
+    }
+    pad = (frame_v1_header_t*)(buf + len);
+    memset(pad, 0, sizeof(frame_v1_header_t));
+    pad->magic_id = FRAME_PACKET_MAGIC_V1;
+    pad->img_type = FRAME_PACKET_TYPE_NULL;
+    return len + (int)sizeof(frame_v1_header_t);
+}
+
+int packetizer_next(const packetizer_t* p, int offset, int len)
+{
+    const int remaining = len - offset;
+
+    if (p->max_transfer <= 0 || remaining <= p->max_transfer) {
+        return remaining;
+    }
+    return p->max_transfer;
+}
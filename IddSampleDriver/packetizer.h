@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Splits the packet stream of one URB buffer into bulk transfers the device
+// can receive. No transfer exceeds the device receive buffer or its transfer
+// limit, so a device with little SRAM streams a large JPEG through a buffer
+// of rx_buffer bytes. The stream ends with a short packet: a transfer whose
+// length is a multiple of the endpoint packet size would leave the device
+// waiting, it gets either an IMAGE_TYPE_NULL padding packet or a zero-length
+// packet (ZLP) after it.
+typedef struct _packetizer {
+    int max_packet;         // wMaxPacketSize of the bulk OUT pipe
+    int max_transfer;       // largest transfer, multiple of max_packet, 0 = unlimited
+    int use_zlp;            // end with a ZLP instead of padding
+} packetizer_t;
+
+// rx_buffer and max_transfer as reported by the device, 0 = unknown / unlimited
+void packetizer_init(packetizer_t* p, int max_packet, int rx_buffer, int max_transfer, int use_zlp);
+
+// Make the end of the len byte stream in buf (size bytes) detectable.
+// Returns the new stream length, -1 if there is no room for the padding.
+// *zlp is set when a zero-length packet must follow the last transfer.
+int  packetizer_terminate(const packetizer_t* p, uint8_t* buf, int len, int size, int* zlp);
+
+// Size of the transfer starting at offset of a len byte stream
+int  packetizer_next(const packetizer_t* p, int offset, int len);
+
+#ifdef __cplusplus
+}
+#endif
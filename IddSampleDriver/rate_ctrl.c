@@ -0,0 +1,59 @@
+#include <string.h>
+#include "rate_ctrl.h"
+
+void rate_ctrl_init(rate_ctrl_t* ctrl, int quality, int fps)
+{
+    memset(ctrl, 0, sizeof(rate_ctrl_t));
+    ctrl->max_quality = ctrl->quality = quality;
+    ctrl->max_fps = ctrl->fps = fps;
+}
+
+int rate_ctrl_update(rate_ctrl_t* ctrl, int64_t decode_us, int fill_pct, int64_t refresh_us)
+{
+    const int quality = ctrl->quality;
+    const int fps = ctrl->fps;
+    const int min_quality = ctrl->max_quality < RATE_MIN_QUALITY ? ctrl->max_quality : RATE_MIN_QUALITY;
+    int fps_limit = ctrl->max_fps;
+
+    if (ctrl->max_fps <= 0) {
+        return 0;
+    }
+    if (ctrl->hold > 0) {
+        ctrl->hold--;
+        return 0;
+    }
+
+    // Frames faster than the panel refresh are never shown
+    if (refresh_us > 0 && 1000000 / refresh_us < fps_limit) {
+        fps_limit = (int)(1000000 / refresh_us);
+    }
+
+    const int64_t period_us = 1000000 / ctrl->fps;
+    if (decode_us > period_us * 9 / 10 || fill_pct >= RATE_FILL_HIGH) {
+        // Device is the bottleneck: smaller frames first, then fewer of them
+        if (ctrl->quality > min_quality) {
+            ctrl->quality -= RATE_QUALITY_STEP;
+            if (ctrl->quality < min_quality) ctrl->quality = min_quality;
+        } else if (decode_us > 0) {
+            ctrl->fps = (int)(1000000 / decode_us);
+        } else {
+            ctrl->fps--;
+        }
+    } else if (decode_us < period_us / 2 && fill_pct <= RATE_FILL_LOW) {
+        // Headroom: restore the frame rate first, then quality
+        if (ctrl->fps < fps_limit) {
+            ctrl->fps++;
+        } else if (ctrl->quality < ctrl->max_quality) {
+            ctrl->quality++;
+        }
+    }
+
+    if (ctrl->fps > fps_limit) ctrl->fps = fps_limit;
+    if (ctrl->fps < RATE_MIN_FPS) ctrl->fps = RATE_MIN_FPS < ctrl->max_fps ? RATE_MIN_FPS : ctrl->max_fps;
+
+    if (ctrl->quality == quality && ctrl->fps == fps) {
+        return 0;
+    }
+    ctrl->hold = RATE_HOLD_REPORTS;
+    return 1;
+}
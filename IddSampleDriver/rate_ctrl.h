@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Adapts JPEG quality and frame rate to device telemetry
+#define RATE_MIN_QUALITY        10
+#define RATE_QUALITY_STEP       5
+#define RATE_MIN_FPS            5
+#define RATE_FILL_HIGH          75  // receive buffer fill (%) that means backlog
+#define RATE_FILL_LOW           25
+#define RATE_HOLD_REPORTS       4   // reports between two adjustments
+
+typedef struct _rate_ctrl {
+    int max_quality;        // configured quality, never exceeded
+    int max_fps;            // configured fps
+    int quality;            // current JPEG quality
+    int fps;                // current pacing target
+    int hold;               // reports left before the next adjustment
+} rate_ctrl_t;
+
+void rate_ctrl_init(rate_ctrl_t* ctrl, int quality, int fps);
+
+// Feed one telemetry report: average decode time, receive buffer fill in
+// percent and panel refresh period (0 = unknown). Returns 1 if quality or
+// fps changed.
+int  rate_ctrl_update(rate_ctrl_t* ctrl, int64_t decode_us, int fill_pct, int64_t refresh_us);
+
+#ifdef __cplusplus
+}
+#endif
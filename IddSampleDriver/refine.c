@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include "refine.h"
+
+int refine_init(refine_map_t* map, int tiles)
+{
+    if (map == NULL || tiles <= 0) {
+        return -1;
+    }
+
+    memset(map, 0, sizeof(refine_map_t));
+    map->tiles = tiles;
+    map->level = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    map->static_frames = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    map->select = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    if (map->level == NULL || map->static_frames == NULL || map->select == NULL) {
+        refine_exit(map);
+        return -2;
+    }
+    return 0;
+}
+
+void refine_exit(refine_map_t* map)
+{
+    if (map == NULL) return;
+
+    free(map->level);
+    free(map->static_frames);
+    free(map->select);
+    memset(map, 0, sizeof(refine_map_t));
+}
+
+void refine_reset(refine_map_t* map)
+{
+    if (map == NULL || map->tiles == 0) return;
+
+    memset(map->level, REFINE_LEVEL_LOW, map->tiles);
+}
+
+void refine_update(refine_map_t* map, const damage_map_t* damage)
+{
+    if (map == NULL || map->tiles != damage->tiles_x * damage->tiles_y) {
+        return;
+    }
+
+    for (int i = 0; i < map->tiles; i++) {
+        if (damage->dirty[i]) {
+            map->level[i] = REFINE_LEVEL_LOW;
+            map->static_frames[i] = 0;
+        } else if (map->static_frames[i] < 255) {
+            map->static_frames[i]++;
+        }
+    }
+}
+
+int refine_select(refine_map_t* map, const damage_map_t* damage, int max, int* level)
+{
+    int count = 0;
+
+    *level = REFINE_LEVEL_LOSSLESS;
+    if (map == NULL || map->tiles != damage->tiles_x * damage->tiles_y) {
+        return 0;
+    }
+
+    memset(map->select, 0, map->tiles);
+
+    // All selected tiles share one level so they are encoded the same way
+    for (int i = 0; i < map->tiles; i++) {
+        if (map->static_frames[i] >= REFINE_STATIC_FRAMES && map->level[i] < *level) {
+            *level = map->level[i];
+        }
+    }
+    if (*level == REFINE_LEVEL_LOSSLESS) {
+        return 0;
+    }
+
+    for (int i = 0; i < map->tiles && count < max; i++) {
+        if (map->static_frames[i] >= REFINE_STATIC_FRAMES && map->level[i] == *level) {
+            map->select[i] = 1;
+            map->level[i]++;
+            count++;
+        }
+    }
+
+    // Report the level the tiles are sent at
+    (*level)++;
+    return count;
+}
+
+void refine_cancel(refine_map_t* map, const damage_map_t* damage, const disp_rect_t* rect)
+{
+    const int tx0 = rect->x / DAMAGE_TILE_SIZE;
+    const int ty0 = rect->y / DAMAGE_TILE_SIZE;
+    const int tx1 = (rect->x + rect->w - 1) / DAMAGE_TILE_SIZE;
+    const int ty1 = (rect->y + rect->h - 1) / DAMAGE_TILE_SIZE;
+
+    if (map == NULL || map->tiles != damage->tiles_x * damage->tiles_y) {
+        return;
+    }
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            const int idx = ty * damage->tiles_x + tx;
+            if (map->select[idx] && map->level[idx] > REFINE_LEVEL_LOW) {
+                map->select[idx] = 0;
+                map->level[idx]--;
+            }
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include "damage.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Refinement levels of a tile on the device
+#define REFINE_LEVEL_LOW        0   // sent at the motion (configured) quality
+#define REFINE_LEVEL_HIGH       1   // resent at REFINE_HIGH_QUALITY
+#define REFINE_LEVEL_LOSSLESS   2   // resent as raw pixels, final
+
+#define REFINE_HIGH_QUALITY     90
+#define REFINE_STATIC_FRAMES    6   // frames a tile must stay unchanged
+#define REFINE_IDLE_TILES       8   // refine only when fewer tiles are dirty
+#define REFINE_MAX_TILES        48  // refined tiles per frame
+
+typedef struct _refine_map {
+    int tiles;
+    uint8_t* level;         // REFINE_LEVEL_* per tile
+    uint8_t* static_frames; // frames since the last change, saturating
+    uint8_t* select;        // tiles picked by refine_select
+} refine_map_t;
+
+int  refine_init(refine_map_t* map, int tiles);
+void refine_exit(refine_map_t* map);
+
+// Every tile back to REFINE_LEVEL_LOW, e.g. after a full frame at normal quality
+void refine_reset(refine_map_t* map);
+
+// Changed tiles drop back to REFINE_LEVEL_LOW, call right after damage_update
+void refine_update(refine_map_t* map, const damage_map_t* damage);
+
+// Pick up to max static, unrefined tiles of one level (lowest first) into
+// map->select and advance them. Returns the tile count and the level in *level.
+int  refine_select(refine_map_t* map, const damage_map_t* damage, int max, int* level);
+
+// Undo refine_select for the selected tiles in rect (pixels) that were not sent
+void refine_cancel(refine_map_t* map, const damage_map_t* damage, const disp_rect_t* rect);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,130 @@
+#include "send_sched.h"
+
+SendScheduler::SendScheduler(int urbs)
+    : m_urbs(urbs), m_attached(0), m_holder(-1), m_last(-1)
+{
+    for (int i = 0; i < SEND_SCHED_MAX_CLIENTS; i++) {
+        m_active[i] = false;
+        m_waiting[i] = false;
+        m_held[i] = 0;
+        m_served[i] = 0;
+    }
+}
+
+void SendScheduler::attach(int client)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    int64_t served = -1;
+
+    if (client < 0 || client >= SEND_SCHED_MAX_CLIENTS || m_active[client]) {
+        return;
+    }
+    // No credit for the time it was away
+    for (int i = 0; i < SEND_SCHED_MAX_CLIENTS; i++) {
+        if (m_active[i] && (served < 0 || m_served[i] < served)) {
+            served = m_served[i];
+        }
+    }
+    m_served[client] = served < 0 ? 0 : served;
+    m_held[client] = 0;
+    m_waiting[client] = false;
+    m_active[client] = true;
+    m_attached++;
+}
+
+void SendScheduler::detach(int client)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (client < 0 || client >= SEND_SCHED_MAX_CLIENTS || !m_active[client]) {
+            return;
+        }
+        m_active[client] = false;
+        m_waiting[client] = false;
+        m_attached--;
+        if (m_holder == client) {
+            m_holder = -1;
+        }
+    }
+    m_turn.notify_all();
+}
+
+bool SendScheduler::hold_urb(int client)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    int share;
+
+    if (client < 0 || client >= SEND_SCHED_MAX_CLIENTS || !m_active[client]) {
+        return true;
+    }
+    share = m_urbs / m_attached;
+    if (share < 1) {
+        share = 1;
+    }
+    if (m_held[client] >= share) {
+        return false;
+    }
+    m_held[client]++;
+    return true;
+}
+
+void SendScheduler::drop_urb(int client)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    if (client >= 0 && client < SEND_SCHED_MAX_CLIENTS && m_held[client] > 0) {
+        m_held[client]--;
+    }
+}
+
+// Least served waiting client, the first after m_last on a tie
+int SendScheduler::next_client() const
+{
+    int best = -1;
+
+    for (int i = 1; i <= SEND_SCHED_MAX_CLIENTS; i++) {
+        const int client = (m_last + i + SEND_SCHED_MAX_CLIENTS) % SEND_SCHED_MAX_CLIENTS;
+        if (m_waiting[client] && (best < 0 || m_served[client] < m_served[best])) {
+            best = client;
+        }
+    }
+    return best;
+}
+
+bool SendScheduler::acquire(int client, int timeout_ms)
+{
+    if (client < 0 || client >= SEND_SCHED_MAX_CLIENTS) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> guard(m_lock);
+    if (!m_active[client]) {
+        return true;
+    }
+    m_waiting[client] = true;
+    const bool turn = m_turn.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+                                      [this, client] { return m_holder < 0 && next_client() == client; });
+    m_waiting[client] = false;
+    if (!turn) {
+        // The turn may be due to another client now
+        guard.unlock();
+        m_turn.notify_all();
+        return false;
+    }
+    m_holder = client;
+    return true;
+}
+
+void SendScheduler::release(int client, int bytes)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (client < 0 || client >= SEND_SCHED_MAX_CLIENTS || m_holder != client) {
+            return;
+        }
+        m_served[client] += bytes;
+        m_holder = -1;
+        m_last = client;
+    }
+    m_turn.notify_all();
+}
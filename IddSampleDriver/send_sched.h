@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+
+#define SEND_SCHED_MAX_CLIENTS  4
+
+// Fair share of one USB link among the monitors of a device. Send turns go
+// to the waiting client that got the fewest bytes through so far, so a
+// monitor streaming large frames waits for the small updates of the others
+// instead of starving them; a client attaching late starts level with the
+// least served one. The URBs a client may hold between encode and send are
+// capped at an equal share of the pool, so one encoder running ahead cannot
+// take all of them.
+class SendScheduler
+{
+public:
+    // urbs: URBs the attached clients share between encode and send
+    explicit SendScheduler(int urbs);
+
+    void attach(int client);
+    void detach(int client);
+
+    // Take a URB of the client's share, false if it holds its share already
+    bool hold_urb(int client);
+    void drop_urb(int client);
+
+    // Wait up to timeout_ms for the client's send turn, false on timeout.
+    // A turn ends with release, bytes = what was sent in it.
+    bool acquire(int client, int timeout_ms);
+    void release(int client, int bytes);
+
+private:
+    int next_client() const;
+
+    std::mutex m_lock;
+    std::condition_variable m_turn;
+    int m_urbs;
+    int m_attached;
+    int m_holder;           // client in its turn, -1 = none
+    int m_last;             // last holder, ties go round robin after it
+    bool m_active[SEND_SCHED_MAX_CLIENTS];
+    bool m_waiting[SEND_SCHED_MAX_CLIENTS];
+    int m_held[SEND_SCHED_MAX_CLIENTS];
+    int64_t m_served[SEND_SCHED_MAX_CLIENTS];
+};
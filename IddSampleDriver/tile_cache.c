@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tile_cache.h"
+
+int tile_cache_init(tile_cache_t* cache, int slots)
+{
+    int buckets = 1;
+
+    if (cache == NULL || slots <= 0 || slots > TILE_CACHE_MAX_SLOTS) {
+        return -1;
+    }
+
+    memset(cache, 0, sizeof(tile_cache_t));
+    cache->slots = slots;
+
+    while (buckets < slots * 2) {
+        buckets <<= 1;
+    }
+    cache->bucket_mask = buckets - 1;
+
+    cache->slot_hash = (uint64_t*)calloc(slots, sizeof(uint64_t));
+    cache->slot_used = (uint8_t*)calloc(slots, sizeof(uint8_t));
+    cache->lru_prev = (int*)calloc(slots, sizeof(int));
+    cache->lru_next = (int*)calloc(slots, sizeof(int));
+    cache->chain = (int*)calloc(slots, sizeof(int));
+    cache->bucket = (int*)calloc(buckets, sizeof(int));
+    if (cache->slot_hash == NULL || cache->slot_used == NULL || cache->lru_prev == NULL ||
+        cache->lru_next == NULL || cache->chain == NULL || cache->bucket == NULL) {
+        tile_cache_exit(cache);
+        return -2;
+    }
+
+    tile_cache_reset(cache);
+    return 0;
+}
+
+void tile_cache_exit(tile_cache_t* cache)
+{
+    if (cache == NULL) return;
+
+    free(cache->slot_hash);
+    free(cache->slot_used);
+    free(cache->lru_prev);
+    free(cache->lru_next);
+    free(cache->chain);
+    free(cache->bucket);
+    memset(cache, 0, sizeof(tile_cache_t));
+}
+
+void tile_cache_reset(tile_cache_t* cache)
+{
+    if (cache == NULL || cache->slots == 0) return;
+
+    memset(cache->slot_used, 0, cache->slots);
+    for (int i = 0; i <= cache->bucket_mask; i++) {
+        cache->bucket[i] = -1;
+    }
+
+    // Initial LRU order: slot 0 is evicted first
+    for (int i = 0; i < cache->slots; i++) {
+        cache->chain[i] = -1;
+        cache->lru_prev[i] = i + 1 < cache->slots ? i + 1 : -1;
+        cache->lru_next[i] = i - 1;
+    }
+    cache->lru_head = cache->slots - 1;
+    cache->lru_tail = 0;
+}
+
+static void lru_touch(tile_cache_t* cache, int slot)
+{
+    if (cache->lru_head == slot) return;
+
+    // Unlink
+    if (cache->lru_prev[slot] >= 0) cache->lru_next[cache->lru_prev[slot]] = cache->lru_next[slot];
+    if (cache->lru_next[slot] >= 0) cache->lru_prev[cache->lru_next[slot]] = cache->lru_prev[slot];
+    if (cache->lru_tail == slot) cache->lru_tail = cache->lru_prev[slot];
+
+    // Push front
+    cache->lru_prev[slot] = -1;
+    cache->lru_next[slot] = cache->lru_head;
+    cache->lru_prev[cache->lru_head] = slot;
+    cache->lru_head = slot;
+}
+
+static void bucket_remove(tile_cache_t* cache, int slot)
+{
+    int* link = &cache->bucket[cache->slot_hash[slot] & cache->bucket_mask];
+
+    while (*link >= 0) {
+        if (*link == slot) {
+            *link = cache->chain[slot];
+            cache->chain[slot] = -1;
+            return;
+        }
+        link = &cache->chain[*link];
+    }
+}
+
+static int slot_find(const tile_cache_t* cache, uint64_t hash)
+{
+    for (int slot = cache->bucket[hash & cache->bucket_mask]; slot >= 0; slot = cache->chain[slot]) {
+        if (cache->slot_hash[slot] == hash) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+int tile_cache_lookup(tile_cache_t* cache, uint64_t hash)
+{
+    int slot;
+
+    if (cache == NULL || cache->slots == 0) {
+        return -1;
+    }
+
+    slot = slot_find(cache, hash);
+    if (slot >= 0) {
+        lru_touch(cache, slot);
+        cache->hits++;
+        return slot;
+    }
+
+    cache->misses++;
+    return -1;
+}
+
+int tile_cache_insert(tile_cache_t* cache, uint64_t hash)
+{
+    int slot, idx;
+
+    if (cache == NULL || cache->slots == 0) {
+        return -1;
+    }
+
+    slot = cache->lru_tail;
+    if (cache->slot_used[slot]) {
+        bucket_remove(cache, slot);
+        cache->evictions++;
+    }
+
+    idx = (int)(hash & cache->bucket_mask);
+    cache->slot_hash[slot] = hash;
+    cache->slot_used[slot] = 1;
+    cache->chain[slot] = cache->bucket[idx];
+    cache->bucket[idx] = slot;
+    lru_touch(cache, slot);
+    return slot;
+}
+
+static int tile_is_full(const damage_map_t* map, int tx, int ty)
+{
+    disp_rect_t rect;
+    damage_tile_rect(map, tx, ty, &rect);
+    return rect.w == DAMAGE_TILE_SIZE && rect.h == DAMAGE_TILE_SIZE;
+}
+
+int tile_cache_match(tile_cache_t* cache, damage_map_t* map, tile_cache_ref_t* draws, int max)
+{
+    int count = 0;
+
+    if (cache == NULL || cache->slots == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < map->tiles_x * map->tiles_y && count < max; i++) {
+        const int tx = i % map->tiles_x;
+        const int ty = i / map->tiles_x;
+        int slot;
+
+        if (!map->dirty[i] || !tile_is_full(map, tx, ty)) continue;
+
+        slot = tile_cache_lookup(cache, map->hash[i]);
+        if (slot < 0) continue;
+
+        draws[count].slot = (uint16_t)slot;
+        draws[count].x = (uint16_t)(tx * DAMAGE_TILE_SIZE);
+        draws[count].y = (uint16_t)(ty * DAMAGE_TILE_SIZE);
+        draws[count].reserved = 0;
+        count++;
+
+        map->dirty[i] = 0;
+        map->dirty_count--;
+    }
+    return count;
+}
+
+int tile_cache_store(tile_cache_t* cache, const damage_map_t* map, tile_cache_ref_t* stores, int max)
+{
+    int count = 0;
+
+    if (cache == NULL || cache->slots == 0) {
+        return 0;
+    }
+
+    // More stores than slots would only overwrite each other
+    if (max > cache->slots) {
+        max = cache->slots;
+    }
+
+    for (int i = 0; i < map->tiles_x * map->tiles_y && count < max; i++) {
+        const int tx = i % map->tiles_x;
+        const int ty = i / map->tiles_x;
+
+        if (!map->dirty[i] || !tile_is_full(map, tx, ty)) continue;
+
+        // Same content earlier in this frame
+        if (slot_find(cache, map->hash[i]) >= 0) continue;
+
+        stores[count].slot = (uint16_t)tile_cache_insert(cache, map->hash[i]);
+        stores[count].x = (uint16_t)(tx * DAMAGE_TILE_SIZE);
+        stores[count].y = (uint16_t)(ty * DAMAGE_TILE_SIZE);
+        stores[count].reserved = 0;
+        count++;
+    }
+    return count;
+}
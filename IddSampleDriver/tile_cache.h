@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include "damage.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TILE_CACHE_MAX_SLOTS   4096
+
+// Wire entry of IMAGE_TYPE_CACHE_DRAW / IMAGE_TYPE_CACHE_STORE packets
+typedef struct _tile_cache_ref {
+    uint16_t slot;
+    uint16_t x, y;
+    uint16_t reserved;
+} tile_cache_ref_t;
+
+// Host mirror of the device tile cache: content hash -> slot, LRU eviction.
+// The device holds 'slots' tiles of DAMAGE_TILE_SIZE x DAMAGE_TILE_SIZE pixels.
+typedef struct _tile_cache {
+    int slots;
+    uint64_t* slot_hash;
+    uint8_t* slot_used;
+    int* lru_prev;          // doubly linked LRU list over slots, head = most recent
+    int* lru_next;
+    int lru_head, lru_tail;
+    int* bucket;            // hash bucket -> first slot, -1 = empty
+    int* chain;             // next slot in the same bucket
+    int bucket_mask;
+    uint64_t hits, misses, evictions;
+} tile_cache_t;
+
+int  tile_cache_init(tile_cache_t* cache, int slots);
+void tile_cache_exit(tile_cache_t* cache);
+
+// Forget all slots, used when the device may have missed store commands
+void tile_cache_reset(tile_cache_t* cache);
+
+// Slot holding hash or -1, a hit becomes most recently used
+int  tile_cache_lookup(tile_cache_t* cache, uint64_t hash);
+
+// Assign the least recently used slot to hash, returns the slot
+int  tile_cache_insert(tile_cache_t* cache, uint64_t hash);
+
+// Dirty full tiles found in the cache: fill draws and clear their dirty flag
+int  tile_cache_match(tile_cache_t* cache, damage_map_t* map, tile_cache_ref_t* draws, int max);
+
+// Remaining dirty full tiles get a slot, the device copies them after drawing
+int  tile_cache_store(tile_cache_t* cache, const damage_map_t* map, tile_cache_ref_t* stores, int max);
+
+#ifdef __cplusplus
+}
+#endif
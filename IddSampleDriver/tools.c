@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include "basetype.h"
 #include "tools.h"
 
@@ -29,56 +30,134 @@ void tools_log(const char* fmt, ...)
     va_end(args);
 }
 
-void tools_sample_tick(int fps)
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+int64_t tools_get_mono_us(void)
 {
-    static int64_t last_tick_time = 0;
-    static uint8_t initialized = 0;
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (int64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+                     counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
 
-    if (fps <= 0) return;
+static int64_t pacer_now_us(void* context)
+{
+    UNREFERENCED_PARAMETER(context);
+    return tools_get_mono_us();
+}
 
-    const int64_t period_us = 1000000 / fps;
-    int64_t current_time = tools_get_time_us();
+static void pacer_sleep_us(void* context, int64_t us)
+{
+    HANDLE timer = (HANDLE)context;
+    LARGE_INTEGER due;
 
-    if (!initialized) {
-        last_tick_time = current_time;
-        initialized = 1;
+    if (timer == NULL) {
+        // Rounds down, the spin tail of the pacer does the rest
+        Sleep((DWORD)(us / 1000));
         return;
     }
 
-    int64_t elapsed_time = current_time - last_tick_time;
+    // Relative due time in 100 ns units
+    due.QuadPart = -us * 10;
+    if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {
+        WaitForSingleObject(timer, INFINITE);
+    }
+}
 
-    if (elapsed_time < period_us) {
-        int64_t sleep_us = period_us - elapsed_time;
-        DWORD sleep_ms = (DWORD)((sleep_us + 500) / 1000);
+int tools_pacer_clock_init(pacer_clock_t* clock)
+{
+    HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
 
-        if (sleep_ms > 0) {
-            Sleep(sleep_ms);
-        }
+    if (timer == NULL) {
+        // Before Windows 10 1803, the pacer learns the larger overshoot
+        timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
     }
+    clock->now_us = pacer_now_us;
+    clock->sleep_us = pacer_sleep_us;
+    clock->context = timer;
+    return timer != NULL ? 0 : -1;
+}
 
-    last_tick_time = tools_get_time_us();
+void tools_pacer_clock_exit(pacer_clock_t* clock)
+{
+    if (clock->context != NULL) {
+        CloseHandle((HANDLE)clock->context);
+        clock->context = NULL;
+    }
+}
+
+void tools_perf_stats_slack(perf_stats_t* stats, int64_t predicted_us, int64_t actual_us)
+{
+    if (stats == NULL) return;
+
+    AcquireSRWLockExclusive(&stats->lock);
+    if (actual_us < 0) stats->late_frames++;
+    if (stats->slack_frames++ == 0) {
+        stats->avg_predicted_slack_us = predicted_us;
+        stats->avg_actual_slack_us = actual_us;
+    } else {
+        stats->avg_predicted_slack_us = (int64_t)(stats->avg_predicted_slack_us * 0.9f + predicted_us * 0.1f);
+        stats->avg_actual_slack_us = (int64_t)(stats->avg_actual_slack_us * 0.9f + actual_us * 0.1f);
+    }
+    ReleaseSRWLockExclusive(&stats->lock);
+}
+
+void tools_perf_stats_pace(perf_stats_t* stats, int64_t jitter_us, int missed)
+{
+    if (stats == NULL) return;
+
+    AcquireSRWLockExclusive(&stats->lock);
+    stats->pace_ticks++;
+    stats->pace_missed += missed;
+    if (jitter_us > stats->max_pace_jitter_us) stats->max_pace_jitter_us = jitter_us;
+    if (stats->avg_pace_jitter_us == 0) {
+        stats->avg_pace_jitter_us = jitter_us;
+    } else {
+        stats->avg_pace_jitter_us = (int64_t)(stats->avg_pace_jitter_us * 0.9f + jitter_us * 0.1f);
+    }
+    ReleaseSRWLockExclusive(&stats->lock);
+}
+
+void tools_perf_stats_pipe(perf_stats_t* stats, int pipe, int bytes, int success)
+{
+    if (stats == NULL || pipe < 0 || pipe >= PERF_MAX_PIPES) return;
+
+    InterlockedIncrement64(&stats->pipe_transfers[pipe]);
+    InterlockedExchangeAdd64(&stats->pipe_bytes[pipe], bytes);
+    if (!success) {
+        InterlockedIncrement64(&stats->pipe_failed[pipe]);
+    }
 }
 
 void tools_perf_stats_init(perf_stats_t* stats)
 {
     if (stats == NULL) return;
     memset(stats, 0, sizeof(perf_stats_t));
+    InitializeSRWLock(&stats->lock);
 }
 
-void tools_perf_stats_update(perf_stats_t* stats, int frame_size,int64_t grab_time, int64_t encode_time,int64_t send_time, int success)
+uint64_t tools_perf_stats_update(perf_stats_t* stats, int frame_size,int64_t grab_time, int64_t encode_time,int64_t send_time, int success)
 {
-    if (stats == NULL) return;
+    if (stats == NULL) return 0;
 
     const int64_t total_time = grab_time + encode_time + send_time;
-    const uint64_t count = stats->total_frames + 1;
 
-    stats->total_frames = count;
+    AcquireSRWLockExclusive(&stats->lock);
+    const uint64_t count = ++stats->total_frames;
     stats->total_bytes += frame_size;
 
     if (success) {
         stats->urbs_sent++;
     } else {
-        stats->error_frames++;
+        // Counted by the capture threads as well
+        PERF_STATS_ADD(stats, error_frames, 1);
         stats->urbs_failed++;
     }
 
@@ -96,19 +175,66 @@ void tools_perf_stats_update(perf_stats_t* stats, int frame_size,int64_t grab_ti
         stats->avg_send_time_us = (int64_t)(stats->avg_send_time_us * (1 - alpha) + send_time * alpha);
         stats->avg_total_time_us = (int64_t)(stats->avg_total_time_us * (1 - alpha) + total_time * alpha);
     }
+    ReleaseSRWLockExclusive(&stats->lock);
+    return count;
 }
 
-void tools_perf_stats_print(perf_stats_t* stats)
+void tools_perf_stats_print(perf_stats_t* shared)
 {
-    if (stats == NULL) return;
+    perf_stats_t copy;
+    const perf_stats_t* stats = &copy;
+
+    if (shared == NULL) return;
+    // Logging is slow, the other threads do not wait for it
+    tools_perf_stats_snapshot(shared, &copy);
 
     LOGW("=== Performance Statistics ===\n");
     LOGW("Total frames: %llu\n", stats->total_frames);
-    LOGW("Dropped frames: %llu\n", stats->dropped_frames);
+    LOGW("Dropped frames: %llu stale: %llu\n", stats->dropped_frames, stats->stale_frames);
     LOGW("Error frames: %llu\n", stats->error_frames);
     LOGW("Total bytes: %llu MB\n", stats->total_bytes / (1024 * 1024));
     LOGW("URBs sent: %llu\n", stats->urbs_sent);
     LOGW("URBs failed: %llu\n", stats->urbs_failed);
+    LOGW("Move cmds: %llu (%llu tiles)\n", stats->move_cmds, stats->moved_tiles);
+    LOGW("Cache hits: %llu stores: %llu\n", stats->cache_hits, stats->cache_stores);
+    LOGW("Refined tiles: %llu\n", stats->refined_tiles);
+    LOGW("Video tiles: %llu deferred: %llu\n", stats->video_tiles, stats->video_deferred);
+    LOGW("Throttled frames: %llu credits: %llu\n", stats->throttled_frames, stats->credits_received);
+    LOGW("Coalesced frames: %llu\n", stats->coalesced_frames);
+    LOGW("Cursor moves: %llu shapes: %llu\n", stats->cursor_moves, stats->cursor_shapes);
+    if (stats->pace_ticks > 0) {
+        LOGW("Pacing: %llu ticks, %llu deadlines missed, jitter avg %lld max %lld us\n", stats->pace_ticks,
+             stats->pace_missed, stats->avg_pace_jitter_us, stats->max_pace_jitter_us);
+    }
+    if (stats->slack_frames > 0) {
+        LOGW("Send slot slack: predicted %lld actual %lld us, %llu/%llu frames late\n", stats->avg_predicted_slack_us,
+             stats->avg_actual_slack_us, stats->late_frames, stats->slack_frames);
+    }
+    if (stats->pipe_count > 1) {
+        const int64_t elapsed_us = tools_get_time_us() - stats->pipe_start_us;
+        for (int i = 0; i < stats->pipe_count && i < PERF_MAX_PIPES; i++) {
+            LOGW("Pipe %d: %lld transfers %lld KB failed %lld, %.2f MB/s\n", i, stats->pipe_transfers[i],
+                 stats->pipe_bytes[i] / 1024, stats->pipe_failed[i],
+                 elapsed_us > 0 ? (float)stats->pipe_bytes[i] / elapsed_us : 0.0f);
+        }
+    }
+    if (stats->input_events > 0) {
+        LOGW("Input events: %llu dropped: %llu latency avg %lld max %lld us\n", stats->input_events,
+             stats->input_dropped, stats->avg_input_latency_us, stats->max_input_latency_us);
+    }
+    if (stats->telemetry_reports > 0) {
+        LOGW("Device decode: %lld us rx fill: %d%% dropped: %llu refresh: %lld us\n",
+             stats->avg_dev_decode_us, stats->dev_rx_fill_pct, stats->dev_dropped_frames, stats->dev_refresh_us);
+    }
+    if (stats->latency_samples > 0) {
+        LOGW("Latency: min %lld avg %lld max %lld us, p50 <%lld p95 <%lld p99 <%lld us (%llu samples, clock rtt %lld us)\n",
+             stats->min_latency_us, stats->avg_latency_us, stats->max_latency_us,
+             latency_percentile(stats, 50), latency_percentile(stats, 95), latency_percentile(stats, 99),
+             stats->latency_samples, stats->clock_rtt_us);
+    }
+    if (stats->cache_hits + stats->cache_stores > 0) {
+        LOGW("Cache hit rate: %.2f%%\n", (float)stats->cache_hits / (stats->cache_hits + stats->cache_stores) * 100);
+    }
     LOGW("Avg grab time: %lld us\n", stats->avg_grab_time_us);
     LOGW("Avg encode time: %lld us\n", stats->avg_encode_time_us);
     LOGW("Avg send time: %lld us\n", stats->avg_send_time_us);
@@ -120,10 +246,95 @@ void tools_perf_stats_print(perf_stats_t* stats)
     }
 }
 
+void tools_perf_stats_telemetry(perf_stats_t* stats, const dev_msg_telemetry_t* msg)
+{
+    if (stats == NULL || msg == NULL) return;
+
+    AcquireSRWLockExclusive(&stats->lock);
+    // Same moving average as the host side times (alpha = 0.1)
+    if (stats->avg_dev_decode_us == 0) {
+        stats->avg_dev_decode_us = msg->decode_us;
+    } else {
+        stats->avg_dev_decode_us = (int64_t)(stats->avg_dev_decode_us * 0.9f + msg->decode_us * 0.1f);
+    }
+    stats->dev_rx_fill_pct = msg->rx_size > 0 ? (int)((uint64_t)msg->rx_fill * 100 / msg->rx_size) : 0;
+    stats->dev_dropped_frames = msg->dropped_frames;
+    stats->dev_refresh_us = msg->refresh_us;
+    stats->telemetry_reports++;
+    ReleaseSRWLockExclusive(&stats->lock);
+}
+
+void tools_perf_stats_latency(perf_stats_t* stats, int64_t latency_us)
+{
+    int64_t bucket;
+
+    if (stats == NULL || latency_us < 0) return;
+
+    bucket = latency_us / LATENCY_BUCKET_US;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    AcquireSRWLockExclusive(&stats->lock);
+    stats->latency_hist[bucket]++;
+
+    if (stats->latency_samples == 0 || latency_us < stats->min_latency_us) stats->min_latency_us = latency_us;
+    if (latency_us > stats->max_latency_us) stats->max_latency_us = latency_us;
+    if (stats->avg_latency_us == 0) {
+        stats->avg_latency_us = latency_us;
+    } else {
+        stats->avg_latency_us = (int64_t)(stats->avg_latency_us * 0.9f + latency_us * 0.1f);
+    }
+    stats->latency_samples++;
+    ReleaseSRWLockExclusive(&stats->lock);
+}
+
+void tools_perf_stats_input(perf_stats_t* stats, int64_t latency_us)
+{
+    if (stats == NULL) return;
+
+    AcquireSRWLockExclusive(&stats->lock);
+    stats->input_events++;
+    if (latency_us >= 0) {
+        if (latency_us > stats->max_input_latency_us) stats->max_input_latency_us = latency_us;
+        if (stats->avg_input_latency_us == 0) {
+            stats->avg_input_latency_us = latency_us;
+        } else {
+            stats->avg_input_latency_us = (int64_t)(stats->avg_input_latency_us * 0.9f + latency_us * 0.1f);
+        }
+    }
+    ReleaseSRWLockExclusive(&stats->lock);
+}
+
+// Upper bucket edge below which pct percent of the latency samples fall
+static int64_t latency_percentile(const perf_stats_t* stats, int pct)
+{
+    const uint64_t target = (stats->latency_samples * pct + 99) / 100;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        sum += stats->latency_hist[i];
+        if (sum >= target) {
+            return (int64_t)(i + 1) * LATENCY_BUCKET_US;
+        }
+    }
+    return stats->max_latency_us;
+}
+
 void tools_perf_stats_reset(perf_stats_t* stats)
 {
     if (stats == NULL) return;
-    tools_perf_stats_init(stats);
+
+    AcquireSRWLockExclusive(&stats->lock);
+    memset((uint8_t*)stats + sizeof(stats->lock), 0, sizeof(perf_stats_t) - sizeof(stats->lock));
+    ReleaseSRWLockExclusive(&stats->lock);
+}
+
+void tools_perf_stats_snapshot(perf_stats_t* stats, perf_stats_t* copy)
+{
+    if (stats == NULL || copy == NULL) return;
+
+    AcquireSRWLockShared(&stats->lock);
+    memcpy(copy, stats, sizeof(perf_stats_t));
+    ReleaseSRWLockShared(&stats->lock);
+    InitializeSRWLock(&copy->lock);
 }
 
 
@@ -174,6 +385,8 @@ void tools_parse_usb_dev_info(char* str, usb_dev_config_t* config)
     config->img_qlt = 5;
     config->debug =debug_level= LOG_LEVEL_INFO;
     config->sleep = 5;
+    config->features = 0;
+    config->cache_slots = 0;
 #if 1
     if (cfg[0].str[0] == 'U') {
         // Parse configuration items
@@ -233,6 +446,22 @@ void tools_parse_usb_dev_info(char* str, usb_dev_config_t* config)
                 }
             }
             break;
+            case 'C': {
+                unsigned int features;
+                if (sscanf_s(item_str, "C%x", &features) == 1) {
+                    config->features = (int)features;
+                    LOGI("udisp features:0x%x\n", features);
+                }
+            }
+            break;
+            case 'K': {
+                int slots;
+                if (sscanf_s(item_str, "K%d", &slots) == 1) {
+                    config->cache_slots = slots;
+                    LOGI("udisp cache slots:%d\n", slots);
+                }
+            }
+            break;
 
             default:
                 LOGW("Unknown encoder type '%c', using JPEG default\n", item_str[1]);
@@ -305,3 +534,29 @@ void tools_parse_usb_dev_info(char* str, usb_dev_config_t* config)
     LOGI("Parsed USB config: w=%d h=%d enc=%d quality=%d fps=%d\n", 
         config->width, config->height, config->img_type,config->img_qlt, config->fps);
 }
+
+int tools_parse_dev_caps(const uint8_t* buf, int len, dev_caps_t* caps)
+{
+    const dev_caps_t* reply = (const dev_caps_t*)buf;
+    int size;
+
+    if (buf == NULL || caps == NULL || len < (int)offsetof(dev_caps_t, codecs)) {
+        return -1;
+    }
+    if (reply->magic != DEV_CAPS_MAGIC || reply->version == 0 || reply->size > len) {
+        LOGW("Invalid caps reply: magic 0x%x version %d size %d/%d\n", reply->magic, reply->version, reply->size, len);
+        return -2;
+    }
+
+    // Older devices send a shorter structure, newer ones a longer one
+    size = reply->size < (int)sizeof(dev_caps_t) ? reply->size : (int)sizeof(dev_caps_t);
+    memset(caps, 0, sizeof(dev_caps_t));
+    memcpy(caps, reply, size);
+
+    LOGI("Device caps v%d: codecs 0x%x features 0x%x panel %dx%d rot %d fps %d\n",
+         caps->version, caps->codecs, caps->features, caps->width, caps->height, caps->rotation, caps->fps);
+    LOGI("Device caps: max transfer %u rx buffer %u decode %u px/s cache %d quality %d\n",
+         caps->max_transfer, caps->rx_buffer, caps->decode_rate, caps->cache_slots, caps->jpeg_quality);
+    LOGI("Device caps: JPEG profile %d decode buffer %u px\n", caps->jpeg_profile, caps->decode_buffer);
+    return 0;
+}
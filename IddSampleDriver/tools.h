@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include "basetype.h"
+#include "frame_pacer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,24 +56,56 @@ extern LONG debug_level;
 // Time functions
 int64_t tools_get_time_us(void);
 
+// Monotonic time for scheduling, not comparable with tools_get_time_us
+int64_t tools_get_mono_us(void);
+
 // Logging functions
 void tools_log(const char* fmt, ...);
 
-// FPS control
-void tools_sample_tick(int fps);
+// Frame pacer clock: monotonic time, sleeps on a high-resolution waitable
+// timer when the system has one. Returns -1 if no timer could be created,
+// the clock then falls back to Sleep.
+int tools_pacer_clock_init(pacer_clock_t* clock);
+void tools_pacer_clock_exit(pacer_clock_t* clock);
+
+// Performance statistics, see perf_stats_t for the threads updating them
+#define PERF_STATS_ADD(stats, field, n) \
+    InterlockedExchangeAdd64((volatile LONG64*)&(stats)->field, (LONG64)(n))
+#define PERF_STATS_SET(stats, field, v) \
+    InterlockedExchange64((volatile LONG64*)&(stats)->field, (LONG64)(v))
 
-// Performance statistics
 void tools_perf_stats_init(perf_stats_t* stats);
-void tools_perf_stats_update(perf_stats_t* stats, int frame_size,
+// Account a sent frame, returns the frames sent so far
+uint64_t tools_perf_stats_update(perf_stats_t* stats, int frame_size,
                              int64_t grab_time, int64_t encode_time,
                              int64_t send_time, int success);
+void tools_perf_stats_telemetry(perf_stats_t* stats, const dev_msg_telemetry_t* msg);
+void tools_perf_stats_latency(perf_stats_t* stats, int64_t latency_us);
+
+// Account an input event forwarded latency_us after the device sampled it (-1 = unknown)
+void tools_perf_stats_input(perf_stats_t* stats, int64_t latency_us);
+
+// Account a frame_pacer_wait result
+void tools_perf_stats_pace(perf_stats_t* stats, int64_t jitter_us, int missed);
+
+// Account the slack to its send slot a frame was predicted to have and had
+void tools_perf_stats_slack(perf_stats_t* stats, int64_t predicted_us, int64_t actual_us);
+
+// Account a completed transfer of bytes on bulk OUT pipe, safe from concurrent completions
+void tools_perf_stats_pipe(perf_stats_t* stats, int pipe, int bytes, int success);
 void tools_perf_stats_print(perf_stats_t* stats);
 void tools_perf_stats_reset(perf_stats_t* stats);
 
+// Consistent copy of stats to read several fields from
+void tools_perf_stats_snapshot(perf_stats_t* stats, perf_stats_t* copy);
+
 // USB device info parsing
 int tools_split_config_str(char* str, usb_info_item_t* cfg, int max);
 void tools_parse_usb_dev_info(char* str, usb_dev_config_t* config);
 
+// Binary capability reply, returns 0 if buf holds a valid dev_caps_t
+int tools_parse_dev_caps(const uint8_t* buf, int len, dev_caps_t* caps);
+
 #ifdef __cplusplus
 }
 #endif
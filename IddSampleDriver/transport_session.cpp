@@ -0,0 +1,74 @@
+#include "Driver.h"
+#include "transport_session.h"
+#include "tools.h"
+
+TransportSession::TransportSession()
+    : m_transport{}, m_urb_list{}, m_urbs_ready(false), m_width(0), m_height(0), m_sched(MAX_URB_SIZE - PIPELINE_IN_FLIGHT)
+{
+    usb_transport_init(&m_transport);
+    for (int i = 0; i < SEND_SCHED_MAX_CLIENTS; i++) {
+        m_encoders[i] = nullptr;
+        m_types[i] = -1;
+    }
+}
+
+TransportSession::~TransportSession()
+{
+    if (m_urbs_ready) {
+        // Completions still reference the pool
+        if (!usb_send_wait(&m_transport, 1, USB_SEND_TIMEOUT_MS)) {
+            LOGW("URBs still in flight at session teardown\n");
+        }
+        usb_resouce_distory(&m_urb_list);
+    }
+    for (int i = 0; i < SEND_SCHED_MAX_CLIENTS; i++) {
+        delete m_encoders[i];
+    }
+    usb_transport_exit(&m_transport);
+}
+
+bool TransportSession::open(int width, int height)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    if (!m_urbs_ready) {
+        if (usb_resouce_init(&m_transport, &m_urb_list, width, height) < 0) {
+            usb_resouce_distory(&m_urb_list);
+            return false;
+        }
+        m_urbs_ready = true;
+        m_width = width;
+        m_height = height;
+        return true;
+    }
+
+    if (width * height <= m_width * m_height) {
+        LOGI("Session reused: URB buffers for %dx%d\n", m_width, m_height);
+        return true;
+    }
+
+    // Every URB must be back in the pool before its buffer can move
+    if (!usb_send_wait(&m_transport, 1, USB_SEND_TIMEOUT_MS) || usb_resouce_resize(&m_urb_list, width, height) < 0) {
+        LOGE("Failed to resize URB buffers to %dx%d\n", width, height);
+        return false;
+    }
+    m_width = width;
+    m_height = height;
+    return true;
+}
+
+ImageEncoder* TransportSession::encoder(int monitor, int type, int quality)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    if (monitor < 0 || monitor >= SEND_SCHED_MAX_CLIENTS) {
+        return nullptr;
+    }
+    if (m_encoders[monitor] == nullptr || m_types[monitor] != type) {
+        delete m_encoders[monitor];
+        m_encoders[monitor] = new ImageEncoder(type, quality);
+        m_types[monitor] = type;
+    }
+    m_encoders[monitor]->set_quality(quality);
+    return m_encoders[monitor];
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "usb_driver.h"
+#include "encoder.h"
+#include "send_sched.h"
+#include <mutex>
+
+// URB pool, encoders and USB transport state of a device, owned by the device
+// context so a mode change or a new swap-chain reuses them instead of
+// rebuilding five frame buffers, their WDF requests and the encoder. Buffers only grow, an encoder
+// is only recreated when the image type changes. The monitors of the device
+// share the pool and take turns on the link through the scheduler, each has
+// an encoder of its own.
+class TransportSession
+{
+public:
+    TransportSession();
+    ~TransportSession();
+
+    // URB pool with buffers for width x height frames, false if it could not
+    // be created or resized (URBs of the last swap-chain still in flight)
+    bool open(int width, int height);
+
+    // Encoder of monitor for type at quality; the swap-chain sets the rest
+    // with the set_* calls, the session keeps ownership
+    ImageEncoder* encoder(int monitor, int type, int quality);
+
+    SLIST_HEADER* urb_list() { return &m_urb_list; }
+    SendScheduler* scheduler() { return &m_sched; }
+    usb_transport_t* transport() { return &m_transport; }
+
+private:
+    std::mutex m_lock;          // the swap-chains of several monitors open at once
+    usb_transport_t m_transport;
+    SLIST_HEADER m_urb_list;
+    bool m_urbs_ready;
+    int m_width, m_height;      // frame size the URB buffers hold
+    SendScheduler m_sched;
+    ImageEncoder* m_encoders[SEND_SCHED_MAX_CLIENTS];     // one per monitor
+    int m_types[SEND_SCHED_MAX_CLIENTS];
+};
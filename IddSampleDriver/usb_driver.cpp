@@ -7,13 +7,76 @@
 // Declare context access macro for IndirectDeviceContextWrapper
 WDF_DECLARE_CONTEXT_TYPE(IndirectDeviceContextWrapper);
 
-// Global error counter for USB
-static usb_connection_state_t g_usb_state = USB_STATE_DISCONNECTED;
-static volatile LONG g_usb_init_flag = 0;
-static WDFWAITLOCK g_usb_state_lock = NULL;
-
 #define LOG_DEBUG() // LOGI("%s.%d\n",__func__,__LINE__)
 
+// Transport state of the device, kept by its session
+static usb_transport_t* usb_transport(WDFDEVICE Device)
+{
+    return WdfObjectGet_IndirectDeviceContextWrapper(Device)->session->transport();
+}
+
+BOOLEAN usb_transport_init(usb_transport_t* transport)
+{
+    memset(transport, 0, sizeof(usb_transport_t));
+    InitializeSRWLock(&transport->state_lock);
+    InitializeSRWLock(&transport->submit_lock);
+    InitializeSRWLock(&transport->input_lock);
+    input_queue_reset(&transport->input_queue);
+    transport->send_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    transport->flow_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    transport->caps_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (transport->send_event == NULL || transport->flow_event == NULL || transport->caps_event == NULL) {
+        LOGE("Transport events could not be created\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void usb_transport_exit(usb_transport_t* transport)
+{
+    if (transport->send_event != NULL) {
+        CloseHandle(transport->send_event);
+        transport->send_event = NULL;
+    }
+    if (transport->flow_event != NULL) {
+        CloseHandle(transport->flow_event);
+        transport->flow_event = NULL;
+    }
+    if (transport->caps_event != NULL) {
+        CloseHandle(transport->caps_event);
+        transport->caps_event = NULL;
+    }
+}
+
+
+// Drop a reference of the URB, the last one gives it back to the pool
+static void usb_urb_put(urb_item_t* urb)
+{
+    if (InterlockedDecrement(&urb->pending) != 0) {
+        return;
+    }
+
+    usb_transport_t* transport = urb->transport;
+
+    // The device never saw (all of) this transfer and will not grant a credit for it
+    if (urb->failed && urb->has_credit) {
+        usb_flow_release(transport);
+    }
+    InterlockedPushEntrySList(urb->urb_list, &(urb->node));
+    InterlockedDecrement(&transport->urbs_in_flight);
+    SetEvent(transport->send_event);
+}
+
+// Stripe position of the pipe behind an I/O target, -1 = not striped
+static int usb_stripe_index(const usb_transport_t* transport, WDFIOTARGET Target)
+{
+    for (int i = 0; i < transport->stripe_count; i++) {
+        if (WdfUsbTargetPipeGetIoTarget(transport->stripe_pipes[i]) == Target) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 static VOID EvtRequestWriteCompletionRoutine(
     WDFREQUEST Request,
@@ -26,9 +89,6 @@ static VOID EvtRequestWriteCompletionRoutine(
     PWDF_USB_REQUEST_COMPLETION_PARAMS usbCompletionParams;
     urb_item_t* urb = (urb_item_t*)Context;
 
-    UNREFERENCED_PARAMETER(Request);
-    UNREFERENCED_PARAMETER(Target);
-
     status = CompletionParams->IoStatus.Status;
     usbCompletionParams = CompletionParams->Parameters.Usb.Completion;
     bytesWritten = usbCompletionParams->Parameters.PipeWrite.Length;
@@ -45,73 +105,68 @@ static VOID EvtRequestWriteCompletionRoutine(
             LOGE("Write failed: request Status 0x%x UsbdStatus 0x%x, URB id=%d, bytesWritten=%d\n",
                  status, usbCompletionParams->UsbdStatus, urb->id, bytesWritten);
         }
+        InterlockedExchange(&urb->failed, 1);
     }
 
-    if (NULL != urb->wdfMemory) {
-		WdfObjectDelete(urb->wdfMemory);
-		urb->wdfMemory = NULL;
-	}
+    if (Request == urb->Request) {
+        if (NULL != urb->wdfMemory) {
+            WdfObjectDelete(urb->wdfMemory);
+            urb->wdfMemory = NULL;
+        }
+    } else {
+        // Further transfer of a split stream, its memory is a child of the request
+        WdfObjectDelete(Request);
+    }
 
-    InterlockedPushEntrySList(urb->urb_list, &(urb->node));
-    LOGI("insert URB id=%d to list, bytesWritten=%d\n", urb->id, bytesWritten);
+    usb_transport_t* transport = urb->transport;
+    const int pipe = usb_stripe_index(transport, Target);
+    LONG queued = 0;
+    if (pipe >= 0) {
+        queued = InterlockedDecrement(&transport->pipe_queued[pipe]);
+        tools_perf_stats_pipe(transport->pipe_stats, pipe, (int)bytesWritten, NT_SUCCESS(status));
+    }
+
+    LOGI("URB id=%d transfer done on pipe %d (%d queued), bytesWritten=%d\n", urb->id, pipe, queued, bytesWritten);
+    usb_urb_put(urb);
 }
 
-NTSTATUS usb_send_data_async(urb_item_t* urb, WDFUSBPIPE pipe, int tsize)
+// Send tsize bytes at offset of the URB buffer with Request, the URB's own
+// request or a temporary one. tsize 0 sends a zero-length packet.
+static NTSTATUS usb_send_transfer(urb_item_t* urb, WDFUSBPIPE pipe, WDFREQUEST Request, int offset, int tsize)
 {
     NTSTATUS status;
-    WDFMEMORY  wdfMemory;
-    WDFREQUEST Request = urb->Request;
-    PUCHAR msg = urb->urb_msg;
-    WDF_USB_PIPE_INFORMATION pipeInfo;
+    WDFMEMORY wdfMemory = NULL;
     WDF_REQUEST_SEND_OPTIONS sendOptions;
+    const BOOLEAN own_request = (Request == urb->Request);
 
-
-    if (tsize > urb->urb_msg_size) {
-        LOGE("Transfer size %d exceeds buffer size %d for URB id=%d\n",tsize, urb->urb_msg_size, urb->id);
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    status = WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES,NonPagedPool,0,tsize,&wdfMemory,NULL);
-	if (!NT_SUCCESS(status)) {
-		LOGE("WdfMemoryCreate NG %x\n",status);
-		return status;
-	}
-
-    urb->wdfMemory=wdfMemory;
-#if 0
-    // 检查管道方向: 必须是OUT管道(写管道)
-    if (WdfUsbTargetPipeIsInEndpoint(pipe)) {
-        LOGE("Cannot use IN pipe (read pipe) for data send, URB id=%d\n", urb->id);
-        return STATUS_INVALID_PARAMETER;
-    }
-
-    // 获取管道信息进行验证
-    WDF_USB_PIPE_INFORMATION_INIT(&pipeInfo);
-    WdfUsbTargetPipeGetInformation(pipe, &pipeInfo);
-
-    if (pipeInfo.PipeType != WdfUsbPipeTypeBulk) {
-        LOGE("Pipe type %d is not supported, only Bulk pipe is supported, URB id=%d\n",pipeInfo.PipeType, urb->id);
-        return STATUS_INVALID_PARAMETER;
+    if (tsize > 0) {
+        WDF_OBJECT_ATTRIBUTES attributes;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+        attributes.ParentObject = Request;
+        status = WdfMemoryCreate(own_request ? WDF_NO_OBJECT_ATTRIBUTES : &attributes, NonPagedPool, 0, tsize, &wdfMemory, NULL);
+        if (!NT_SUCCESS(status)) {
+            LOGE("WdfMemoryCreate NG %x\n", status);
+            return status;
+        }
+        WdfMemoryCopyFromBuffer(wdfMemory, 0, urb->urb_msg + offset, tsize);
     }
-#endif
 
-    LOG_DEBUG();
-    // Copy to pre-allocated WDF memory
-    WdfMemoryCopyFromBuffer(wdfMemory, 0, msg, tsize);
-
-    WDF_REQUEST_REUSE_PARAMS params;
-    WDF_REQUEST_REUSE_PARAMS_INIT(&params, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
-    status = WdfRequestReuse(Request, &params);
-    if (!NT_SUCCESS(status)) {
-        LOGE("WdfRequestReuse failed: 0x%x, URB id=%d\n", status, urb->id);
+    if (own_request) {
+        WDF_REQUEST_REUSE_PARAMS params;
+        WDF_REQUEST_REUSE_PARAMS_INIT(&params, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+        status = WdfRequestReuse(Request, &params);
+        if (!NT_SUCCESS(status)) {
+            LOGE("WdfRequestReuse failed: 0x%x, URB id=%d\n", status, urb->id);
+        }
+        urb->wdfMemory = wdfMemory;
     }
 
-    // Format request for write
+    // Format request for write, no memory means a zero-length packet
     LOG_DEBUG();
-    status = WdfUsbTargetPipeFormatRequestForWrite(pipe, Request,wdfMemory, NULL);
+    status = WdfUsbTargetPipeFormatRequestForWrite(pipe, Request, wdfMemory, NULL);
     if (!NT_SUCCESS(status)) {
         LOGE("WdfUsbTargetPipeFormatRequestForWrite failed: 0x%x\n", status);
-        return status;
+        goto fail;
     }
 
     urb->pipe = pipe;
@@ -124,16 +179,149 @@ NTSTATUS usb_send_data_async(urb_item_t* urb, WDFUSBPIPE pipe, int tsize)
 
     LOG_DEBUG();
     if (!WdfRequestSend(Request, WdfUsbTargetPipeGetIoTarget(pipe), &sendOptions)) {
-        WdfRequestGetStatus(Request);
+        status = WdfRequestGetStatus(Request);
         LOGE("WdfRequestSend failed: 0x%x, URB id=%d\n", status, urb->id);
-        return status;
+        goto fail;
     }
-
-    LOGI("usb_send_data_async: Request sent successfully, URB id=%d, timeout=%dms ..... \n", urb->id, USB_SEND_TIMEOUT_MS);
     return STATUS_SUCCESS;
+
+fail:
+    if (wdfMemory != NULL) {
+        WdfObjectDelete(wdfMemory);
+    }
+    if (own_request) {
+        urb->wdfMemory = NULL;
+    }
+    return status;
+}
+
+NTSTATUS usb_send_data_async(urb_item_t* urb, WDFUSBPIPE pipe, int tsize)
+{
+    usb_transport_t* transport = urb->transport;
+    NTSTATUS status = STATUS_SUCCESS;
+    int zlp = 0;
+    int transfers = 0;
+
+    // The sender holds a reference until all transfers are on their way
+    urb->pending = 1;
+    urb->failed = 0;
+    InterlockedIncrement(&transport->urbs_in_flight);
+
+    // The device parses one byte stream: the chunks of this URB must not land
+    // between those of a frame, cursor or ping submitted by another thread,
+    // and a striped stream must start on the first pipe after the last one ended
+    AcquireSRWLockExclusive(&transport->submit_lock);
+    if (tsize > urb->urb_msg_size) {
+        LOGE("Transfer size %d exceeds buffer size %d for URB id=%d\n",tsize, urb->urb_msg_size, urb->id);
+        status = STATUS_BUFFER_TOO_SMALL;
+    } else {
+        tsize = packetizer_terminate(&transport->packetizer, urb->urb_msg, tsize, urb->urb_msg_size, &zlp);
+        if (tsize <= 0) {
+            LOGE("No room to terminate the transfer, URB id=%d\n", urb->id);
+            status = STATUS_BUFFER_TOO_SMALL;
+        }
+    }
+
+    for (int offset = 0; NT_SUCCESS(status) && (offset < tsize || zlp); ) {
+        const int size = offset < tsize ? packetizer_next(&transport->packetizer, offset, tsize) : 0;
+        WDFREQUEST Request = urb->Request;
+        // Chunk n of a striped transfer goes to pipe n modulo the pipe count
+        const int stripe = (transport->stripe_count > 1 && pipe == transport->stripe_pipes[0]) ?
+                           transfers % transport->stripe_count : -1;
+        WDFUSBPIPE chunk_pipe = stripe >= 0 ? transport->stripe_pipes[stripe] : pipe;
+
+        if (offset > 0) {
+            status = WdfRequestCreate(WDF_NO_OBJECT_ATTRIBUTES, NULL, &Request);
+            if (!NT_SUCCESS(status)) {
+                LOGE("WdfRequestCreate failed: 0x%x\n", status);
+                break;
+            }
+        }
+
+        InterlockedIncrement(&urb->pending);
+        if (stripe >= 0) {
+            InterlockedIncrement(&transport->pipe_queued[stripe]);
+        }
+        status = usb_send_transfer(urb, chunk_pipe, Request, offset, size);
+        if (!NT_SUCCESS(status)) {
+            // No completion will come for it
+            InterlockedDecrement(&urb->pending);
+            if (stripe >= 0) {
+                InterlockedDecrement(&transport->pipe_queued[stripe]);
+            }
+            if (Request != urb->Request) {
+                WdfObjectDelete(Request);
+            }
+            break;
+        }
+        transfers++;
+        if (size == 0) {
+            zlp = 0;
+        }
+        offset += size;
+    }
+    ReleaseSRWLockExclusive(&transport->submit_lock);
+
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&urb->failed, 1);
+    }
+    usb_urb_put(urb);
+
+    LOGI("usb_send_data_async: %d transfers of %d bytes, URB id=%d, status 0x%x\n", transfers, tsize, urb->id, status);
+    return status;
+}
+
+void usb_packetizer_init(usb_transport_t* transport, int max_packet, int rx_buffer, int max_transfer, BOOLEAN use_zlp)
+{
+    packetizer_init(&transport->packetizer, max_packet, rx_buffer, max_transfer, use_zlp);
+    LOGI("Packetizer: max packet %d, transfers up to %d bytes, %s\n", max_packet,
+         transport->packetizer.max_transfer, use_zlp ? "zero-length packet" : "padding");
+}
+
+
+BOOLEAN usb_send_wait(usb_transport_t* transport, LONG max_in_flight, DWORD timeout_ms)
+{
+    const int64_t deadline_us = tools_get_time_us() + (int64_t)timeout_ms * 1000;
+
+    while (transport->urbs_in_flight >= max_in_flight) {
+        const int64_t left_us = deadline_us - tools_get_time_us();
+        if (left_us <= 0 || transport->send_event == NULL) {
+            return FALSE;
+        }
+        WaitForSingleObject(transport->send_event, (DWORD)((left_us + 999) / 1000));
+    }
+    return TRUE;
 }
 
 
+void usb_stripe_init(WDFDEVICE Device)
+{
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
+    const BOOLEAN stripe = (pDeviceContext->config.features & DEV_FEATURE_STRIPE) != 0;
+
+    transport->stripe_count = 0;
+    for (int i = 0; i < pDeviceContext->BulkWritePipeCount && (stripe || i == 0); i++) {
+        transport->stripe_pipes[transport->stripe_count] = pDeviceContext->BulkWritePipes[i];
+        InterlockedExchange(&transport->pipe_queued[transport->stripe_count], 0);
+        transport->stripe_count++;
+    }
+
+    perf_stats_t* stats = &pDeviceContext->perf_stats;
+    AcquireSRWLockExclusive(&stats->lock);
+    for (int i = 0; i < PERF_MAX_PIPES; i++) {
+        stats->pipe_transfers[i] = 0;
+        stats->pipe_bytes[i] = 0;
+        stats->pipe_failed[i] = 0;
+    }
+    stats->pipe_count = transport->stripe_count;
+    stats->pipe_start_us = tools_get_time_us();
+    ReleaseSRWLockExclusive(&stats->lock);
+    transport->pipe_stats = stats;
+
+    LOGI("Bulk OUT: %d pipes, %s\n", pDeviceContext->BulkWritePipeCount,
+         transport->stripe_count > 1 ? "transfers striped over all" : "transfers on the first");
+}
 
 NTSTATUS usb_send_data_sync(urb_item_t* urb, WDFUSBPIPE pipe, int tsize)
 {
@@ -279,6 +467,9 @@ NTSTATUS usb_select_interface(WDFDEVICE Device)
 
     pDeviceContext->BulkReadPipe = NULL;
     pDeviceContext->BulkWritePipe = NULL;
+    pDeviceContext->BulkWritePipeCount = 0;
+    UCHAR endpoints[USB_MAX_OUT_PIPES];
+    int packet_sizes[USB_MAX_OUT_PIPES];
 
     // Scan all interfaces to find Bulk endpoints
     for (UCHAR ifIndex = 0; ifIndex < numInterfaces; ifIndex++) {
@@ -315,15 +506,34 @@ NTSTATUS usb_select_interface(WDFDEVICE Device)
             }
 
             if (pipeInfo.PipeType == WdfUsbPipeTypeBulk && WdfUsbTargetPipeIsOutEndpoint(pipe)) {
-                pDeviceContext->BulkWritePipe = pipe;
-                pDeviceContext->max_out_pkg_size = pipeInfo.MaximumPacketSize;
+                int count = pDeviceContext->BulkWritePipeCount;
+                if (count == USB_MAX_OUT_PIPES) {
+                    LOGW("Bulk OUT endpoint 0x%02x not used, %d pipes at most\n", pipeInfo.EndpointAddress, USB_MAX_OUT_PIPES);
+                    continue;
+                }
+                // Keep them in endpoint order, the order of DEV_FEATURE_STRIPE
+                while (count > 0 && endpoints[count - 1] > pipeInfo.EndpointAddress) {
+                    endpoints[count] = endpoints[count - 1];
+                    packet_sizes[count] = packet_sizes[count - 1];
+                    pDeviceContext->BulkWritePipes[count] = pDeviceContext->BulkWritePipes[count - 1];
+                    count--;
+                }
+                endpoints[count] = pipeInfo.EndpointAddress;
+                packet_sizes[count] = pipeInfo.MaximumPacketSize;
+                pDeviceContext->BulkWritePipes[count] = pipe;
+                pDeviceContext->BulkWritePipeCount++;
                 pDeviceContext->UsbInterface = usbInterface;
-                LOGI("Found BulkWrite Pipe on interface %d: 0x%p, max_packet_size: %d\n",
-                     interfaceNumber, pipe, pDeviceContext->max_out_pkg_size);
+                LOGI("Found BulkWrite Pipe 0x%02x on interface %d: 0x%p, max_packet_size: %d\n",
+                     pipeInfo.EndpointAddress, interfaceNumber, pipe, pipeInfo.MaximumPacketSize);
             }
         }
     }
 
+    if (pDeviceContext->BulkWritePipeCount > 0) {
+        pDeviceContext->BulkWritePipe = pDeviceContext->BulkWritePipes[0];
+        pDeviceContext->max_out_pkg_size = packet_sizes[0];
+    }
+
     if (pDeviceContext->BulkWritePipe == NULL || pDeviceContext->BulkReadPipe == NULL) {
         status = STATUS_INVALID_DEVICE_STATE;
         LOGE("Device not properly configured: BulkReadPipe=%p, BulkWritePipe=%p\n",
@@ -335,7 +545,67 @@ NTSTATUS usb_select_interface(WDFDEVICE Device)
     return STATUS_SUCCESS;
 }
 
-int usb_resouce_init(SLIST_HEADER* urb_list, int width, int height)
+// The reply comes through the continuous reader, see EvtUsbReadComplete: a
+// pipe configured for it takes no other reads, and it stays configured over
+// prepare/release cycles. The reader is started for the handshake only, D0
+// entry starts it for good.
+NTSTATUS usb_query_dev_caps(WDFDEVICE Device, dev_caps_t* caps)
+{
+    NTSTATUS status;
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
+    WDF_MEMORY_DESCRIPTOR memDesc;
+    WDF_REQUEST_SEND_OPTIONS sendOptions;
+    ULONG bytesTransferred = 0;
+    struct {
+        image_frame_header_t header;
+        host_caps_t host;
+    } query = {};
+
+    if (pDeviceContext->BulkWritePipe == NULL || transport->reader_pipe == NULL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    query.header.magic_id = FRAME_MAGIC_ID;
+    query.header.img_type = IMAGE_TYPE_CAPS_QUERY;
+    query.header.img_len = sizeof(host_caps_t);
+    query.header.reserved[0] = 0X12345678;
+    query.header.reserved[1] = 0X87654321;
+    query.host.version = DEV_CAPS_VERSION;
+    query.host.size = sizeof(host_caps_t);
+    query.host.features = DEV_FEATURE_HOST_MASK;
+
+    ResetEvent(transport->caps_event);
+    InterlockedExchange(&transport->caps_wait, TRUE);
+    status = usb_reader_start(Device);
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&transport->caps_wait, FALSE);
+        return status;
+    }
+
+    WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_TIMEOUT);
+    WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&sendOptions, WDF_REL_TIMEOUT_IN_MS(USB_CAPS_TIMEOUT_MS));
+
+    WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&memDesc, &query, sizeof(query));
+    status = WdfUsbTargetPipeWriteSynchronously(pDeviceContext->BulkWritePipe, NULL, &sendOptions, &memDesc, &bytesTransferred);
+    if (!NT_SUCCESS(status)) {
+        LOGW("Caps query write failed: 0x%x\n", status);
+    } else if (WaitForSingleObject(transport->caps_event, USB_CAPS_TIMEOUT_MS) != WAIT_OBJECT_0) {
+        // Devices without the handshake do not answer
+        status = STATUS_IO_TIMEOUT;
+    } else {
+        status = transport->caps_status;
+    }
+
+    InterlockedExchange(&transport->caps_wait, FALSE);
+    usb_reader_stop(Device);
+    if (NT_SUCCESS(status)) {
+        *caps = transport->caps;
+    }
+    return status;
+}
+
+int usb_resouce_init(usb_transport_t* transport, SLIST_HEADER* urb_list, int width, int height)
 {
     NTSTATUS status;
 
@@ -346,16 +616,6 @@ int usb_resouce_init(SLIST_HEADER* urb_list, int width, int height)
     int buffer_size = width * height * 4;  // RGB888 = 4 bytes per pixel
     int max_transfer_size = buffer_size + 128;
 
-    // Initialize USB state lock for UMDF
-    WDF_OBJECT_ATTRIBUTES attributes;
-    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-    status = WdfWaitLockCreate(&attributes, &g_usb_state_lock);
-    if (!NT_SUCCESS(status)) {
-        LOGE("WdfWaitLockCreate failed: 0x%x\n", status);
-        return -1;
-    }
-
-    // Set lock initialized flag
     for (int i = 0; i < MAX_URB_SIZE; i++) {
 
         urb_item_t* purb = (urb_item_t*)_aligned_malloc(sizeof(urb_item_t), MEMORY_ALLOCATION_ALIGNMENT);
@@ -371,7 +631,12 @@ int usb_resouce_init(SLIST_HEADER* urb_list, int width, int height)
         }
 
         purb->id = i;
+        purb->has_credit = FALSE;
+        purb->pending = 0;
+        purb->failed = 0;
+        purb->wdfMemory = NULL;
         purb->urb_list = urb_list;
+        purb->transport = transport;
 
         // Allocate urb_msg buffer
         purb->urb_msg = (uint8_t*)_aligned_malloc(max_transfer_size, MEMORY_ALLOCATION_ALIGNMENT);
@@ -383,10 +648,53 @@ int usb_resouce_init(SLIST_HEADER* urb_list, int width, int height)
         InterlockedPushEntrySList(urb_list, &(purb->node));
         LOGD("Created URB item %d: urb_msg=%p, size=%d, wdfMemory=%p\n",purb->id, purb->urb_msg, purb->urb_msg_size, purb->wdfMemory);
     }
-    g_usb_init_flag = 1;
     return 0;
 }
 
+int usb_resouce_resize(SLIST_HEADER* urb_list, int width, int height)
+{
+    urb_item_t* urbs[MAX_URB_SIZE];
+    int count = 0;
+    int result = 0;
+    const int max_transfer_size = width * height * 4 + 128;
+
+    while (count < MAX_URB_SIZE) {
+        urb_item_t* purb = (urb_item_t*)InterlockedPopEntrySList(urb_list);
+        if (purb == NULL) {
+            break;
+        }
+        urbs[count++] = purb;
+    }
+    if (count < MAX_URB_SIZE) {
+        LOGE("%s: %d URBs still in use\n", __func__, MAX_URB_SIZE - count);
+        result = -1;
+    }
+
+    for (int i = 0; i < count && result == 0; i++) {
+        urb_item_t* purb = urbs[i];
+        if (purb->urb_msg_size >= max_transfer_size) {
+            continue;
+        }
+        uint8_t* msg = (uint8_t*)_aligned_malloc(max_transfer_size, MEMORY_ALLOCATION_ALIGNMENT);
+        if (msg == NULL) {
+            LOGE("Failed to allocate urb_msg for URB %d\n", purb->id);
+            result = -2;
+            break;
+        }
+        _aligned_free(purb->urb_msg);
+        purb->urb_msg = msg;
+        purb->urb_msg_size = max_transfer_size;
+    }
+
+    for (int i = 0; i < count; i++) {
+        InterlockedPushEntrySList(urb_list, &(urbs[i]->node));
+    }
+    if (result == 0) {
+        LOGI("%s: URB buffers for %dx%d\n", __func__, width, height);
+    }
+    return result;
+}
+
 int usb_resouce_distory(SLIST_HEADER* urb_list)
 {
     LOGD("%s: Cleaning up URB list\n", __func__);
@@ -413,51 +721,298 @@ int usb_resouce_distory(SLIST_HEADER* urb_list)
         }
         _aligned_free(purb);
     }
-    g_usb_init_flag =0;
     return 0;
 }
 
+// The pipes and the striping are set up once at prepare hardware and shared
+// by all monitors, transfers of other monitors may be in flight: connecting a
+// swap-chain only checks that they are there and marks the device connected.
 NTSTATUS usb_device_connect(WDFDEVICE Device)
 {
-    NTSTATUS status;
-    if(g_usb_init_flag > 0) {
-        // Re-select interfaces
-        status = usb_select_interface(Device);
-        if (!NT_SUCCESS(status)) {
-            LOGE("Failed to select interfaces on reconnect: 0x%x\n", status);
-            return status;
-        }
-
-        WdfWaitLockAcquire(g_usb_state_lock, NULL);
-        g_usb_state = USB_STATE_CONNECTED;
-        WdfWaitLockRelease(g_usb_state_lock);
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
 
+    if (pDeviceContext->UsbDevice == NULL || pDeviceContext->BulkWritePipe == NULL) {
+        LOGE("USB device not prepared: UsbDevice=%p, BulkWritePipe=%p\n",
+             pDeviceContext->UsbDevice, pDeviceContext->BulkWritePipe);
+        return STATUS_INVALID_DEVICE_STATE;
     }
+
+    AcquireSRWLockExclusive(&transport->state_lock);
+    pDeviceContext->usb_state = USB_STATE_CONNECTED;
+    ReleaseSRWLockExclusive(&transport->state_lock);
+
     LOGI("USB device connected successfully\n");
     return STATUS_SUCCESS;
 }
 
 NTSTATUS usb_device_disconnect(WDFDEVICE Device)
 {
-    UNREFERENCED_PARAMETER(Device);
-    // Update USB state
-    if(g_usb_init_flag > 0) {
-        WdfWaitLockAcquire(g_usb_state_lock, NULL);
-        g_usb_state = USB_STATE_DISCONNECTED;
-        WdfWaitLockRelease(g_usb_state_lock);
-    }
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
+
+    AcquireSRWLockExclusive(&transport->state_lock);
+    pDeviceContext->usb_state = USB_STATE_DISCONNECTED;
+    ReleaseSRWLockExclusive(&transport->state_lock);
+
     LOGI("USB device disconnected\n");
     return STATUS_SUCCESS;
 }
 
 BOOLEAN usb_is_connected(WDFDEVICE Device)
 {
-    UNREFERENCED_PARAMETER(Device);
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
     usb_connection_state_t state;
-    if(g_usb_init_flag > 0) {
-        WdfWaitLockAcquire(g_usb_state_lock, NULL);
-        state = g_usb_state;
-        WdfWaitLockRelease(g_usb_state_lock);
-    }
+
+    AcquireSRWLockShared(&transport->state_lock);
+    state = pDeviceContext->usb_state;
+    ReleaseSRWLockShared(&transport->state_lock);
     return (state == USB_STATE_CONNECTED);
 }
+
+static void usb_flow_grant(usb_transport_t* transport, LONG credits)
+{
+    InterlockedExchangeAdd(&transport->flow_credits, credits);
+    InterlockedExchange64(&transport->flow_grant_us, tools_get_time_us());
+    SetEvent(transport->flow_event);
+}
+
+void usb_flow_init(usb_transport_t* transport, BOOLEAN enabled, int credits)
+{
+    transport->flow_enabled = enabled && transport->flow_event != NULL;
+    transport->flow_initial = credits;
+    InterlockedExchange(&transport->flow_credits, credits);
+    InterlockedExchange64(&transport->flow_grant_us, tools_get_time_us());
+    LOGI("Flow control %s, %d initial credits\n", transport->flow_enabled ? "enabled" : "disabled", credits);
+}
+
+BOOLEAN usb_flow_acquire(usb_transport_t* transport, DWORD timeout_ms)
+{
+    if (!transport->flow_enabled) {
+        return TRUE;
+    }
+
+    for (;;) {
+        const LONG credits = transport->flow_credits;
+        if (credits > 0) {
+            if (InterlockedCompareExchange(&transport->flow_credits, credits - 1, credits) == credits) {
+                return TRUE;
+            }
+            continue;
+        }
+
+        // A lost grant must not stall the stream for good
+        if (tools_get_time_us() - transport->flow_grant_us > FLOW_STALL_MS * 1000) {
+            LOGW("No credit for %dms, resetting flow control\n", FLOW_STALL_MS);
+            usb_flow_grant(transport, transport->flow_initial);
+            continue;
+        }
+
+        if (timeout_ms == 0 || WaitForSingleObject(transport->flow_event, timeout_ms) != WAIT_OBJECT_0) {
+            return FALSE;
+        }
+        timeout_ms = 0;
+    }
+}
+
+void usb_flow_release(usb_transport_t* transport)
+{
+    if (!transport->flow_enabled) return;
+
+    InterlockedIncrement(&transport->flow_credits);
+    SetEvent(transport->flow_event);
+}
+
+void usb_input_set_sink(usb_transport_t* transport, usb_input_sink_t sink, void* context)
+{
+    AcquireSRWLockExclusive(&transport->input_lock);
+    transport->input_sink = sink;
+    transport->input_sink_context = context;
+    // Events queued so far are too old to inject
+    input_queue_reset(&transport->input_queue);
+    ReleaseSRWLockExclusive(&transport->input_lock);
+}
+
+// Queue the events of a DEV_MSG_INPUT payload and forward everything queued.
+// The lock is held across the sink so reports of concurrent reads stay ordered.
+static void usb_input_dispatch(IndirectDeviceContextWrapper* pDeviceContext, usb_transport_t* transport, const uint8_t* payload, int size)
+{
+    input_event_t events[INPUT_MAX_EVENTS];
+    input_event_t event;
+    uint32_t seq = 0;
+    const int count = input_parse(payload, size, events, INPUT_MAX_EVENTS, &seq);
+
+    if (count < 0) {
+        LOGW("Malformed input report, %d bytes\n", size);
+        return;
+    }
+
+    AcquireSRWLockExclusive(&transport->input_lock);
+    if (transport->input_seq_valid) {
+        const uint32_t lost = input_seq_lost(transport->input_seq, seq);
+        if (lost == 0 && seq != transport->input_seq + 1) {
+            LOGD("Input report counter resync %u -> %u\n", transport->input_seq, seq);
+        }
+        PERF_STATS_ADD(&pDeviceContext->perf_stats, input_dropped, lost);
+    }
+    transport->input_seq = seq;
+    transport->input_seq_valid = TRUE;
+
+    const uint64_t queue_dropped = transport->input_queue.dropped;
+    for (int i = 0; i < count; i++) {
+        input_queue_push(&transport->input_queue, &events[i]);
+    }
+    PERF_STATS_ADD(&pDeviceContext->perf_stats, input_dropped, transport->input_queue.dropped - queue_dropped);
+
+    while (transport->input_sink != NULL && input_queue_pop(&transport->input_queue, &event)) {
+        transport->input_sink(transport->input_sink_context, &event);
+        const int64_t latency_us = pDeviceContext->clock.valid ?
+            tools_get_time_us() - clock_sync_to_host(&pDeviceContext->clock, event.device_us) : -1;
+        tools_perf_stats_input(&pDeviceContext->perf_stats, latency_us);
+    }
+    ReleaseSRWLockExclusive(&transport->input_lock);
+}
+
+static void usb_dispatch_dev_msg(WDFDEVICE Device, const uint8_t* buf, int len)
+{
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
+    int pos = 0;
+
+    while (len - pos >= (int)sizeof(dev_msg_header_t)) {
+        const dev_msg_header_t* msg = (const dev_msg_header_t*)(buf + pos);
+
+        if (msg->magic != DEV_MSG_MAGIC || msg->size < sizeof(dev_msg_header_t) || msg->size > len - pos) {
+            LOGW("Malformed device message at %d/%d\n", pos, len);
+            return;
+        }
+
+        switch (msg->type) {
+        case DEV_MSG_CREDIT:
+            if (msg->size >= sizeof(dev_msg_credit_t)) {
+                const dev_msg_credit_t* credit = (const dev_msg_credit_t*)msg;
+                usb_flow_grant(transport, credit->credits);
+                PERF_STATS_ADD(&pDeviceContext->perf_stats, credits_received, credit->credits);
+                LOGD("Credit +%u after frame %u, now %d\n", credit->credits, credit->frame_seq, transport->flow_credits);
+            }
+            break;
+        case DEV_MSG_TELEMETRY:
+            if (msg->size >= sizeof(dev_msg_telemetry_t)) {
+                const dev_msg_telemetry_t* telemetry = (const dev_msg_telemetry_t*)msg;
+                tools_perf_stats_telemetry(&pDeviceContext->perf_stats, telemetry);
+                LOGD("Telemetry frame %u: decode %uus fill %u/%u dropped %u\n", telemetry->frame_seq,
+                     telemetry->decode_us, telemetry->rx_fill, telemetry->rx_size, telemetry->dropped_frames);
+            }
+            break;
+        case DEV_MSG_PONG:
+            if (msg->size >= sizeof(dev_msg_pong_t)) {
+                const dev_msg_pong_t* pong = (const dev_msg_pong_t*)msg;
+                clock_sync_add(&pDeviceContext->clock, pong->host_us, pong->rx_us, pong->tx_us, tools_get_time_us());
+                PERF_STATS_SET(&pDeviceContext->perf_stats, clock_rtt_us, pDeviceContext->clock.rtt);
+                LOGD("Pong %u: offset %lld us rtt %lld us\n", pong->seq, pDeviceContext->clock.offset, pDeviceContext->clock.rtt);
+            }
+            break;
+        case DEV_MSG_PRESENT:
+            if (msg->size >= sizeof(dev_msg_present_t) && pDeviceContext->clock.valid) {
+                const dev_msg_present_t* present = (const dev_msg_present_t*)msg;
+                // The header carries the low 32 bits of the capture time, wrap-safe for latencies below 71 minutes
+                const _u32 present_us = (_u32)clock_sync_to_host(&pDeviceContext->clock, present->present_us);
+                tools_perf_stats_latency(&pDeviceContext->perf_stats, (int32_t)(present_us - present->capture_us));
+            }
+            break;
+        case DEV_MSG_INPUT:
+            usb_input_dispatch(pDeviceContext, transport, (const uint8_t*)(msg + 1), msg->size - (int)sizeof(dev_msg_header_t));
+            break;
+        default:
+            LOGD("Unknown device message type %d\n", msg->type);
+            break;
+        }
+        pos += msg->size;
+    }
+}
+
+static VOID EvtUsbReadComplete(WDFUSBPIPE Pipe, WDFMEMORY Buffer, size_t NumBytesTransferred, WDFCONTEXT Context)
+{
+    UNREFERENCED_PARAMETER(Pipe);
+
+    const uint8_t* buf = (const uint8_t*)WdfMemoryGetBuffer(Buffer, NULL);
+    usb_transport_t* transport = usb_transport((WDFDEVICE)Context);
+
+    // The answer to usb_query_dev_caps, everything else is device messages
+    if (NumBytesTransferred >= sizeof(uint32_t) && *(const uint32_t*)buf == DEV_CAPS_MAGIC) {
+        if (InterlockedCompareExchange(&transport->caps_wait, FALSE, TRUE) == TRUE) {
+            transport->caps_status = tools_parse_dev_caps(buf, (int)NumBytesTransferred, &transport->caps) < 0 ?
+                                     STATUS_DEVICE_PROTOCOL_ERROR : STATUS_SUCCESS;
+            SetEvent(transport->caps_event);
+        }
+        return;
+    }
+    usb_dispatch_dev_msg((WDFDEVICE)Context, buf, (int)NumBytesTransferred);
+}
+
+static BOOLEAN EvtUsbReadersFailed(WDFUSBPIPE Pipe, NTSTATUS Status, USBD_STATUS UsbdStatus)
+{
+    UNREFERENCED_PARAMETER(Pipe);
+
+    LOGW("Bulk IN reader failed: 0x%x UsbdStatus 0x%x, restarting\n", Status, UsbdStatus);
+    return TRUE;
+}
+
+NTSTATUS usb_reader_config(WDFDEVICE Device)
+{
+    NTSTATUS status;
+    auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(Device);
+    usb_transport_t* transport = usb_transport(Device);
+    WDF_USB_CONTINUOUS_READER_CONFIG readerConfig;
+
+    if (pDeviceContext->BulkReadPipe == NULL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    // A pipe keeps its reader across prepare/release cycles
+    if (pDeviceContext->BulkReadPipe == transport->reader_pipe) {
+        return STATUS_SUCCESS;
+    }
+
+    WDF_USB_CONTINUOUS_READER_CONFIG_INIT(&readerConfig, EvtUsbReadComplete, Device, USB_READ_BUFF_SIZE);
+    readerConfig.EvtUsbTargetPipeReadersFailed = EvtUsbReadersFailed;
+
+    status = WdfUsbTargetPipeConfigContinuousReader(pDeviceContext->BulkReadPipe, &readerConfig);
+    if (!NT_SUCCESS(status)) {
+        LOGE("WdfUsbTargetPipeConfigContinuousReader failed: 0x%x\n", status);
+        return status;
+    }
+
+    transport->reader_pipe = pDeviceContext->BulkReadPipe;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS usb_reader_start(WDFDEVICE Device)
+{
+    usb_transport_t* transport = usb_transport(Device);
+    NTSTATUS status;
+
+    if (transport->reader_pipe == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    // The device restarts its report counter
+    AcquireSRWLockExclusive(&transport->input_lock);
+    transport->input_seq_valid = FALSE;
+    ReleaseSRWLockExclusive(&transport->input_lock);
+
+    status = WdfIoTargetStart(WdfUsbTargetPipeGetIoTarget(transport->reader_pipe));
+    if (!NT_SUCCESS(status)) {
+        LOGE("Bulk IN reader start failed: 0x%x\n", status);
+    }
+    return status;
+}
+
+void usb_reader_stop(WDFDEVICE Device)
+{
+    usb_transport_t* transport = usb_transport(Device);
+
+    if (transport->reader_pipe != NULL) {
+        WdfIoTargetStop(WdfUsbTargetPipeGetIoTarget(transport->reader_pipe), WdfIoTargetCancelSentIo);
+    }
+}
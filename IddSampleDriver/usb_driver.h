@@ -3,6 +3,8 @@
 #include <wdf.h>
 #include <stdint.h>
 #include "basetype.h"
+#include "input.h"
+#include "packetizer.h"
 
 #define MAX_URB_SIZE    5
 #define MAX_RETRY_COUNT 3
@@ -10,9 +12,61 @@
 #define USB_INFO_CFG_MAX 10
 #define USB_BUFF_SIZE   (1920 * 1080 * 4)
 #define USB_SEND_TIMEOUT_MS  500
+#define USB_CAPS_TIMEOUT_MS  200
+#define USB_READ_BUFF_SIZE   512
+#define USB_MAX_OUT_PIPES    PERF_MAX_PIPES
+#define USB_STRIPE_CHUNK     (64 * 1024)   // stripe chunk of devices without a transfer limit
+
+// Credit based flow control, see DEV_FEATURE_CREDIT
+#define FLOW_INITIAL_CREDITS 2      // transfers in flight before the first grant
+#define FLOW_STALL_MS        1000   // assume lost grants after this long without one
+
+// Input back-channel of DEV_FEATURE_INPUT devices: DEV_MSG_INPUT events are
+// handed to the sink from the reader completion, in device order. The sink
+// injects them and must not block. Events arriving without a sink wait in a
+// bounded queue, see input_queue_t.
+typedef void (*usb_input_sink_t)(void* context, const input_event_t* event);
+
+// Transport state of one device, owned by its TransportSession: the send
+// path, the bulk OUT pipes, credits from the device and the input queue.
+// Adapters of several devices run side by side, each on its own.
+typedef struct _usb_transport {
+    SRWLOCK state_lock;             // guards the device context usb_state
+    // Transfer splitting of usb_send_data_async. One URB is submitted at a
+    // time so the chunks of two streams never interleave on the pipes.
+    SRWLOCK submit_lock;
+    packetizer_t packetizer;
+    volatile LONG urbs_in_flight;
+    HANDLE send_event;              // set when a URB went back to its pool
+    // Bulk OUT pipes a transfer is striped over, see DEV_FEATURE_STRIPE
+    WDFUSBPIPE stripe_pipes[USB_MAX_OUT_PIPES];
+    int stripe_count;
+    volatile LONG pipe_queued[USB_MAX_OUT_PIPES];     // transfers waiting on each pipe
+    perf_stats_t* pipe_stats;
+    // Bulk IN reader and transfer credits granted by the device
+    WDFUSBPIPE reader_pipe;
+    volatile LONG flow_credits;
+    volatile LONG64 flow_grant_us;
+    BOOLEAN flow_enabled;
+    int flow_initial;
+    HANDLE flow_event;
+    // Capability reply picked from the reader, see usb_query_dev_caps
+    HANDLE caps_event;
+    volatile LONG caps_wait;
+    NTSTATUS caps_status;
+    dev_caps_t caps;
+    // Touch/pointer input waiting for the sink
+    SRWLOCK input_lock;
+    input_queue_t input_queue;
+    usb_input_sink_t input_sink;
+    void* input_sink_context;
+    uint32_t input_seq;
+    BOOLEAN input_seq_valid;
+} usb_transport_t;
 
 typedef struct _urb_item {
     SLIST_ENTRY node;
+    usb_transport_t* transport;     // of the device the pool belongs to
     WDFUSBPIPE pipe;
     int id;
     uint8_t* urb_msg;  // Dynamically allocated buffer
@@ -20,24 +74,79 @@ typedef struct _urb_item {
     PSLIST_HEADER urb_list;
     WDFREQUEST Request;
     WDFMEMORY wdfMemory;  // Pre-allocated WDF memory for USB transfer
+    BOOLEAN has_credit;   // transfer holds a flow control credit
+    volatile LONG pending;    // references: the sender and each transfer in flight
+    volatile LONG failed;     // a transfer of the URB failed
 } urb_item_t, *purb_item_t;
 
-// USB transfer resource initialization
-int usb_resouce_init(SLIST_HEADER* urb_list, int width, int height);
+// Per-device transport state, see usb_transport_t
+BOOLEAN usb_transport_init(usb_transport_t* transport);
+void usb_transport_exit(usb_transport_t* transport);
+
+// USB transfer resource initialization, the URBs send through transport
+int usb_resouce_init(usb_transport_t* transport, SLIST_HEADER* urb_list, int width, int height);
+
+// Grow the URB buffers to width x height frames, every URB must be in the
+// pool. Buffers already large enough are kept.
+int usb_resouce_resize(SLIST_HEADER* urb_list, int width, int height);
 
 // USB transfer resource cleanup
 int usb_resouce_distory(SLIST_HEADER* urb_list);
 
-// USB asynchronous data send with retry
+// Send the tsize bytes of packets in urb->urb_msg, split into transfers by the
+// packetizer and terminated with padding or a zero-length packet. The URB goes
+// back to its pool when the last transfer completed, also when sending fails;
+// a failed URB holding a credit gives it back. Streams of concurrent callers
+// (frames from the send stage, cursor and pings from the encode stage) go
+// out one after the other, never interleaved.
 NTSTATUS usb_send_data_async(urb_item_t* urb, WDFUSBPIPE pipe, int tsize);
 
+// Transfer limits of usb_send_data_async, see packetizer_init
+void usb_packetizer_init(usb_transport_t* transport, int max_packet, int rx_buffer, int max_transfer, BOOLEAN use_zlp);
+
+// Stripe the transfers sent on the first bulk OUT pipe over all of them if the
+// device has several and announces DEV_FEATURE_STRIPE, else use the first one
+// only. Call once the pipes were selected at prepare hardware, while nothing
+// is in flight; resets the per-pipe statistics.
+void usb_stripe_init(WDFDEVICE Device);
+
+// Wait up to timeout_ms until fewer than max_in_flight URBs have transfers on
+// the wire, returns FALSE on timeout. Lets a sender keep the next frame back
+// until the link is free instead of queueing it in the USB stack.
+BOOLEAN usb_send_wait(usb_transport_t* transport, LONG max_in_flight, DWORD timeout_ms);
+
 // USB synchronous data send (for debugging)
 NTSTATUS usb_send_data_sync(urb_item_t* urb, WDFUSBPIPE pipe, int tsize);
 
 // USB enumeration information parsing
 NTSTATUS usb_get_discribe_info(WDFDEVICE Device, TCHAR* stringBuf);
 
-// USB hot-plug support
+// Find the bulk IN pipe and the bulk OUT pipes in endpoint order. Prepare
+// hardware only, nothing may be in flight on the pipes.
+NTSTATUS usb_select_interface(WDFDEVICE Device);
+
+// Binary capability handshake, fails if the device does not answer. Needs the
+// reader configured and stopped: prepare hardware, before D0 entry.
+NTSTATUS usb_query_dev_caps(WDFDEVICE Device, dev_caps_t* caps);
+
+// Continuous reader on the bulk IN pipe, dispatches DEV_MSG_* messages.
+// Configured at prepare hardware before the caps handshake, which reads its
+// reply through it, started and stopped with D0 entry/exit.
+NTSTATUS usb_reader_config(WDFDEVICE Device);
+NTSTATUS usb_reader_start(WDFDEVICE Device);
+void usb_reader_stop(WDFDEVICE Device);
+
+// Flow control: usb_flow_acquire takes a credit, waiting up to timeout_ms,
+// returns FALSE if none came. Credits of transfers that never reached the
+// device are given back with usb_flow_release. Disabled flow always succeeds.
+void usb_flow_init(usb_transport_t* transport, BOOLEAN enabled, int credits);
+BOOLEAN usb_flow_acquire(usb_transport_t* transport, DWORD timeout_ms);
+void usb_flow_release(usb_transport_t* transport);
+
+// Set the input sink, NULL = queue only, see usb_input_sink_t
+void usb_input_set_sink(usb_transport_t* transport, usb_input_sink_t sink, void* context);
+
+// USB hot-plug support, connect only checks the pipes selected at prepare hardware
 NTSTATUS usb_device_connect(WDFDEVICE Device);
 NTSTATUS usb_device_disconnect(WDFDEVICE Device);
 BOOLEAN usb_is_connected(WDFDEVICE Device);
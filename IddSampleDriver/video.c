@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+#include "video.h"
+
+int video_init(video_map_t* map, int tiles)
+{
+    if (map == NULL || tiles <= 0) {
+        return -1;
+    }
+
+    memset(map, 0, sizeof(video_map_t));
+    map->tiles = tiles;
+    map->history = (uint16_t*)calloc(tiles, sizeof(uint16_t));
+    map->seen_hash = (uint64_t*)calloc(tiles, sizeof(uint64_t));
+    map->video = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    map->select = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    if (map->history == NULL || map->seen_hash == NULL || map->video == NULL || map->select == NULL) {
+        video_exit(map);
+        return -2;
+    }
+    return 0;
+}
+
+void video_exit(video_map_t* map)
+{
+    if (map == NULL) return;
+
+    free(map->history);
+    free(map->seen_hash);
+    free(map->video);
+    free(map->select);
+    memset(map, 0, sizeof(video_map_t));
+}
+
+void video_reset(video_map_t* map)
+{
+    if (map == NULL || map->tiles == 0) return;
+
+    memset(map->history, 0, map->tiles * sizeof(uint16_t));
+    memset(map->video, 0, map->tiles);
+    memset(map->select, 0, map->tiles);
+    map->video_tiles = 0;
+    map->deferred = 0;
+}
+
+static int bit_count(uint16_t v)
+{
+    int count = 0;
+    while (v) {
+        v &= v - 1;
+        count++;
+    }
+    return count;
+}
+
+int video_split(video_map_t* map, damage_map_t* damage, int due)
+{
+    int count = 0;
+
+    if (map == NULL || map->tiles != damage->tiles_x * damage->tiles_y) {
+        return 0;
+    }
+
+    memset(map->select, 0, map->tiles);
+    map->video_tiles = 0;
+    map->deferred = 0;
+
+    for (int i = 0; i < map->tiles; i++) {
+        int changes;
+
+        map->history[i] = (uint16_t)((map->history[i] << 1) | (damage->hash[i] != map->seen_hash[i]));
+        map->seen_hash[i] = damage->hash[i];
+        changes = bit_count(map->history[i]);
+        if (changes >= VIDEO_ENTER_CHANGES) {
+            map->video[i] = 1;
+        } else if (changes < VIDEO_EXIT_CHANGES) {
+            map->video[i] = 0;
+        }
+        map->video_tiles += map->video[i];
+    }
+
+    // A few busy tiles (clock, spinner) are cheaper as normal rects
+    if (map->video_tiles < VIDEO_MIN_TILES) {
+        return 0;
+    }
+
+    for (int i = 0; i < map->tiles; i++) {
+        if (!map->video[i] || !damage->dirty[i]) continue;
+
+        damage->dirty[i] = 0;
+        damage->dirty_count--;
+        if (due) {
+            map->select[i] = 1;
+            count++;
+        } else {
+            // The device still shows the old content. Comparing against the
+            // previous hash misses damage that was merged or forced dirty,
+            // the tile goes out with the next frame whether it changes or not.
+            damage->pending[i] = 1;
+            map->deferred++;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include "damage.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A tile is video while it keeps changing in most of the recent frames
+#define VIDEO_HISTORY_FRAMES    16  // bits of per-tile change history
+#define VIDEO_ENTER_CHANGES     10  // changes in history to become video
+#define VIDEO_EXIT_CHANGES      4   // stays video until it falls below this
+#define VIDEO_MIN_TILES         4   // smaller regions are not treated as video
+#define VIDEO_MAX_RECTS         8
+
+#define VIDEO_JPEG_QUALITY      50
+#define VIDEO_MAX_FPS           30  // rate cap of video regions, 0 = none
+
+typedef struct _video_map {
+    int tiles;
+    uint16_t* history;      // change bit per frame, bit 0 = latest frame
+    uint64_t* seen_hash;    // tile hash of the last frame seen by the detector
+    uint8_t* video;         // 1 while the tile is classified as video
+    uint8_t* select;        // video tiles to send in this frame
+    int video_tiles;        // tiles classified as video
+    int deferred;           // video tiles held back by the rate cap this frame
+} video_map_t;
+
+int  video_init(video_map_t* map, int tiles);
+void video_exit(video_map_t* map);
+
+// Forget the change history, e.g. after a mode change
+void video_reset(video_map_t* map);
+
+// Update the history from damage->hash and move dirty video tiles out of
+// damage->dirty. If due, they are returned in map->select; otherwise they are
+// deferred: marked pending in damage, so they are dirty in the next frame.
+// Returns the number of selected tiles.
+int  video_split(video_map_t* map, damage_map_t* damage, int due);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,190 @@
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "work_pool.h"
+
+// Worker a thread belongs to, jobs it submits go to its own deque
+static thread_local const WorkPool* t_pool = nullptr;
+static thread_local int t_worker = -1;
+
+WorkPool::WorkPool(int threads, uint64_t affinity)
+    : m_affinity(affinity), m_next(0), m_queued(0), m_stop(false)
+{
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    if (threads > WORK_POOL_MAX_THREADS) {
+        threads = WORK_POOL_MAX_THREADS;
+    }
+
+    for (int i = 0; i < threads - 1; i++) {
+        m_workers.emplace_back(new Worker());
+    }
+    // Start the workers once the deques they steal from all exist
+    for (int i = 0; i < (int)m_workers.size(); i++) {
+        m_workers[i]->thread = std::thread(&WorkPool::worker_loop, this, i);
+        set_affinity(m_workers[i]->thread, i);
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_idle_lock);
+        m_stop = true;
+    }
+    m_idle.notify_all();
+    for (auto& worker : m_workers) {
+        worker->thread.join();
+    }
+}
+
+void WorkPool::set_affinity(std::thread& thread, int index)
+{
+    int cpus[64];
+    int count = 0;
+
+    for (int cpu = 0; cpu < 64; cpu++) {
+        if (m_affinity & (1ULL << cpu)) {
+            cpus[count++] = cpu;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    const int cpu = cpus[index % count];
+#ifdef _WIN32
+    SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+void WorkPool::submit(WorkGroup& group, std::function<void()> job)
+{
+    group.m_pending.fetch_add(1);
+
+    if (m_workers.empty()) {
+        Job inline_job = { std::move(job), &group };
+        execute(inline_job);
+        return;
+    }
+
+    const int index = (t_pool == this) ? t_worker : (int)(m_next.fetch_add(1) % m_workers.size());
+    {
+        std::lock_guard<std::mutex> guard(m_workers[index]->lock);
+        m_workers[index]->jobs.push_back({ std::move(job), &group });
+    }
+    m_queued.fetch_add(1);
+
+    // Taking the lock orders the push before a worker's check of m_queued
+    {
+        std::lock_guard<std::mutex> guard(m_idle_lock);
+    }
+    m_idle.notify_one();
+}
+
+// Own deque from the back, then the others from the front. index -1 = not a worker.
+bool WorkPool::take(int index, Job& job)
+{
+    const int count = (int)m_workers.size();
+
+    if (index >= 0) {
+        Worker* own = m_workers[index].get();
+        std::lock_guard<std::mutex> guard(own->lock);
+        if (!own->jobs.empty()) {
+            job = std::move(own->jobs.back());
+            own->jobs.pop_back();
+            m_queued.fetch_sub(1);
+            return true;
+        }
+    }
+
+    const int start = index >= 0 ? index : (int)(m_next.load() % count);
+    for (int i = 0; i < count; i++) {
+        const int victim = (start + i) % count;
+        if (victim == index) {
+            continue;
+        }
+        Worker* other = m_workers[victim].get();
+        std::lock_guard<std::mutex> guard(other->lock);
+        if (!other->jobs.empty()) {
+            job = std::move(other->jobs.front());
+            other->jobs.pop_front();
+            m_queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::execute(Job& job)
+{
+    job.fn();
+    if (job.group->m_pending.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> guard(m_idle_lock);
+        m_done.notify_all();
+    }
+}
+
+void WorkPool::worker_loop(int index)
+{
+    t_pool = this;
+    t_worker = index;
+
+    for (;;) {
+        Job job;
+        if (take(index, job)) {
+            execute(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(m_idle_lock);
+        m_idle.wait(guard, [this] { return m_stop || m_queued.load() > 0; });
+        if (m_stop) {
+            return;
+        }
+    }
+}
+
+void WorkPool::join(WorkGroup& group)
+{
+    const int index = (t_pool == this) ? t_worker : -1;
+
+    while (group.m_pending.load() > 0) {
+        Job job;
+        if (!m_workers.empty() && take(index, job)) {
+            execute(job);
+            continue;
+        }
+
+        // The remaining jobs run on workers, wake up when one of them finishes the group
+        std::unique_lock<std::mutex> guard(m_idle_lock);
+        m_done.wait_for(guard, std::chrono::milliseconds(1), [&group] { return group.m_pending.load() == 0; });
+    }
+}
+
+void WorkPool::run(int count, const std::function<void(int)>& job)
+{
+    WorkGroup group;
+
+    // The calling thread takes the first job itself instead of waiting
+    for (int i = 1; i < count; i++) {
+        submit(group, [&job, i] { job(i); });
+    }
+    if (count > 0) {
+        job(0);
+    }
+    join(group);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define WORK_POOL_MAX_THREADS   32
+
+// Jobs submitted together and joined together, e.g. the stripes of one frame
+class WorkGroup
+{
+public:
+    WorkGroup() : m_pending(0) {}
+
+private:
+    friend class WorkPool;
+    std::atomic<int> m_pending;
+};
+
+// Work-stealing thread pool for encode jobs (tiles, stripes, color conversion
+// chunks). Each worker has a deque: it runs its own jobs newest first and,
+// when it runs dry, steals the oldest job of another worker. A thread joining
+// a group runs jobs itself until the group is done, so a pool without workers
+// still works, just sequentially.
+class WorkPool
+{
+public:
+    // threads: threads working on a group including the joining one, so
+    // threads - 1 workers are started; 0 = one per CPU. affinity: bit mask of
+    // CPUs to spread the workers over, one CPU each in turn; 0 = no hint.
+    WorkPool(int threads, uint64_t affinity);
+    ~WorkPool();
+
+    int threads() const { return (int)m_workers.size() + 1; }
+
+    void submit(WorkGroup& group, std::function<void()> job);
+
+    // Run jobs until every job of group has finished
+    void join(WorkGroup& group);
+
+    // job(0) .. job(count - 1) on the workers and the calling thread
+    void run(int count, const std::function<void(int)>& job);
+
+private:
+    struct Job
+    {
+        std::function<void()> fn;
+        WorkGroup* group;
+    };
+
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Job> jobs;
+        std::thread thread;
+    };
+
+    void worker_loop(int index);
+    bool take(int index, Job& job);
+    void execute(Job& job);
+    void set_affinity(std::thread& thread, int index);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    uint64_t m_affinity;
+    std::atomic<unsigned> m_next;       // round robin target of outside submits
+    std::atomic<int> m_queued;          // jobs waiting in any deque
+    std::mutex m_idle_lock;
+    std::condition_variable m_idle;     // workers wait here for jobs
+    std::condition_variable m_done;     // joiners wait here for their group
+    bool m_stop;
+};
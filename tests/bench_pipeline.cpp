@@ -0,0 +1,174 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "test_util.h"
+#include "bounded_queue.h"
+#include "mailbox.h"
+
+// Capture -> encode -> send with the queues of SwapChainProcessor, fake stages
+// that take a fixed time per frame, against the same work done one frame at a
+// time on one thread. Frame slots travel capture -> encode -> capture through
+// BoundedQueues, encoded transfers reach the send stage through the Mailbox.
+#define FRAMES          120
+#define PIPE_FRAMES     3       // PIPELINE_FRAMES
+#define PIPE_QUEUE      4       // PIPELINE_QUEUE_SIZE
+#define TRANSFERS       4       // URB pool
+#define GRAB_US         2000
+#define ENCODE_US       6000
+#define SEND_US         5000
+
+struct SimFrame {
+    int slot;
+    int seq;
+};
+
+struct SimTransfer {
+    int id;
+    int seq;
+};
+
+struct Pipeline {
+    BoundedQueue<int, PIPE_QUEUE> free_frames;      // encode -> capture
+    BoundedQueue<SimFrame, PIPE_QUEUE> captured;    // capture -> encode
+    BoundedQueue<int, PIPE_QUEUE> free_transfers;   // send/encode -> encode
+    Mailbox<SimTransfer> outbox;                    // encode -> send, latest wins
+    SimTransfer transfers[TRANSFERS];
+    std::atomic<int> owner[PIPE_FRAMES];            // 0 free, 1 capture, 2 encode
+    std::atomic<bool> capture_done;
+    std::atomic<bool> encode_done;
+    int sent;
+    int stale;
+    int last_seq;
+};
+
+static void work(int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+static void idle()
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+static void capture_stage(Pipeline* p)
+{
+    for (int seq = 0; seq < FRAMES; seq++) {
+        int slot;
+
+        while (!p->free_frames.pop(slot)) {
+            idle();
+        }
+        CHECK(p->owner[slot].exchange(1) == 0);
+        work(GRAB_US);
+        p->owner[slot].store(2);
+        CHECK(p->captured.push(SimFrame{ slot, seq }));
+    }
+    p->capture_done = true;
+}
+
+static void encode_stage(Pipeline* p)
+{
+    SimFrame frame;
+
+    while (true) {
+        if (!p->captured.pop(frame)) {
+            if (p->capture_done && p->captured.size() == 0) break;
+            idle();
+            continue;
+        }
+        CHECK(p->owner[frame.slot].load() == 2);
+        int id;
+        while (!p->free_transfers.pop(id)) {
+            idle();
+        }
+        work(ENCODE_US);
+        p->owner[frame.slot].store(0);
+        CHECK(p->free_frames.push(frame.slot));
+
+        p->transfers[id].seq = frame.seq;
+        SimTransfer* replaced = p->outbox.post(&p->transfers[id]);
+        if (replaced != nullptr) {
+            p->stale++;
+            CHECK(p->free_transfers.push(replaced->id));
+        }
+    }
+    p->encode_done = true;
+}
+
+static void send_stage(Pipeline* p)
+{
+    while (true) {
+        SimTransfer* transfer = p->outbox.take();
+        if (transfer == nullptr) {
+            if (p->encode_done && p->outbox.empty()) break;
+            idle();
+            continue;
+        }
+        // Latest wins never reorders
+        CHECK(transfer->seq > p->last_seq);
+        p->last_seq = transfer->seq;
+        work(SEND_US);
+        p->sent++;
+        CHECK(p->free_transfers.push(transfer->id));
+    }
+}
+
+static double run_pipelined(int* sent, int* stale)
+{
+    Pipeline p;
+
+    for (int i = 0; i < PIPE_FRAMES; i++) {
+        p.owner[i] = 0;
+        p.free_frames.push(i);
+    }
+    for (int i = 0; i < TRANSFERS; i++) {
+        p.transfers[i].id = i;
+        p.free_transfers.push(i);
+    }
+    p.capture_done = false;
+    p.encode_done = false;
+    p.sent = 0;
+    p.stale = 0;
+    p.last_seq = -1;
+
+    const int64_t start = test_now_us();
+    std::thread send(send_stage, &p);
+    std::thread encode(encode_stage, &p);
+    capture_stage(&p);
+    encode.join();
+    send.join();
+    const int64_t elapsed = test_now_us() - start;
+
+    *sent = p.sent;
+    *stale = p.stale;
+    return p.sent * 1e6 / elapsed;
+}
+
+static double run_sequential()
+{
+    const int64_t start = test_now_us();
+
+    for (int seq = 0; seq < FRAMES; seq++) {
+        work(GRAB_US);
+        work(ENCODE_US);
+        work(SEND_US);
+    }
+    return FRAMES * 1e6 / (test_now_us() - start);
+}
+
+int main()
+{
+    int sent, stale;
+    const double sequential = run_sequential();
+    const double pipelined = run_pipelined(&sent, &stale);
+
+    printf("grab %d us, encode %d us, send %d us, %d frames\n", GRAB_US, ENCODE_US, SEND_US, FRAMES);
+    printf("sequential: %6.1f fps\n", sequential);
+    printf("pipelined:  %6.1f fps (%d sent, %d replaced in the mailbox) %.2fx\n", pipelined, sent, stale, pipelined / sequential);
+
+    CHECK_EQ(sent + stale, FRAMES);
+    // The frame time drops from the sum of the stages to the slowest one
+    CHECK(pipelined > sequential * 1.5);
+    return 0;
+}
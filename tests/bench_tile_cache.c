@@ -0,0 +1,191 @@
+#include <string.h>
+#include "test_util.h"
+#include "damage.h"
+#include "tile_cache.h"
+
+// Replays synthetic desktop sessions through damage detection and the tile
+// cache the way the encode stage does (match, then store what is left) and
+// reports how many dirty tiles the device could draw from its cache.
+#define FRAME_W         1920
+#define FRAME_H         1080
+#define PAGE_COUNT      4       // application windows switched between
+#define WINDOW_TX       8       // window position and size in tiles
+#define WINDOW_TY       4
+#define WINDOW_TILES_X  40
+#define WINDOW_TILES_Y  22
+#define SWITCH_FRAMES   15      // frames between two window switches
+#define SESSION_FRAMES  240
+
+typedef struct _replay_stats {
+    uint64_t dirty;         // full dirty tiles after damage detection
+    uint64_t draws;         // drawn from the device cache
+    uint64_t stores;        // sent and stored on the device
+    int64_t elapsed_us;     // match + store
+} replay_stats_t;
+
+static uint32_t mix(uint32_t v)
+{
+    v ^= v >> 16;
+    v *= 0x7feb352d;
+    v ^= v >> 15;
+    v *= 0x846ca68b;
+    v ^= v >> 16;
+    return v;
+}
+
+// Tile content of seed, 0 is the plain background
+static void fill_tile(uint8_t* fb, int tx, int ty, uint32_t seed)
+{
+    for (int y = 0; y < DAMAGE_TILE_SIZE; y++) {
+        const int py = ty * DAMAGE_TILE_SIZE + y;
+        uint32_t* line;
+
+        if (py >= FRAME_H) break;
+        line = (uint32_t*)(fb + (size_t)py * FRAME_W * 4) + tx * DAMAGE_TILE_SIZE;
+        for (int x = 0; x < DAMAGE_TILE_SIZE; x++) {
+            line[x] = seed == 0 ? 0xff202020 : mix(seed * 4099 + y * DAMAGE_TILE_SIZE + x);
+        }
+    }
+}
+
+// Window page: a third of the tiles is background, the rest is page content
+static uint32_t page_seed(int page, int tx, int ty)
+{
+    const uint32_t id = (uint32_t)(page * 65536 + ty * 256 + tx + 1);
+    return mix(id) % 3 == 0 ? 0 : id;
+}
+
+// Document tile row line
+static uint32_t doc_seed(int line, int tx)
+{
+    return (uint32_t)(0x1000000 + line * 256 + tx);
+}
+
+static void replay_frame(tile_cache_t* cache, damage_map_t* map, const uint8_t* fb,
+                         tile_cache_ref_t* refs, int max, replay_stats_t* stats)
+{
+    int64_t start;
+    int dirty_full = 0;
+
+    damage_update(map, fb, FRAME_W * 4);
+    for (int i = 0; i < map->tiles_x * map->tiles_y; i++) {
+        // The partial bottom row is never cached
+        dirty_full += map->dirty[i] && (i / map->tiles_x + 1) * DAMAGE_TILE_SIZE <= FRAME_H;
+    }
+
+    start = test_now_us();
+    stats->draws += tile_cache_match(cache, map, refs, max);
+    stats->stores += tile_cache_store(cache, map, refs, max);
+    stats->elapsed_us += test_now_us() - start;
+    stats->dirty += dirty_full;
+}
+
+// Cycle through PAGE_COUNT windows on a wallpaper, a clock in the corner
+// ticks every frame
+static void replay_switch(int slots, replay_stats_t* stats, uint8_t* fb, tile_cache_ref_t* refs, int max)
+{
+    tile_cache_t cache;
+    damage_map_t map;
+
+    CHECK(tile_cache_init(&cache, slots) == 0);
+    CHECK(damage_init(&map, FRAME_W, FRAME_H) == 0);
+    memset(stats, 0, sizeof(*stats));
+    for (int ty = 0; ty < map.tiles_y; ty++) {
+        for (int tx = 0; tx < map.tiles_x; tx++) {
+            fill_tile(fb, tx, ty, page_seed(PAGE_COUNT, tx, ty));
+        }
+    }
+
+    for (int frame = 0; frame < SESSION_FRAMES; frame++) {
+        if (frame % SWITCH_FRAMES == 0) {
+            const int page = frame / SWITCH_FRAMES % PAGE_COUNT;
+            for (int ty = WINDOW_TY; ty < WINDOW_TY + WINDOW_TILES_Y; ty++) {
+                for (int tx = WINDOW_TX; tx < WINDOW_TX + WINDOW_TILES_X; tx++) {
+                    fill_tile(fb, tx, ty, page_seed(page, tx, ty));
+                }
+            }
+        }
+        fill_tile(fb, map.tiles_x - 1, 0, 0x2000000 + frame);
+        replay_frame(&cache, &map, fb, refs, max, stats);
+    }
+
+    damage_exit(&map);
+    tile_cache_exit(&cache);
+}
+
+// Scroll a document down a tile row per frame and back up again. The
+// document is rendered once, each frame is a view into it.
+static void replay_scroll(int slots, replay_stats_t* stats, tile_cache_ref_t* refs, int max)
+{
+    tile_cache_t cache;
+    damage_map_t map;
+    const int steps = SESSION_FRAMES / 2;
+    const int doc_rows = (FRAME_H + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE + steps;
+    const size_t row_bytes = (size_t)DAMAGE_TILE_SIZE * FRAME_W * 4;
+    uint8_t* doc = (uint8_t*)malloc(row_bytes * doc_rows);
+
+    CHECK(doc != NULL);
+    CHECK(tile_cache_init(&cache, slots) == 0);
+    CHECK(damage_init(&map, FRAME_W, FRAME_H) == 0);
+    memset(stats, 0, sizeof(*stats));
+    for (int row = 0; row < doc_rows; row++) {
+        for (int tx = 0; tx < map.tiles_x; tx++) {
+            fill_tile(doc + row * row_bytes, tx, 0, doc_seed(row, tx));
+        }
+    }
+
+    for (int frame = 0; frame < SESSION_FRAMES; frame++) {
+        const int top = frame < steps ? frame : SESSION_FRAMES - 1 - frame;
+        replay_frame(&cache, &map, doc + top * row_bytes, refs, max, stats);
+    }
+
+    damage_exit(&map);
+    tile_cache_exit(&cache);
+    free(doc);
+}
+
+static double hit_rate(const replay_stats_t* stats)
+{
+    return stats->dirty ? (double)stats->draws / (double)stats->dirty : 0.0;
+}
+
+static void report(const char* name, int slots, const replay_stats_t* stats)
+{
+    printf("%-8s slots %4d: dirty %7llu draws %7llu stores %7llu hit rate %5.1f%% cache %.1f us/frame\n",
+           name, slots, (unsigned long long)stats->dirty, (unsigned long long)stats->draws,
+           (unsigned long long)stats->stores, 100.0 * hit_rate(stats),
+           (double)stats->elapsed_us / SESSION_FRAMES);
+}
+
+int main(void)
+{
+    static const int slot_counts[] = { 512, 1024, 4096 };
+    const int max = ((FRAME_W + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE) * ((FRAME_H + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE);
+    uint8_t* fb = (uint8_t*)calloc((size_t)FRAME_W * FRAME_H, 4);
+    tile_cache_ref_t* refs = (tile_cache_ref_t*)calloc(max, sizeof(tile_cache_ref_t));
+    replay_stats_t stats;
+
+    CHECK(fb != NULL && refs != NULL);
+
+    for (size_t i = 0; i < sizeof(slot_counts) / sizeof(slot_counts[0]); i++) {
+        replay_switch(slot_counts[i], &stats, fb, refs, max);
+        report("switch", slot_counts[i], &stats);
+        // All windows fit in the largest cache: only the first frame, the
+        // first visit of each window and the clock miss
+        if (slot_counts[i] == 4096) {
+            CHECK(hit_rate(&stats) > 0.6);
+        }
+    }
+    for (size_t i = 0; i < sizeof(slot_counts) / sizeof(slot_counts[0]); i++) {
+        replay_scroll(slot_counts[i], &stats, refs, max);
+        report("scroll", slot_counts[i], &stats);
+        // Scrolling back up only shows rows seen on the way down
+        if (slot_counts[i] == 4096) {
+            CHECK(hit_rate(&stats) > 0.9);
+        }
+    }
+
+    free(refs);
+    free(fb);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "test_util.h"
+#include "damage.h"
+#include "work_pool.h"
+
+// Scaling of WorkPool on 4K frames with the two job shapes the encoders use:
+// row chunks through run() (RGB565 conversion, as encode_rgb565 splits it)
+// and a group of tile row jobs through submit()/join() (tile hashing). Every
+// thread count has to produce the single threaded output; the timings are
+// printed, the speedup depends on the cores of the machine.
+#define FRAME_W     3840
+#define FRAME_H     2160
+#define FRAMES      8
+
+static void convert_rows(uint8_t* out, const uint8_t* in, int first, int last)
+{
+    for (int row = first; row < last; row++) {
+        const uint32_t* src = (const uint32_t*)(in + (size_t)row * FRAME_W * 4);
+        uint8_t* dst = out + (size_t)row * FRAME_W * 2;
+        for (int col = 0; col < FRAME_W; col++) {
+            const uint32_t pixel = src[col];
+            const uint16_t rgb565 = (uint16_t)((((pixel >> 16) & 0xF8) << 8) | (((pixel >> 8) & 0xFC) << 3) | ((pixel & 0xFF) >> 3));
+            *dst++ = rgb565 & 0xFF;
+            *dst++ = rgb565 >> 8;
+        }
+    }
+}
+
+static void hash_tile_row(uint64_t* hashes, const uint8_t* in, int ty, int tiles_x)
+{
+    for (int tx = 0; tx < tiles_x; tx++) {
+        int h = FRAME_H - ty * DAMAGE_TILE_SIZE;
+        if (h > DAMAGE_TILE_SIZE) h = DAMAGE_TILE_SIZE;
+        hashes[ty * tiles_x + tx] = damage_hash_block(in, FRAME_W * 4, tx * DAMAGE_TILE_SIZE, ty * DAMAGE_TILE_SIZE, DAMAGE_TILE_SIZE, h);
+    }
+}
+
+int main()
+{
+    const int tiles_x = FRAME_W / DAMAGE_TILE_SIZE;
+    const int tiles_y = (FRAME_H + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    const int cores = (int)std::thread::hardware_concurrency();
+    std::vector<uint8_t> frame((size_t)FRAME_W * FRAME_H * 4);
+    std::vector<uint8_t> expect_rgb((size_t)FRAME_W * FRAME_H * 2), rgb(expect_rgb.size());
+    std::vector<uint64_t> expect_hash(tiles_x * tiles_y), hash(expect_hash.size());
+    double base_convert = 0, base_hash = 0;
+
+    uint32_t seed = 1;
+    for (size_t i = 0; i < frame.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        frame[i] = (uint8_t)(seed >> 16);
+    }
+    convert_rows(expect_rgb.data(), frame.data(), 0, FRAME_H);
+    for (int ty = 0; ty < tiles_y; ty++) {
+        hash_tile_row(expect_hash.data(), frame.data(), ty, tiles_x);
+    }
+
+    printf("%dx%d, %d frames, %d cores\n", FRAME_W, FRAME_H, FRAMES, cores);
+    printf("threads  convert ms/frame  speedup  hash ms/frame  speedup\n");
+    for (int threads : { 1, 2, 4, 8, 12, 16 }) {
+        WorkPool pool(threads, 0);
+        const int jobs = pool.threads();
+        int64_t convert_us = 0, hash_us = 0;
+
+        CHECK_EQ(pool.threads(), threads);
+        for (int f = 0; f < FRAMES; f++) {
+            memset(rgb.data(), 0, rgb.size());
+            memset(hash.data(), 0, hash.size() * sizeof(uint64_t));
+
+            int64_t start = test_now_us();
+            pool.run(jobs, [&](int job) { convert_rows(rgb.data(), frame.data(), FRAME_H * job / jobs, FRAME_H * (job + 1) / jobs); });
+            convert_us += test_now_us() - start;
+
+            start = test_now_us();
+            WorkGroup group;
+            for (int ty = 0; ty < tiles_y; ty++) {
+                pool.submit(group, [&, ty] { hash_tile_row(hash.data(), frame.data(), ty, tiles_x); });
+            }
+            pool.join(group);
+            hash_us += test_now_us() - start;
+
+            CHECK(memcmp(rgb.data(), expect_rgb.data(), rgb.size()) == 0);
+            CHECK(memcmp(hash.data(), expect_hash.data(), hash.size() * sizeof(uint64_t)) == 0);
+        }
+
+        const double convert_ms = convert_us / 1000.0 / FRAMES;
+        const double hash_ms = hash_us / 1000.0 / FRAMES;
+        if (threads == 1) {
+            base_convert = convert_ms;
+            base_hash = hash_ms;
+        }
+        printf("%7d  %16.2f  %6.2fx  %13.2f  %6.2fx\n", threads, convert_ms, base_convert / convert_ms, hash_ms, base_hash / hash_ms);
+    }
+    return 0;
+}
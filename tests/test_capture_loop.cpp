@@ -0,0 +1,355 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "test_util.h"
+#include "capture_loop.h"
+#include "frame_slots.h"
+
+// Fake swap-chain and pipeline for CaptureLoop: the swap-chain plays a script
+// of acquire results, both sides log their calls into one trace. The surface
+// must go back right after the copy is submitted, never held while reading,
+// handing on or pacing.
+
+struct Trace {
+    std::string calls;
+    bool held = false;      // surface acquired and not released
+
+    void add(const char* call)
+    {
+        if (!calls.empty()) calls += ' ';
+        calls += call;
+    }
+};
+
+class FakeSwapChain : public SwapChainSource
+{
+public:
+    FakeSwapChain(Trace& trace, std::vector<int> script) : m_trace(trace), m_script(script) {}
+
+    bool copy_ok = true;
+    bool read_ok = true;
+    bool release_ok = true;
+    int waits_left = 100;
+
+    int acquire() override
+    {
+        CHECK(!m_trace.held);
+        const int status = m_next < m_script.size() ? m_script[m_next++] : SWAPCHAIN_LOST;
+        m_trace.add(status == SWAPCHAIN_FRAME ? "acquire" : status == SWAPCHAIN_PENDING ? "pending" : "lost");
+        m_trace.held = status == SWAPCHAIN_FRAME;
+        return status;
+    }
+
+    bool wait(int timeout_ms) override
+    {
+        CHECK_EQ(timeout_ms, CAPTURE_WAIT_MS);
+        m_trace.add("wait");
+        return waits_left-- > 0;
+    }
+
+    bool copy(int* width, int* height) override
+    {
+        CHECK(m_trace.held);
+        m_trace.add("copy");
+        *width = 64;
+        *height = 32;
+        return copy_ok;
+    }
+
+    bool release() override
+    {
+        CHECK(m_trace.held);
+        m_trace.add("release");
+        m_trace.held = false;
+        return release_ok;
+    }
+
+    bool read(uint8_t* dst) override
+    {
+        CHECK(!m_trace.held);
+        CHECK(dst != nullptr);
+        m_trace.add("read");
+        return read_ok;
+    }
+
+private:
+    Trace& m_trace;
+    std::vector<int> m_script;
+    size_t m_next = 0;
+};
+
+class FakeTarget : public CaptureTarget
+{
+public:
+    explicit FakeTarget(Trace& trace) : m_trace(trace) {}
+
+    bool drop = false;          // begin_frame has no buffer
+    int paces_left = 100;
+    int committed = 0;
+
+    bool pace() override
+    {
+        CHECK(!m_trace.held);
+        m_trace.add("pace");
+        return paces_left-- > 0;
+    }
+
+    uint8_t* begin_frame() override
+    {
+        m_trace.add("begin");
+        return drop ? nullptr : m_buffer;
+    }
+
+    void commit_frame(int width, int height) override
+    {
+        CHECK(!m_trace.held);
+        CHECK_EQ(width, 64);
+        CHECK_EQ(height, 32);
+        m_trace.add("commit");
+        committed++;
+    }
+
+    void abort_frame() override
+    {
+        m_trace.add("abort");
+    }
+
+private:
+    Trace& m_trace;
+    uint8_t m_buffer[64 * 32 * 4];
+};
+
+static void check_trace(const Trace& trace, const char* expect)
+{
+    if (trace.calls != expect) {
+        fprintf(stderr, "trace: %s\nexpect: %s\n", trace.calls.c_str(), expect);
+        exit(1);
+    }
+    CHECK(!trace.held);
+}
+
+static void test_frames()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_FRAME, SWAPCHAIN_FRAME, SWAPCHAIN_LOST });
+    FakeTarget target(trace);
+
+    CaptureLoop(source, target).run();
+    check_trace(trace, "acquire begin copy release read commit pace "
+                       "acquire begin copy release read commit pace lost");
+    CHECK_EQ(target.committed, 2);
+}
+
+static void test_pending()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_PENDING, SWAPCHAIN_PENDING, SWAPCHAIN_FRAME, SWAPCHAIN_PENDING });
+    FakeTarget target(trace);
+
+    // No frame, no pacing: waiting for the next one is the pace
+    source.waits_left = 2;
+    CaptureLoop(source, target).run();
+    check_trace(trace, "pending wait pending wait acquire begin copy release read commit pace pending wait");
+}
+
+static void test_dropped()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_FRAME, SWAPCHAIN_LOST });
+    FakeTarget target(trace);
+
+    // No free slot: the surface still goes back at once, nothing is copied
+    target.drop = true;
+    CaptureLoop(source, target).run();
+    check_trace(trace, "acquire begin release pace lost");
+    CHECK_EQ(target.committed, 0);
+}
+
+static void test_copy_failed()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_FRAME, SWAPCHAIN_LOST });
+    FakeTarget target(trace);
+
+    source.copy_ok = false;
+    CaptureLoop(source, target).run();
+    check_trace(trace, "acquire begin copy release abort pace lost");
+}
+
+static void test_read_failed()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_FRAME, SWAPCHAIN_LOST });
+    FakeTarget target(trace);
+
+    source.read_ok = false;
+    CaptureLoop(source, target).run();
+    check_trace(trace, "acquire begin copy release read abort pace lost");
+}
+
+static void test_release_failed()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_FRAME, SWAPCHAIN_FRAME });
+    FakeTarget target(trace);
+
+    // The copy was made before the swap-chain went away, it still goes out
+    source.release_ok = false;
+    CaptureLoop(source, target).run();
+    check_trace(trace, "acquire begin copy release read commit");
+}
+
+static void test_pace_stops()
+{
+    Trace trace;
+    FakeSwapChain source(trace, { SWAPCHAIN_FRAME, SWAPCHAIN_FRAME });
+    FakeTarget target(trace);
+
+    target.paces_left = 0;
+    CaptureLoop(source, target).run();
+    check_trace(trace, "acquire begin copy release read commit pace");
+}
+
+// Capture side of the driver pipeline: frame slots come from FrameSlots, the
+// encode stage runs on its own thread and gives them back
+class SlotTarget : public CaptureTarget
+{
+public:
+    static const int FRAMES = 3;    // PIPELINE_FRAMES
+
+    SlotTarget() : m_slot(-1), m_stop(false)
+    {
+        for (int i = 0; i < FRAMES; i++) {
+            CHECK(m_slots.put(i));
+        }
+        m_encode = std::thread([this] { encode_loop(); });
+    }
+
+    int committed = 0;
+    int aborted = 0;
+    int dropped = 0;
+
+    bool pace() override
+    {
+        return true;
+    }
+
+    uint8_t* begin_frame() override
+    {
+        if (!m_slots.take(m_slot)) {
+            dropped++;
+            return nullptr;
+        }
+        return m_buffer;
+    }
+
+    void commit_frame(int, int) override
+    {
+        while (!m_captured.push(m_slot)) {
+            std::this_thread::yield();
+        }
+        committed++;
+    }
+
+    void abort_frame() override
+    {
+        m_slots.give_back(m_slot);
+        aborted++;
+    }
+
+    // Stop the encode stage, then every slot has to be back
+    void check_slots()
+    {
+        bool seen[FRAMES] = {};
+        int slot;
+
+        m_stop = true;
+        m_encode.join();
+        while (m_captured.pop(slot)) {
+            CHECK(m_slots.put(slot));
+        }
+        CHECK_EQ(m_slots.available(), FRAMES);
+        while (m_slots.take(slot)) {
+            CHECK(slot >= 0 && slot < FRAMES && !seen[slot]);
+            seen[slot] = true;
+        }
+    }
+
+private:
+    void encode_loop()
+    {
+        int slot;
+
+        while (!m_stop) {
+            if (m_captured.pop(slot)) {
+                CHECK(m_slots.put(slot));
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    FrameSlots<4> m_slots;                  // PIPELINE_QUEUE_SIZE
+    BoundedQueue<int, 4> m_captured;
+    int m_slot;
+    std::atomic<bool> m_stop;
+    std::thread m_encode;
+    uint8_t m_buffer[64 * 32 * 4];
+};
+
+// Copies and reads failing over and over while the encode stage returns
+// slots concurrently: no slot is lost or handed out twice
+static void test_failures_keep_slots()
+{
+    const int frames = 20000;
+    Trace trace;
+    std::vector<int> script(frames, SWAPCHAIN_FRAME);
+    FakeSwapChain source(trace, script);
+    SlotTarget target;
+
+    source.copy_ok = false;
+    source.read_ok = false;
+    CaptureLoop(source, target).run();
+    CHECK_EQ(target.aborted + target.dropped, frames);
+
+    // Then a mix of good and failed frames
+    Trace mixed_trace;
+    class FlakySwapChain : public FakeSwapChain
+    {
+    public:
+        using FakeSwapChain::FakeSwapChain;
+        int n = 0;
+
+        bool copy(int* width, int* height) override
+        {
+            FakeSwapChain::copy(width, height);
+            return ++n % 3 != 0;
+        }
+        bool read(uint8_t* dst) override
+        {
+            FakeSwapChain::read(dst);
+            return n % 5 != 0;
+        }
+    };
+    FlakySwapChain flaky(mixed_trace, script);
+    CaptureLoop(flaky, target).run();
+    CHECK(target.committed > 0);
+    CHECK_EQ(target.committed + target.aborted + target.dropped, 2 * frames);
+
+    target.check_slots();
+}
+
+int main()
+{
+    test_frames();
+    test_pending();
+    test_dropped();
+    test_copy_failed();
+    test_read_failed();
+    test_release_failed();
+    test_pace_stops();
+    test_failures_keep_slots();
+    printf("capture_loop: ok\n");
+    return 0;
+}
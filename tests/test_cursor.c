@@ -0,0 +1,107 @@
+#include <stddef.h>
+#include <string.h>
+#include "test_util.h"
+#include "cursor.h"
+
+// The cursor packets themselves are written by ImageEncoder, which needs the
+// WDK and libjpeg; this covers the device cache mirror and the shape identity.
+
+static void test_cache_hit_miss(void)
+{
+    cursor_cache_t cache;
+    int slot, again;
+
+    cursor_cache_reset(&cache);
+    CHECK_EQ(cursor_cache_lookup(&cache, 0x1234, &slot), 0);
+    CHECK(slot >= 0 && slot < CURSOR_CACHE_SLOTS);
+    CHECK_EQ(cursor_cache_lookup(&cache, 0x1234, &again), 1);
+    CHECK_EQ(again, slot);
+    CHECK_EQ(cache.hits, 1);
+    CHECK_EQ(cache.misses, 1);
+
+    // A reset device holds nothing, the shape is sent again
+    cursor_cache_reset(&cache);
+    CHECK_EQ(cursor_cache_lookup(&cache, 0x1234, &slot), 0);
+}
+
+static void test_cache_lru(void)
+{
+    cursor_cache_t cache;
+    int slots[CURSOR_CACHE_SLOTS + 1];
+    int slot;
+
+    cursor_cache_reset(&cache);
+    for (int i = 0; i < CURSOR_CACHE_SLOTS; i++) {
+        CHECK_EQ(cursor_cache_lookup(&cache, 100 + i, &slots[i]), 0);
+        for (int j = 0; j < i; j++) {
+            CHECK(slots[j] != slots[i]);
+        }
+    }
+
+    // Shape 100 is used again, 101 becomes the oldest and gives its slot up
+    CHECK_EQ(cursor_cache_lookup(&cache, 100, &slot), 1);
+    CHECK_EQ(cursor_cache_lookup(&cache, 200, &slots[CURSOR_CACHE_SLOTS]), 0);
+    CHECK_EQ(slots[CURSOR_CACHE_SLOTS], slots[1]);
+    CHECK_EQ(cursor_cache_lookup(&cache, 100, &slot), 1);
+    CHECK_EQ(slot, slots[0]);
+    CHECK_EQ(cursor_cache_lookup(&cache, 101, &slot), 0);
+
+    // Cycling through the usual arrow / I-beam / hand shapes never misses
+    cursor_cache_reset(&cache);
+    for (int round = 0; round < 100; round++) {
+        for (int shape = 0; shape < 3; shape++) {
+            cursor_cache_lookup(&cache, 1000 + shape, &slot);
+        }
+    }
+    CHECK_EQ(cache.misses, 3);
+    CHECK_EQ(cache.hits, 297);
+}
+
+static void test_shape_hash(void)
+{
+    uint8_t pixels[CURSOR_MAX_SIZE * CURSOR_MAX_SIZE * 4];
+    uint8_t padded[CURSOR_MAX_SIZE * (CURSOR_MAX_SIZE + 8) * 4];
+    const int w = 32, h = 32, pitch = w * 4, padded_pitch = (w + 8) * 4;
+    uint64_t base;
+
+    for (int i = 0; i < (int)sizeof(pixels); i++) {
+        pixels[i] = (uint8_t)(i * 13 + 5);
+    }
+    memset(padded, 0xcc, sizeof(padded));
+    for (int y = 0; y < h; y++) {
+        memcpy(padded + y * padded_pitch, pixels + y * pitch, pitch);
+    }
+
+    base = cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 2, w, h, pitch, pixels);
+    CHECK(base == cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 2, w, h, pitch, pixels));
+
+    // Row padding is not part of the shape
+    CHECK(base == cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 2, w, h, padded_pitch, padded));
+
+    // Type, hotspot, size and every pixel are
+    CHECK(base != cursor_shape_hash(CURSOR_SHAPE_MASKED, 1, 2, w, h, pitch, pixels));
+    CHECK(base != cursor_shape_hash(CURSOR_SHAPE_ALPHA, 2, 2, w, h, pitch, pixels));
+    CHECK(base != cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 3, w, h, pitch, pixels));
+    CHECK(base != cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 2, w, h - 1, pitch, pixels));
+    CHECK(base != cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 2, w - 1, h, pitch, pixels));
+    pixels[pitch * (h - 1) + pitch - 1] ^= 1;
+    CHECK(base != cursor_shape_hash(CURSOR_SHAPE_ALPHA, 1, 2, w, h, pitch, pixels));
+}
+
+static void test_wire_layout(void)
+{
+    // Both payloads are part of the device protocol
+    CHECK_EQ(sizeof(cursor_shape_t), 8);
+    CHECK_EQ(sizeof(cursor_pos_t), 8);
+    CHECK_EQ(offsetof(cursor_pos_t, slot), 4);
+}
+
+int main(void)
+{
+    test_cache_hit_miss();
+    test_cache_lru();
+    test_shape_hash();
+    test_wire_layout();
+    printf("cursor: ok\n");
+    return 0;
+}
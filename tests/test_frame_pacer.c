@@ -0,0 +1,208 @@
+#include <string.h>
+#include "test_util.h"
+#include "frame_pacer.h"
+
+// Mock clock: time only moves when the pacer reads it (a spin step) or sleeps
+// (the request rounded up to the timer granularity plus a fixed overshoot),
+// and when the test spends time on a frame.
+typedef struct _mock_clock {
+    int64_t now;
+    int64_t read_step_us;       // each now_us call costs this much
+    int64_t granularity_us;     // sleeps end on a multiple of this, 0 = exact
+    int64_t overshoot_us;       // added to every sleep
+    int sleeps;
+    int reads;
+} mock_clock_t;
+
+static int64_t mock_now(void* context)
+{
+    mock_clock_t* clock = (mock_clock_t*)context;
+
+    clock->reads++;
+    clock->now += clock->read_step_us;
+    return clock->now;
+}
+
+static void mock_sleep(void* context, int64_t us)
+{
+    mock_clock_t* clock = (mock_clock_t*)context;
+    int64_t end = clock->now + us;
+
+    clock->sleeps++;
+    if (clock->granularity_us > 0) {
+        end = (end + clock->granularity_us - 1) / clock->granularity_us * clock->granularity_us;
+    }
+    clock->now = end + clock->overshoot_us;
+}
+
+static void pacer_setup(frame_pacer_t* pacer, mock_clock_t* mock, int fps)
+{
+    pacer_clock_t clock = { mock_now, mock_sleep, mock };
+
+    frame_pacer_init(pacer, &clock, fps);
+}
+
+static void test_steady(void)
+{
+    mock_clock_t mock = { 1000000, 5, 0, 0, 0, 0 };
+    frame_pacer_t pacer;
+    int64_t start;
+    int missed;
+
+    pacer_setup(&pacer, &mock, 60);
+    CHECK_EQ(frame_pacer_wait(&pacer, 0, &missed), 0);
+    start = pacer.slot_us;
+
+    for (int n = 1; n <= 120; n++) {
+        mock.now += 4000;   // the frame
+        const int64_t late = frame_pacer_wait(&pacer, 0, &missed);
+        CHECK_EQ(missed, 0);
+        // Deadlines are absolute, nothing drifts
+        CHECK_EQ(pacer.slot_us, start + n * pacer.period_us);
+        CHECK(late >= 0 && late <= mock.read_step_us);
+        CHECK(mock.now >= pacer.slot_us);
+    }
+    CHECK_EQ(pacer.ticks, 120);
+    CHECK_EQ(pacer.missed, 0);
+    // The wait sleeps instead of spinning through the whole period
+    CHECK(mock.reads < 120 * (PACER_SPIN_US / mock.read_step_us + 8));
+}
+
+// A sleep that always overshoots: the pacer learns it and wakes up earlier
+static void test_overshoot(void)
+{
+    mock_clock_t mock = { 0, 5, 0, 2500, 0, 0 };
+    frame_pacer_t pacer;
+    int missed;
+
+    pacer_setup(&pacer, &mock, 60);
+    frame_pacer_wait(&pacer, 0, &missed);
+    for (int n = 1; n <= 60; n++) {
+        mock.now += 3000;
+        const int64_t late = frame_pacer_wait(&pacer, 0, &missed);
+        CHECK_EQ(missed, 0);
+        // Once the estimate settled the deadline is met by spinning
+        if (n > 30) {
+            CHECK(late <= mock.read_step_us);
+        }
+    }
+    CHECK(pacer.overshoot_us > 2000 && pacer.overshoot_us <= 2500);
+    CHECK(pacer.max_jitter_us < pacer.period_us);
+}
+
+// Sleeps on a coarse timer (15.6 ms tick) still hit 60 fps deadlines by spinning
+static void test_coarse_timer(void)
+{
+    mock_clock_t mock = { 0, 5, 15625, 0, 0, 0 };
+    frame_pacer_t pacer;
+    int64_t start;
+    int missed, total_missed = 0;
+
+    pacer_setup(&pacer, &mock, 60);
+    frame_pacer_wait(&pacer, 0, &missed);
+    start = pacer.slot_us;
+    for (int n = 1; n <= 60; n++) {
+        mock.now += 1000;
+        frame_pacer_wait(&pacer, 0, &missed);
+        total_missed += missed;
+        CHECK_EQ((pacer.slot_us - start) % pacer.period_us, 0);
+    }
+    CHECK_EQ(total_missed, 0);
+}
+
+// A frame that takes several periods skips the deadlines it missed, the phase stays
+static void test_missed(void)
+{
+    mock_clock_t mock = { 0, 5, 0, 0, 0, 0 };
+    frame_pacer_t pacer;
+    int64_t start, late;
+    int missed;
+
+    pacer_setup(&pacer, &mock, 50);
+    frame_pacer_wait(&pacer, 0, &missed);
+    start = pacer.slot_us;
+    mock.now += 1000;
+    frame_pacer_wait(&pacer, 0, &missed);
+    CHECK_EQ(pacer.slot_us, start + 20000);
+
+    // Deadlines 2 and 3 pass during the frame, the wait releases deadline 4 late
+    mock.now += 3 * 20000 + 5000;
+    late = frame_pacer_wait(&pacer, 0, &missed);
+    CHECK_EQ(missed, 2);
+    CHECK_EQ(pacer.missed, 2);
+    CHECK_EQ(pacer.slot_us, start + 4 * 20000);
+    CHECK(late >= 5000 && late < 20000);
+
+    mock.now += 1000;
+    late = frame_pacer_wait(&pacer, 0, &missed);
+    CHECK(late <= mock.read_step_us);
+    CHECK_EQ(missed, 0);
+    CHECK_EQ(pacer.slot_us, start + 5 * 20000);
+}
+
+// The wait returns lead_us before the deadline, slot_us is the deadline
+static void test_lead(void)
+{
+    mock_clock_t mock = { 0, 5, 0, 0, 0, 0 };
+    frame_pacer_t pacer;
+    int missed;
+
+    pacer_setup(&pacer, &mock, 100);
+    frame_pacer_wait(&pacer, 3000, &missed);
+    CHECK_EQ(pacer.slot_us, mock.now + 3000);
+    for (int n = 0; n < 10; n++) {
+        frame_pacer_wait(&pacer, 3000, &missed);
+        CHECK(pacer.slot_us - mock.now >= 3000 - mock.read_step_us);
+        CHECK(pacer.slot_us - mock.now <= 3000);
+    }
+}
+
+static void test_rate_change(void)
+{
+    mock_clock_t mock = { 0, 5, 0, 0, 0, 0 };
+    frame_pacer_t pacer;
+    int64_t last;
+    int missed;
+
+    pacer_setup(&pacer, &mock, 60);
+    frame_pacer_wait(&pacer, 0, &missed);
+    frame_pacer_wait(&pacer, 0, &missed);
+    last = pacer.slot_us;
+
+    // Next deadline is one new period after the last one
+    frame_pacer_set_fps(&pacer, 30);
+    frame_pacer_wait(&pacer, 0, &missed);
+    CHECK_EQ(pacer.slot_us, last + 1000000 / 30);
+
+    // fps 0 stops pacing: no sleep, no spin
+    frame_pacer_set_fps(&pacer, 0);
+    mock.sleeps = 0;
+    mock.reads = 0;
+    CHECK_EQ(frame_pacer_wait(&pacer, 0, &missed), 0);
+    CHECK_EQ(mock.sleeps, 0);
+    CHECK_EQ(mock.reads, 0);
+
+    // Pacing again starts a new schedule
+    frame_pacer_set_fps(&pacer, 60);
+    CHECK_EQ(frame_pacer_wait(&pacer, 0, &missed), 0);
+    CHECK_EQ(pacer.slot_us, mock.now);
+
+    // So does a reset after a pause
+    mock.now += 10 * 1000000;
+    frame_pacer_reset(&pacer);
+    CHECK_EQ(frame_pacer_wait(&pacer, 0, &missed), 0);
+    CHECK_EQ(missed, 0);
+    CHECK_EQ(pacer.slot_us, mock.now);
+}
+
+int main(void)
+{
+    test_steady();
+    test_overshoot();
+    test_coarse_timer();
+    test_missed();
+    test_lead();
+    test_rate_change();
+    printf("frame_pacer: ok\n");
+    return 0;
+}
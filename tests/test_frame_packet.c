@@ -0,0 +1,216 @@
+#include <string.h>
+#include "test_util.h"
+#include "frame_packet.h"
+
+#define BUF_SIZE    4096
+
+static const uint8_t payload_a[5] = { 1, 2, 3, 4, 5 };
+static uint8_t payload_b[64];
+
+static const frame_rect_info_t input_rects[] = {
+    { 3, 0, 0, 0, 16, 16, 0, NULL },                                // empty payload
+    { 1, sizeof(payload_a), 32, 64, 8, 4, 0, payload_a },
+    { 7, sizeof(payload_b), 100, 200, 300, 400, 1, payload_b },
+};
+#define INPUT_RECTS ((int)(sizeof(input_rects) / sizeof(input_rects[0])))
+
+static int build_v2(uint8_t* buf)
+{
+    int pos = 0;
+
+    for (int i = 0; i < INPUT_RECTS; i++) {
+        CHECK_EQ(frame_packet_add_rect(buf, BUF_SIZE, &pos, &input_rects[i]), 0);
+        CHECK_EQ(pos % FRAME_PACKET_ALIGN, 0);
+    }
+    return frame_packet_finish(buf, pos - (int)sizeof(frame_v2_header_t), 42, FRAME_FLAG_COMPLETE, 1920, 1080, 123456789);
+}
+
+static void check_rect(const frame_rect_info_t* got, const frame_rect_info_t* want, int region)
+{
+    CHECK_EQ(got->type, want->type);
+    CHECK_EQ(got->len, want->len);
+    CHECK_EQ(got->x, want->x);
+    CHECK_EQ(got->y, want->y);
+    CHECK_EQ(got->w, want->w);
+    CHECK_EQ(got->h, want->h);
+    CHECK_EQ(got->region, region);
+    CHECK(want->len == 0 || memcmp(got->data, want->data, want->len) == 0);
+}
+
+static void test_v2_round_trip(void)
+{
+    uint8_t buf[BUF_SIZE];
+    frame_rect_info_t rects[INPUT_RECTS];
+    frame_info_t info;
+    int size = build_v2(buf);
+    int expect = (int)sizeof(frame_v2_header_t);
+
+    for (int i = 0; i < INPUT_RECTS; i++) {
+        expect += frame_packet_entry_size(input_rects[i].len);
+    }
+    CHECK_EQ(size, expect);
+
+    CHECK_EQ(frame_packet_parse(buf, size, &info, rects, INPUT_RECTS), 0);
+    CHECK_EQ(info.version, FRAME_PACKET_VERSION);
+    CHECK_EQ(info.seq, 42);
+    CHECK_EQ(info.flags, FRAME_FLAG_COMPLETE);
+    CHECK_EQ(info.width, 1920);
+    CHECK_EQ(info.height, 1080);
+    CHECK_EQ(info.capture_us, 123456789);
+    CHECK_EQ(info.rect_count, INPUT_RECTS);
+    CHECK_EQ(info.size, size);
+    for (int i = 0; i < INPUT_RECTS; i++) {
+        check_rect(&rects[i], &input_rects[i], input_rects[i].region);
+    }
+
+    // A short rects array still reports every rect of the transfer
+    CHECK_EQ(frame_packet_parse(buf, size, &info, rects, 1), 0);
+    CHECK_EQ(info.rect_count, INPUT_RECTS);
+    check_rect(&rects[0], &input_rects[0], 0);
+
+    // Trailing bytes of the next transfer are not consumed
+    CHECK_EQ(frame_packet_parse(buf, size + 64, &info, rects, INPUT_RECTS), 0);
+    CHECK_EQ(info.size, size);
+}
+
+static void test_v2_serializer_limits(void)
+{
+    uint8_t buf[BUF_SIZE];
+    frame_v2_rect_t* entry;
+    int pos = 0;
+
+    // Entry does not fit the buffer
+    CHECK_EQ(frame_packet_add_rect(buf, (int)sizeof(frame_v2_header_t) + 64, &pos, &input_rects[2]), -1);
+    CHECK_EQ(pos, (int)sizeof(frame_v2_header_t));
+
+    // An entry length past the body is caught before sending
+    CHECK_EQ(frame_packet_add_rect(buf, BUF_SIZE, &pos, &input_rects[1]), 0);
+    entry = (frame_v2_rect_t*)(buf + sizeof(frame_v2_header_t));
+    entry->img_len = 100;
+    CHECK(frame_packet_finish(buf, pos - (int)sizeof(frame_v2_header_t), 1, 0, 0, 0, 0) < 0);
+
+    // Empty body: a frame with no rects
+    CHECK_EQ(frame_packet_finish(buf, 0, 1, FRAME_FLAG_COMPLETE, 64, 64, 0), (int)sizeof(frame_v2_header_t));
+}
+
+static int build_v1(uint8_t* buf)
+{
+    int pos = 0;
+
+    memset(buf, 0, BUF_SIZE);
+    for (int i = 1; i < INPUT_RECTS; i++) {
+        frame_v1_header_t* header = (frame_v1_header_t*)(buf + pos);
+
+        header->magic_id = FRAME_PACKET_MAGIC_V1;
+        header->img_type = input_rects[i].type;
+        header->img_len = input_rects[i].len;
+        header->img_cnt = 7;
+        header->img_x = input_rects[i].x;
+        header->img_y = input_rects[i].y;
+        header->img_w = input_rects[i].w;
+        header->img_h = input_rects[i].h;
+        memcpy(header + 1, input_rects[i].data, input_rects[i].len);
+        pos += (int)((sizeof(frame_v1_header_t) + input_rects[i].len + FRAME_PACKET_ALIGN - 1) & ~(FRAME_PACKET_ALIGN - 1));
+    }
+    ((frame_v1_header_t*)(buf + pos))->magic_id = FRAME_PACKET_MAGIC_V1;
+    ((frame_v1_header_t*)(buf + pos))->img_type = FRAME_PACKET_TYPE_NULL;
+    return pos + (int)sizeof(frame_v1_header_t);
+}
+
+static void test_v1_parse(void)
+{
+    uint8_t buf[BUF_SIZE];
+    frame_rect_info_t rects[INPUT_RECTS];
+    frame_info_t info;
+    const int size = build_v1(buf);
+
+    CHECK_EQ(frame_packet_parse(buf, size, &info, rects, INPUT_RECTS), 0);
+    CHECK_EQ(info.version, 1);
+    CHECK_EQ(info.seq, 7);
+    CHECK_EQ(info.flags, FRAME_FLAG_COMPLETE);
+    CHECK_EQ(info.rect_count, INPUT_RECTS - 1);
+    CHECK_EQ(info.size, size);
+    for (int i = 1; i < INPUT_RECTS; i++) {
+        // v1 carries no region
+        check_rect(&rects[i - 1], &input_rects[i], 0);
+    }
+}
+
+// Every prefix of a transfer parses as malformed or as fewer rects, never
+// reading past its end (the copy is exactly len bytes for a checking allocator)
+static void check_truncated(const uint8_t* buf, int size, int rect_count)
+{
+    frame_rect_info_t rects[INPUT_RECTS];
+    frame_info_t info;
+
+    for (int len = 0; len < size; len++) {
+        uint8_t* copy = (uint8_t*)malloc(len ? len : 1);
+        int ret;
+
+        memcpy(copy, buf, len);
+        ret = frame_packet_parse(copy, len, &info, rects, INPUT_RECTS);
+        CHECK(ret < 0 || (info.rect_count <= rect_count && info.size <= len));
+        free(copy);
+    }
+}
+
+static void test_truncated(void)
+{
+    uint8_t buf[BUF_SIZE];
+    frame_info_t info;
+    int size;
+
+    // v2 declares its length, any prefix is malformed
+    size = build_v2(buf);
+    check_truncated(buf, size, INPUT_RECTS);
+    for (int len = 0; len < size; len++) {
+        CHECK(frame_packet_parse(buf, len, &info, NULL, 0) < 0);
+    }
+
+    // v1 ends at the last whole packet when the NULL packet is cut off
+    size = build_v1(buf);
+    check_truncated(buf, size, INPUT_RECTS - 1);
+    CHECK(frame_packet_parse(buf, (int)sizeof(frame_v1_header_t) + 2, &info, NULL, 0) < 0);
+}
+
+static void test_bad_magic(void)
+{
+    uint8_t buf[BUF_SIZE];
+    frame_info_t info;
+    int size;
+
+    size = build_v2(buf);
+    buf[3] = 'x';
+    CHECK(frame_packet_parse(buf, size, &info, NULL, 0) < 0);
+
+    size = build_v1(buf);
+    buf[0] = 0;
+    CHECK(frame_packet_parse(buf, size, &info, NULL, 0) < 0);
+
+    // A later v1 packet with a broken magic fails the transfer
+    size = build_v1(buf);
+    buf[FRAME_PACKET_ALIGN * 2] ^= 0xff;
+    CHECK(frame_packet_parse(buf, size, &info, NULL, 0) < 0);
+
+    // v2 header smaller than this revision
+    size = build_v2(buf);
+    ((frame_v2_header_t*)buf)->header_size = sizeof(frame_v2_header_t) - 4;
+    CHECK(frame_packet_parse(buf, size, &info, NULL, 0) < 0);
+
+    CHECK(frame_packet_parse(NULL, 0, &info, NULL, 0) < 0);
+}
+
+int main(void)
+{
+    for (int i = 0; i < (int)sizeof(payload_b); i++) {
+        payload_b[i] = (uint8_t)(i * 7 + 1);
+    }
+
+    test_v2_round_trip();
+    test_v2_serializer_limits();
+    test_v1_parse();
+    test_truncated();
+    test_bad_magic();
+    printf("frame_packet: ok\n");
+    return 0;
+}
@@ -0,0 +1,297 @@
+#include <string.h>
+#include "test_util.h"
+#include "input.h"
+
+// Simulated DEV_FEATURE_INPUT device: builds DEV_MSG_INPUT payloads the way
+// the firmware does, the host side runs them through the same parse, counter
+// check and queue steps as usb_input_dispatch.
+
+typedef struct _sim_device {
+    uint32_t seq;
+    uint64_t clock_us;
+    uint8_t payload[sizeof(input_report_t) + INPUT_MAX_EVENTS * sizeof(input_event_t)];
+} sim_device_t;
+
+typedef struct _sim_host {
+    input_queue_t queue;
+    uint32_t seq;
+    int seq_valid;
+    uint64_t lost;
+    input_event_t injected[256];   // what the sink got, in order
+    int injected_count;
+} sim_host_t;
+
+static input_event_t make_event(int type, int contact, int flags, int x, int y)
+{
+    input_event_t event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = (uint8_t)type;
+    event.contact = (uint8_t)contact;
+    event.flags = (uint16_t)flags;
+    event.x = (uint16_t)x;
+    event.y = (uint16_t)y;
+    return event;
+}
+
+// Report of count events, returns the payload size
+static int device_report(sim_device_t* dev, input_event_t* events, int count)
+{
+    input_report_t report;
+
+    memset(&report, 0, sizeof(report));
+    report.count = (uint16_t)count;
+    report.seq = dev->seq++;
+    for (int i = 0; i < count; i++) {
+        events[i].device_us = dev->clock_us;
+        dev->clock_us += 1000;
+    }
+    memcpy(dev->payload, &report, sizeof(report));
+    memcpy(dev->payload + sizeof(report), events, count * sizeof(input_event_t));
+    return (int)(sizeof(report) + count * sizeof(input_event_t));
+}
+
+static void host_receive(sim_host_t* host, const uint8_t* payload, int size)
+{
+    input_event_t events[INPUT_MAX_EVENTS];
+    uint32_t seq;
+    const int count = input_parse(payload, size, events, INPUT_MAX_EVENTS, &seq);
+
+    CHECK(count >= 0);
+    if (host->seq_valid) {
+        host->lost += input_seq_lost(host->seq, seq);
+    }
+    host->seq = seq;
+    host->seq_valid = 1;
+    for (int i = 0; i < count; i++) {
+        input_queue_push(&host->queue, &events[i]);
+    }
+}
+
+static void host_drain(sim_host_t* host)
+{
+    input_event_t event;
+
+    while (input_queue_pop(&host->queue, &event)) {
+        CHECK(host->injected_count < (int)(sizeof(host->injected) / sizeof(host->injected[0])));
+        host->injected[host->injected_count++] = event;
+    }
+}
+
+static void test_parse(void)
+{
+    sim_device_t dev;
+    input_event_t events[3], parsed[INPUT_MAX_EVENTS];
+    uint32_t seq = 0;
+    int size;
+
+    memset(&dev, 0, sizeof(dev));
+    dev.seq = 77;
+    events[0] = make_event(INPUT_EVENT_TOUCH, 1, INPUT_FLAG_DOWN, 10, 20);
+    events[1] = make_event(INPUT_EVENT_TOUCH, 2, INPUT_FLAG_DOWN, 30, 40);
+    events[2] = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE | INPUT_FLAG_BUTTON_LEFT, 50, 60);
+    size = device_report(&dev, events, 3);
+
+    CHECK_EQ(input_parse(dev.payload, size, parsed, INPUT_MAX_EVENTS, &seq), 3);
+    CHECK_EQ(seq, 77);
+    CHECK(memcmp(parsed, events, sizeof(events)) == 0);
+
+    // Fewer slots than events: the first ones
+    CHECK_EQ(input_parse(dev.payload, size, parsed, 2, NULL), 2);
+    CHECK_EQ(parsed[1].contact, 2);
+
+    // Cut short, too many events, no header
+    CHECK_EQ(input_parse(dev.payload, size - 1, parsed, INPUT_MAX_EVENTS, NULL), -1);
+    ((input_report_t*)dev.payload)->count = INPUT_MAX_EVENTS + 1;
+    CHECK_EQ(input_parse(dev.payload, (int)sizeof(dev.payload), parsed, INPUT_MAX_EVENTS, NULL), -1);
+    CHECK_EQ(input_parse(dev.payload, (int)sizeof(input_report_t) - 1, parsed, INPUT_MAX_EVENTS, NULL), -1);
+    CHECK_EQ(input_parse(NULL, 0, parsed, INPUT_MAX_EVENTS, NULL), -1);
+
+    // An empty report only carries the counter
+    ((input_report_t*)dev.payload)->count = 0;
+    CHECK_EQ(input_parse(dev.payload, (int)sizeof(input_report_t), parsed, INPUT_MAX_EVENTS, NULL), 0);
+}
+
+static void test_seq(void)
+{
+    CHECK_EQ(input_seq_lost(10, 11), 0);
+    CHECK_EQ(input_seq_lost(10, 14), 3);
+    CHECK_EQ(input_seq_lost(0xffffffff, 0), 0);
+    CHECK_EQ(input_seq_lost(0xfffffffe, 1), 2);
+    // Device restart or a repeated report: resync, nothing lost
+    CHECK_EQ(input_seq_lost(5000, 0), 0);
+    CHECK_EQ(input_seq_lost(10, 10), 0);
+    CHECK_EQ(input_seq_lost(10, 9), 0);
+}
+
+// Two finger drag while the sink is slow: moves of a contact collapse to its
+// latest position, down and up of each contact stay in order
+static void test_drag_session(void)
+{
+    sim_device_t dev;
+    sim_host_t host;
+    input_event_t events[2];
+    int size, downs = 0, ups = 0;
+    int last_x[2] = { -1, -1 };
+
+    memset(&dev, 0, sizeof(dev));
+    memset(&host, 0, sizeof(host));
+    input_queue_reset(&host.queue);
+
+    events[0] = make_event(INPUT_EVENT_TOUCH, 0, INPUT_FLAG_DOWN, 100, 100);
+    events[1] = make_event(INPUT_EVENT_TOUCH, 1, INPUT_FLAG_DOWN, 200, 100);
+    size = device_report(&dev, events, 2);
+    host_receive(&host, dev.payload, size);
+
+    for (int step = 1; step <= 40; step++) {
+        events[0] = make_event(INPUT_EVENT_TOUCH, 0, INPUT_FLAG_MOVE, 100 + step, 100);
+        events[1] = make_event(INPUT_EVENT_TOUCH, 1, INPUT_FLAG_MOVE, 200 + step, 100);
+        size = device_report(&dev, events, 2);
+        host_receive(&host, dev.payload, size);
+        // The sink catches up every 8th report
+        if (step % 8 == 0) {
+            host_drain(&host);
+        }
+    }
+
+    events[0] = make_event(INPUT_EVENT_TOUCH, 0, INPUT_FLAG_UP, 140, 100);
+    events[1] = make_event(INPUT_EVENT_TOUCH, 1, INPUT_FLAG_UP, 240, 100);
+    size = device_report(&dev, events, 2);
+    host_receive(&host, dev.payload, size);
+    host_drain(&host);
+
+    CHECK_EQ(host.lost, 0);
+    CHECK_EQ(host.queue.dropped, 0);
+    CHECK(host.queue.coalesced > 0);
+    CHECK(host.injected_count < 2 + 80 + 2);
+
+    for (int i = 0; i < host.injected_count; i++) {
+        const input_event_t* event = &host.injected[i];
+        const int contact = event->contact;
+
+        CHECK(contact == 0 || contact == 1);
+        if (event->flags & INPUT_FLAG_DOWN) {
+            CHECK_EQ(last_x[contact], -1);
+            downs++;
+        } else if (event->flags & INPUT_FLAG_UP) {
+            CHECK_EQ(event->x, 140 + contact * 100);
+            ups++;
+        } else {
+            // Positions only move forward
+            CHECK(event->x > last_x[contact]);
+        }
+        CHECK(downs > 0);
+        last_x[contact] = event->x;
+    }
+    CHECK_EQ(downs, 2);
+    CHECK_EQ(ups, 2);
+    // Both contacts got their last position before lifting
+    CHECK_EQ(host.injected[host.injected_count - 4].x, 140);
+    CHECK_EQ(host.injected[host.injected_count - 3].x, 240);
+}
+
+// Coalescing keeps the sample time of the oldest move, that is the latency
+static void test_coalesce_keeps_sample_time(void)
+{
+    input_queue_t queue;
+    input_event_t event, out;
+
+    input_queue_reset(&queue);
+    event = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE, 1, 1);
+    event.device_us = 1000;
+    input_queue_push(&queue, &event);
+    event.x = 9;
+    event.device_us = 5000;
+    input_queue_push(&queue, &event);
+
+    CHECK_EQ(queue.count, 1);
+    CHECK_EQ(queue.coalesced, 1);
+    CHECK_EQ(input_queue_pop(&queue, &out), 1);
+    CHECK_EQ(out.x, 9);
+    CHECK_EQ(out.device_us, 1000);
+
+    // A button change in between is not merged across
+    event = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE, 1, 1);
+    input_queue_push(&queue, &event);
+    event = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE | INPUT_FLAG_BUTTON_LEFT, 2, 1);
+    input_queue_push(&queue, &event);
+    event = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE, 3, 1);
+    input_queue_push(&queue, &event);
+    CHECK_EQ(queue.count, 3);
+    CHECK_EQ(input_queue_pop(&queue, &out), 1);
+    CHECK_EQ(out.x, 1);
+}
+
+// No sink for a while (device started before the session): the oldest events
+// are dropped, the rest come out in order
+static void test_overflow(void)
+{
+    sim_device_t dev;
+    sim_host_t host;
+    input_event_t events[INPUT_MAX_EVENTS];
+    int size, total = 0;
+
+    memset(&dev, 0, sizeof(dev));
+    memset(&host, 0, sizeof(host));
+    input_queue_reset(&host.queue);
+
+    for (int report = 0; report < 4; report++) {
+        for (int i = 0; i < INPUT_MAX_EVENTS; i++) {
+            const int flags = (total % 2) ? INPUT_FLAG_UP : INPUT_FLAG_DOWN;
+            events[i] = make_event(INPUT_EVENT_TOUCH, total % 8, flags, total, 0);
+            total++;
+        }
+        size = device_report(&dev, events, INPUT_MAX_EVENTS);
+        host_receive(&host, dev.payload, size);
+    }
+    host_drain(&host);
+
+    CHECK_EQ(host.queue.dropped, total - INPUT_QUEUE_SIZE);
+    CHECK_EQ(host.injected_count, INPUT_QUEUE_SIZE);
+    for (int i = 0; i < host.injected_count; i++) {
+        CHECK_EQ(host.injected[i].x, total - INPUT_QUEUE_SIZE + i);
+    }
+}
+
+// Lost reports are counted, a device restart is not
+static void test_session_counter(void)
+{
+    sim_device_t dev;
+    sim_host_t host;
+    input_event_t event;
+    int size;
+
+    memset(&dev, 0, sizeof(dev));
+    memset(&host, 0, sizeof(host));
+    input_queue_reset(&host.queue);
+
+    for (int i = 0; i < 10; i++) {
+        event = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE, i, 0);
+        size = device_report(&dev, &event, 1);
+        // Reports 3 and 4 never arrive
+        if (i != 3 && i != 4) {
+            host_receive(&host, dev.payload, size);
+        }
+    }
+    CHECK_EQ(host.lost, 2);
+
+    dev.seq = 0;
+    for (int i = 0; i < 5; i++) {
+        event = make_event(INPUT_EVENT_POINTER, 0, INPUT_FLAG_MOVE, i, 0);
+        size = device_report(&dev, &event, 1);
+        host_receive(&host, dev.payload, size);
+    }
+    CHECK_EQ(host.lost, 2);
+}
+
+int main(void)
+{
+    test_parse();
+    test_seq();
+    test_drag_session();
+    test_coalesce_keeps_sample_time();
+    test_overflow();
+    test_session_counter();
+    printf("input: ok\n");
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <string.h>
+#include "test_util.h"
+#include "damage.h"
+#include "video.h"
+
+// Host side of the update path the way SwapChainProcessor::encode_frame runs
+// it: damage_update, coalescing held frames back with damage_merge, then
+// video_split under the rate cap. A mirror of the device keeps the tile hashes
+// it was sent, after a few frames without changes it must show the last frame.
+#define FRAME_W     256
+#define FRAME_H     128
+#define TILES_X     (FRAME_W / DAMAGE_TILE_SIZE)
+#define TILES_Y     (FRAME_H / DAMAGE_TILE_SIZE)
+#define TILES       (TILES_X * TILES_Y)
+#define REGION_ROW  1       // the video region: the first 4 tiles of this row
+
+typedef struct _sim {
+    uint32_t fb[FRAME_W * FRAME_H];
+    damage_map_t damage;
+    video_map_t video;
+    uint64_t device[TILES];     // tile hash the device shows
+    int deferred;
+} sim_t;
+
+static void sim_init(sim_t* sim)
+{
+    memset(sim, 0, sizeof(sim_t));
+    CHECK_EQ(damage_init(&sim->damage, FRAME_W, FRAME_H), 0);
+    CHECK_EQ(video_init(&sim->video, TILES), 0);
+}
+
+static void sim_exit(sim_t* sim)
+{
+    damage_exit(&sim->damage);
+    video_exit(&sim->video);
+}
+
+static void draw_region(sim_t* sim, uint32_t color)
+{
+    for (int y = REGION_ROW * DAMAGE_TILE_SIZE; y < (REGION_ROW + 1) * DAMAGE_TILE_SIZE; y++) {
+        for (int x = 0; x < VIDEO_MIN_TILES * DAMAGE_TILE_SIZE; x++) {
+            sim->fb[y * FRAME_W + x] = color;
+        }
+    }
+}
+
+// One captured frame; coalesce holds it back, due is the video rate cap
+static void sim_frame(sim_t* sim, int coalesce, int due)
+{
+    damage_update(&sim->damage, (const uint8_t*)sim->fb, FRAME_W * 4);
+    if (coalesce) {
+        damage_merge(&sim->damage, sim->damage.dirty);
+        return;
+    }
+    video_split(&sim->video, &sim->damage, due);
+    sim->deferred += sim->video.deferred;
+    for (int i = 0; i < TILES; i++) {
+        if (sim->damage.dirty[i] || sim->video.select[i]) {
+            sim->device[i] = sim->damage.hash[i];
+        }
+    }
+}
+
+static void check_device(const sim_t* sim)
+{
+    for (int i = 0; i < TILES; i++) {
+        CHECK_EQ(sim->device[i], sim->damage.hash[i]);
+    }
+}
+
+// Animate the region until it is classified as video
+static void play_video(sim_t* sim, int frames)
+{
+    for (int n = 1; n <= frames; n++) {
+        draw_region(sim, 0x10000u * n + 0x80);
+        sim_frame(sim, 0, 1);
+    }
+    CHECK(sim->video.video_tiles >= VIDEO_MIN_TILES);
+    check_device(sim);
+}
+
+// The last change is deferred, then the region stops changing
+static void test_deferred_then_static(void)
+{
+    sim_t sim;
+
+    sim_init(&sim);
+    play_video(&sim, VIDEO_HISTORY_FRAMES);
+    draw_region(&sim, 0xffffff);
+    sim_frame(&sim, 0, 0);
+    CHECK_EQ(sim.deferred, VIDEO_MIN_TILES);
+    for (int n = 0; n < 3; n++) {
+        sim_frame(&sim, 0, 1);
+    }
+    check_device(&sim);
+    sim_exit(&sim);
+}
+
+// The last change was coalesced, the frame carrying it is deferred and the
+// region does not change again: only the merged damage says it is dirty
+static void test_coalesced_then_deferred(void)
+{
+    sim_t sim;
+
+    sim_init(&sim);
+    play_video(&sim, VIDEO_HISTORY_FRAMES);
+    draw_region(&sim, 0xffffff);
+    sim_frame(&sim, 1, 1);
+    sim_frame(&sim, 0, 0);
+    CHECK_EQ(sim.deferred, VIDEO_MIN_TILES);
+    for (int n = 0; n < 3; n++) {
+        sim_frame(&sim, 0, 1);
+    }
+    check_device(&sim);
+    sim_exit(&sim);
+}
+
+// Deferred several frames in a row while it still changes
+static void test_deferred_run(void)
+{
+    sim_t sim;
+
+    sim_init(&sim);
+    play_video(&sim, VIDEO_HISTORY_FRAMES);
+    for (int n = 0; n < 5; n++) {
+        draw_region(&sim, 0xff00 + n);
+        sim_frame(&sim, 0, 0);
+    }
+    CHECK_EQ(sim.deferred, 5 * VIDEO_MIN_TILES);
+    sim_frame(&sim, 0, 1);
+    check_device(&sim);
+    sim_exit(&sim);
+}
+
+int main(void)
+{
+    test_deferred_then_static();
+    test_coalesced_then_deferred();
+    test_deferred_run();
+    printf("video: ok\n");
+    return 0;
+}